@@ -2,6 +2,7 @@
 -- psql -U collab collabDB
 -- psql> \i dbclean.sql
 DROP TABLE tracker;
+DROP FUNCTION project_lineage(integer);
 DROP TABLE forklist;
 DROP TABLE snapshots;
 DROP SEQUENCE snapshots_sid_seq;
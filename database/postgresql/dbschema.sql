@@ -77,12 +77,16 @@ CREATE TABLE updates (
    PRIMARY KEY (updateid,pid)
 );
 
+CREATE INDEX updates_pid_index ON updates(pid, updateid);
+
 CREATE SEQUENCE snapshots_sid_seq;
 
 CREATE TABLE forklist (
    fid SERIAL UNIQUE NOT NULL,
    child INTEGER REFERENCES projects(pid),
    parent INTEGER REFERENCES projects(pid), 
+   source INTEGER REFERENCES projects(pid), --forks share the updates of source rather than copying them
+   forkupdateid BIGINT,                     --the last update of source that belongs to child
    PRIMARY KEY(fid)
 );
 --tracker is no longer required, since the last update is stored in the idb
@@ -101,6 +105,16 @@ BEGIN
 END;
 $$ LANGUAGE plpgsql;
 
+--the projects whose updates make up the history of lpid, each with the last of its updates that belongs to lpid
+CREATE OR REPLACE FUNCTION project_lineage(lpid integer) RETURNS TABLE (pid integer, maxid bigint) AS $$
+   WITH RECURSIVE chain(pid, maxid) AS (
+      SELECT lpid, 9223372036854775807::bigint
+      UNION ALL
+      SELECT f.source, least(f.forkupdateid, c.maxid) FROM forklist f JOIN chain c ON f.child = c.pid WHERE f.source IS NOT NULL
+   )
+   SELECT c.pid, c.maxid FROM chain c;
+$$ LANGUAGE sql STABLE;
+
 CREATE OR REPLACE FUNCTION fork_project(oldpid integer) RETURNS integer AS $$
 DECLARE
     projects_row projects%ROWTYPE;
@@ -0,0 +1,20 @@
+-- one time migration for databases created by earlier servers, something like:
+-- psql -U collab collabDB
+-- psql> \i fork_lineage.sql
+
+-- forks no longer copy the updates of the project they fork from, they record
+-- where they forked instead and catch up reads through the chain of sources.
+-- forks made before this migration keep their copies and have no source.
+ALTER TABLE forklist ADD COLUMN source INTEGER REFERENCES projects(pid);
+ALTER TABLE forklist ADD COLUMN forkupdateid BIGINT;
+
+CREATE INDEX updates_pid_index ON updates(pid, updateid);
+
+CREATE OR REPLACE FUNCTION project_lineage(lpid integer) RETURNS TABLE (pid integer, maxid bigint) AS $$
+   WITH RECURSIVE chain(pid, maxid) AS (
+      SELECT lpid, 9223372036854775807::bigint
+      UNION ALL
+      SELECT f.source, least(f.forkupdateid, c.maxid) FROM forklist f JOIN chain c ON f.child = c.pid WHERE f.source IS NOT NULL
+   )
+   SELECT c.pid, c.maxid FROM chain c;
+$$ LANGUAGE sql STABLE;
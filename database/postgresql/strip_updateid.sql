@@ -0,0 +1,8 @@
+-- one time migration for databases created by earlier servers, something like:
+-- psql -U collab collabDB
+-- psql> \i strip_updateid.sql
+
+-- updates are now stored without an updateid key, the server splices the
+-- updateid onto the stored text when an update is sent. Rows that still carry
+-- one are parsed and rewritten on every catch up until they are migrated.
+UPDATE updates SET json = (json::jsonb - 'updateid')::text WHERE json LIKE '%"updateid"%';
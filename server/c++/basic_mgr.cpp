@@ -77,11 +77,8 @@ int BasicConnectionManager::authenticate(Client *c, const char *user, const uint
  * @param cmd the 'command' that was performed (comment, rename, etc)
  * @param data the 'data' portion of the command (the comment text, etc)
  */
-void BasicConnectionManager::post(Client *src, const char * cmd, json_object *obj) {
-   sem_wait(&queueMutex);
-   queue.push_back(new Packet(src, cmd, obj, 0));   //add a new packet with the binary data to the queue
-   sem_post(&queueMutex);
-   sem_post(&queueSem);  //notify is the compliment to wait
+void BasicConnectionManager::post(Client *src, const char * cmd, uint16_t cmdId, json_object *obj) {
+   enqueue(new Packet(src, cmd, cmdId, obj, 0));   //add a new packet with the binary data to the queue
 }
 
 /**
@@ -92,8 +89,9 @@ void BasicConnectionManager::post(Client *src, const char * cmd, json_object *ob
  * @param c the client requesting updates 
  * @param lastUpdate the last update the client received 
  */
-void BasicConnectionManager::sendLatestUpdates(Client *c, uint64_t lastUpdate) {
+bool BasicConnectionManager::sendLatestUpdates(Client *c, uint64_t lastUpdate) {
    c->send_error("Server is in basic mode, updates to date are not stored");
+   return false;
 }
 
 /**
@@ -124,21 +122,20 @@ ProjectInfo *BasicConnectionManager::getProjectInfo(int pid) {
  * @return a vector of project info objects for the provided phash
  */
 vector<ProjectInfo*> *BasicConnectionManager::getProjectList(const string &phash) {
-   vector<ProjectInfo*> *plist;
-   //build a basic mode project list
+   //build a basic mode project list, the caller deletes the list and its
+   //contents so hand back copies rather than our own project records
+   vector<ProjectInfo*> *plist = new vector<ProjectInfo*>;
+   sem_wait(&pidLock);
    Basic_it bi = basicProjects.find(phash);
    if (bi != basicProjects.end()) {
-      plist = (*bi).second;
-   }
-   else {
-      plist = new vector<ProjectInfo*>;
-   }
-   for (Info_it it = plist->begin(); it != plist->end(); it++) {
-      ClientSet *cs = projects.get((*it)->lpid);
-      if (cs != NULL) {
-         (*it)->connected = cs->size();
+      vector<ProjectInfo*> *vpi = (*bi).second;
+      for (Info_it it = vpi->begin(); it != vpi->end(); it++) {
+         ProjectInfo *pi = new ProjectInfo(**it);
+         pi->connected = projects.numClients(pi->lpid);
+         plist->push_back(pi);
       }
    }
+   sem_post(&pidLock);
    return plist;
 }
 
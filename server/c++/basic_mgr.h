@@ -77,7 +77,7 @@ public:
     * @param cmd the 'command' that was performed (comment, rename, etc)
     * @param data the 'data' portion of the command (the comment text, etc)
     */
-   void post(Client *src, const char *cmd, json_object *obj);
+   void post(Client *src, const char *cmd, uint16_t cmdId, json_object *obj);
 
    /**
     * sendLatestUpdates sends updates from LastUpdate to current 
@@ -86,8 +86,10 @@ public:
     * this function is typically called when a user is re-joining a project that they had previously worked on
     * @param c the client requesting updates 
     * @param lastUpdate the last update the client received 
+    * @return true if a full chunk was sent and more updates may follow it, in which
+    *         case the caller continues from the last update queued to the client
     */
-   void sendLatestUpdates(Client *c, uint64_t lastUpdate);
+   bool sendLatestUpdates(Client *c, uint64_t lastUpdate);
 
    /**
     * getProjectInfo gets information related to a local project
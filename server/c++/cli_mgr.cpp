@@ -20,7 +20,9 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
 #include <arpa/inet.h>
+#include <algorithm>
 
 #include "utils.h"
 #include "client.h"
@@ -28,13 +30,186 @@
 #include "cli_mgr.h"
 #include "projectmap.h"
 #include "clientset.h"
+#include "reactor.h"
+#include "uring.h"
+#include "epoch.h"
+#include "control_pool.h"
 
-Packet::Packet(Client *src, const char *cmd, json_object *obj, uint64_t updateid) {
-   c = src;
+//the most packets a dispatcher takes from its shard at once
+#define DISPATCH_BATCH 256
+
+//free packets kept by each thread, half of them move to or from the shared free list at a time
+#define PACKET_CACHE 256
+
+/*
+ * Packets are made by the threads that read from clients and by the update
+ * writer, and destroyed by the dispatchers, so a burst of updates would
+ * otherwise be a burst of malloc and free calls contending across threads.
+ * Each thread keeps its own free list instead. A thread that frees more than
+ * PACKET_CACHE packets hands half of them to a shared free list, and a
+ * thread that runs out takes up to half as many back from it under a single
+ * lock, so only one packet in PACKET_CACHE / 2 touches shared state.
+ */
+struct PacketCache {
+   void *head;        //free packets, linked through their first word
+   uint32_t count;
+};
+
+static __thread PacketCache *packetCache = NULL;
+static pthread_key_t packetKey;
+static pthread_once_t packetKeyOnce = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t sharedLock = PTHREAD_MUTEX_INITIALIZER;   //guards the shared list and its counters
+static void *sharedHead = NULL;
+static uint32_t sharedCount = 0;
+static uint64_t refills = 0;    //batches taken from the shared list
+static uint64_t spills = 0;     //batches handed to it
+static volatile uint64_t packetsMade = 0;
+static volatile uint64_t packetsFresh = 0;   //those that needed a malloc
+
+/**
+ * spill moves count packets from the front of a thread's free list to the shared one
+ */
+static void spill(PacketCache *pc, uint32_t count) {
+   if (count == 0) {
+      return;
+   }
+   void *first = pc->head;
+   void *last = first;
+   for (uint32_t i = 1; i < count; i++) {
+      last = *(void**)last;
+   }
+   pc->head = *(void**)last;
+   pc->count -= count;
+   pthread_mutex_lock(&sharedLock);
+   *(void**)last = sharedHead;
+   sharedHead = first;
+   sharedCount += count;
+   spills++;
+   pthread_mutex_unlock(&sharedLock);
+}
+
+/**
+ * refill moves up to half a cache of packets from the shared free list to a thread's
+ */
+static void refill(PacketCache *pc) {
+   pthread_mutex_lock(&sharedLock);
+   if (sharedHead != NULL) {
+      uint32_t n = 0;
+      while (sharedHead != NULL && n < PACKET_CACHE / 2) {
+         void *p = sharedHead;
+         sharedHead = *(void**)p;
+         *(void**)p = pc->head;
+         pc->head = p;
+         n++;
+      }
+      sharedCount -= n;
+      pc->count += n;
+      refills++;
+   }
+   pthread_mutex_unlock(&sharedLock);
+}
+
+//hands the free list of an exiting thread to the shared one
+static void releaseCache(void *arg) {
+   PacketCache *pc = (PacketCache*)arg;
+   spill(pc, pc->count);
+   delete pc;
+}
+
+static void makePacketKey() {
+   pthread_key_create(&packetKey, releaseCache);
+}
+
+static PacketCache *thisCache() {
+   if (packetCache == NULL) {
+      pthread_once(&packetKeyOnce, makePacketKey);
+      packetCache = new PacketCache;
+      packetCache->head = NULL;
+      packetCache->count = 0;
+      pthread_setspecific(packetKey, packetCache);
+   }
+   return packetCache;
+}
+
+void *Packet::operator new(size_t size) {
+   PacketCache *pc = thisCache();
+   __sync_add_and_fetch(&packetsMade, 1);
+   if (pc->head == NULL) {
+      refill(pc);
+   }
+   if (pc->head == NULL) {
+      __sync_add_and_fetch(&packetsFresh, 1);
+      return ::operator new(size);
+   }
+   void *p = pc->head;
+   pc->head = *(void**)p;
+   pc->count--;
+   return p;
+}
+
+void Packet::operator delete(void *p) {
+   PacketCache *pc = thisCache();
+   *(void**)p = pc->head;
+   pc->head = p;
+   if (++pc->count > PACKET_CACHE) {
+      spill(pc, PACKET_CACHE / 2);
+   }
+}
+
+string Packet::poolStats() {
+   char buf[256];
+   pthread_mutex_lock(&sharedLock);
+   snprintf(buf, sizeof(buf), "Packets: %" PRIu64 " made, %" PRIu64 " needed a malloc, %" PRIu64 " refills from and %" PRIu64 " spills to the shared free list, which holds %u\n",
+            packetsMade, packetsFresh, refills, spills, sharedCount);
+   pthread_mutex_unlock(&sharedLock);
+   return buf;
+}
+
+Packet::Packet(Client *src, const char *cmd, uint16_t cmdId, json_object *obj, uint64_t updateid) {
+   c = src->ref();
+   refs = 1;
+   this->cmd = cmd;
+   this->cmdId = cmdId;
+   this->obj = obj;
+   uid = updateid;
+   pid = src->getPid();
+   next = NULL;
+   size_t jlen;
+   const char *json = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &jlen);
+   wire = new EncodedPacket(json, jlen, updateid);
+   framed = NULL;
+}
+
+Packet::Packet(Client *src, int pid, const char *cmd, uint16_t cmdId, json_object *obj, uint64_t updateid, const char *json, uint32_t jlen) {
+   c = src != NULL ? src->ref() : NULL;
+   refs = 1;
    this->cmd = cmd;
+   this->cmdId = cmdId;
    this->obj = obj;
    uid = updateid;
-   append_json_uint64_val(obj, "updateid", updateid);   //is this really necessary?
+   this->pid = pid;
+   next = NULL;
+   wire = new EncodedPacket(json, jlen, updateid);
+   framed = NULL;
+}
+
+Packet::~Packet() {
+   if (c != NULL) {
+      c->release();
+   }
+   wire->release();
+   if (framed != NULL) {
+      framed->release();
+   }
+   json_object_put(obj);
+}
+
+EncodedPacket *Packet::frame() {
+   if (framed == NULL) {
+      framed = EncodedPacket::fromFrame(obj, uid);
+   }
+   return framed;
 }
 
 /**
@@ -47,16 +222,180 @@ ConnectionManagerBase::ConnectionManagerBase(json_object *conf, bool mode) {
    basicMode = mode;
    done = false;
    sem_init(&pidLock, 0, 1);
-   sem_init(&queueSem, 0, 0);
-   sem_init(&queueMutex, 0, 1);
+
+   int nshards = getIntOption(conf, "DISPATCH_THREADS", 4);
+   if (nshards < 1) {
+      nshards = 1;
+   }
+   for (int i = 0; i < nshards; i++) {
+      DispatchShard *ds = new DispatchShard;
+      ds->mgr = this;
+      pthread_mutex_init(&ds->lock, NULL);
+      sem_init(&ds->ready, 0, 0);
+      ds->head = ds->tail = NULL;
+      shards.push_back(ds);
+   }
+
+   string model = getStringOption(conf, "IO_MODEL", "threads");
+   bool uring = model == "uring";
+   if (uring && !Uring::supported()) {
+      fprintf(stderr, "io_uring is not available, using epoll\n");
+      uring = false;
+      model = "epoll";
+   }
+   polledMode = uring || model == "epoll";
+   if (!polledMode && model != "threads") {
+      fprintf(stderr, "Unknown IO_MODEL %s, using threads\n", model.c_str());
+      model = "threads";
+   }
+   int nthreads = getIntOption(conf, "IO_THREADS", 1);
+   fprintf(stderr, "Using %s I/O model with %d I/O threads\n", model.c_str(), nthreads);
+   reactor = new Reactor(nthreads, uring);
+
+   int controlThreads = getIntOption(conf, "CONTROL_THREADS", 4);
+   //resync chunks wait on the database as well, and a Reactor loop must not, so they always get a worker
+   inlineControl = controlThreads <= 0;
+   control = new ControlPool(inlineControl ? 1 : controlThreads);
+
+   queueHighWater = getIntOption(conf, "CLIENT_QUEUE_HWM", 4 * 1024 * 1024);
+   string policy = getStringOption(conf, "CLIENT_QUEUE_OVERFLOW", "resync");
+   overflowResync = policy != "disconnect";
+   if (overflowResync && policy != "resync") {
+      fprintf(stderr, "Unknown CLIENT_QUEUE_OVERFLOW %s, using resync\n", policy.c_str());
+   }
+
+   maxMessage = getIntOption(conf, "MAX_MESSAGE_SIZE", 16 * 1024 * 1024);
+   maxJsonDepth = getIntOption(conf, "MAX_JSON_DEPTH", JSON_TOKENER_DEFAULT_DEPTH);
+   tcpNoDelay = getIntOption(conf, "TCP_NODELAY", 1) != 0;
+   tcpCork = getIntOption(conf, "TCP_CORK", 0) != 0;
+   compressionLevel = getIntOption(conf, "COMPRESSION_LEVEL", Z_DEFAULT_COMPRESSION);
+   if (compressionLevel < -1 || compressionLevel > Z_BEST_COMPRESSION) {
+      fprintf(stderr, "Invalid COMPRESSION_LEVEL %d, using default\n", compressionLevel);
+      compressionLevel = Z_DEFAULT_COMPRESSION;
+   }
+
+   heartbeatInterval = getIntOption(conf, "HEARTBEAT_INTERVAL", 30);
+   int heartbeatTimeout = getIntOption(conf, "HEARTBEAT_TIMEOUT", 90);
+   if (heartbeatInterval > 0 && !polledMode) {
+      //only a polled Reactor loop keeps the timer wheel that sends them
+      fprintf(stderr, "Heartbeats need IO_MODEL epoll or uring, disabling them\n");
+      heartbeatInterval = 0;
+   }
+   if (heartbeatInterval < 0) {
+      heartbeatInterval = 0;
+   }
+   if (heartbeatTimeout <= heartbeatInterval) {
+      fprintf(stderr, "HEARTBEAT_TIMEOUT must be longer than HEARTBEAT_INTERVAL, using %d\n", heartbeatInterval * 3);
+      heartbeatTimeout = heartbeatInterval * 3;
+   }
+   reactor->setHeartbeat(heartbeatInterval * 1000, heartbeatTimeout * 1000);
+   keepAliveIdle = getIntOption(conf, "TCP_KEEPALIVE_IDLE", 60);
+   keepAliveInterval = getIntOption(conf, "TCP_KEEPALIVE_INTERVAL", 10);
+   keepAliveCount = getIntOption(conf, "TCP_KEEPALIVE_COUNT", 6);
+
+   pthread_mutex_init(&backlogLock, NULL);
+   publishRate = getIntOption(conf, "PUBLISH_RATE", 0);
+   publishBurst = getIntOption(conf, "PUBLISH_BURST", 1000);
+   if (publishBurst < 1) {
+      publishBurst = 1;
+   }
+   backlogHigh = getIntOption(conf, "PROJECT_BACKLOG_HWM", 10000);
+   backlogLow = getIntOption(conf, "PROJECT_BACKLOG_LWM", backlogHigh / 2);
+   if (backlogLow >= backlogHigh) {
+      backlogLow = backlogHigh / 2;
+   }
 }
 
 void ConnectionManagerBase::start() {
+   reactor->start();
+   control->start();
    pthread_attr_t attr;
    pthread_attr_init(&attr);
    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-   pthread_t tid;
-   pthread_create(&tid, &attr, run, (void*)this);
+   for (vector<DispatchShard*>::iterator i = shards.begin(); i != shards.end(); i++) {
+      pthread_t tid;
+      pthread_create(&tid, &attr, run, (void*)*i);
+   }
+   pthread_attr_destroy(&attr);
+}
+
+/**
+ * enqueue hands a packet to the dispatch shard that owns its project.
+ * Packets for the same project are always dispatched in the order they
+ * were enqueued, packets for different projects may be dispatched in parallel.
+ * @param p the packet to dispatch, ownership passes to the dispatcher
+ */
+void ConnectionManagerBase::enqueue(Packet *p) {
+   DispatchShard *ds = shards[(unsigned int)p->pid % shards.size()];
+   p->next = NULL;
+   pthread_mutex_lock(&ds->lock);
+   if (ds->tail == NULL) {
+      ds->head = p;
+   }
+   else {
+      ds->tail->next = p;
+   }
+   ds->tail = p;
+   pthread_mutex_unlock(&ds->lock);
+   sem_post(&ds->ready);
+}
+
+/**
+ * admit counts an update about to be posted by a client against the dispatch
+ * backlog of its project, pausing reading from the client while the backlog
+ * is at or above PROJECT_BACKLOG_HWM
+ * @param c the publishing client
+ */
+void ConnectionManagerBase::admit(Client *c) {
+   if (backlogHigh == 0) {
+      return;
+   }
+   pthread_mutex_lock(&backlogLock);
+   ProjectBacklog &b = backlogs[c->getPid()];
+   b.pending++;
+   if (b.pending > b.peak) {
+      b.peak = b.pending;
+   }
+   if (b.pending >= backlogHigh) {
+      if (!b.paused) {
+         b.paused = true;
+         b.pauses++;
+      }
+      //paused while holding backlogLock so that retire can not miss it, and
+      //resumed by this project even if the client has since moved on
+      if (c->pause(PAUSE_BACKLOG)) {
+         b.publishers.push_back(c->ref());
+      }
+   }
+   pthread_mutex_unlock(&backlogLock);
+}
+
+/**
+ * retire releases the backlog held by updates that have been dispatched or
+ * dropped, resuming the project's publishers once it falls to PROJECT_BACKLOG_LWM
+ * @param pid the project the updates were admitted to
+ * @param count the number of updates
+ */
+void ConnectionManagerBase::retire(int pid, uint32_t count) {
+   if (backlogHigh == 0) {
+      return;
+   }
+   vector<Client*> publishers;
+   pthread_mutex_lock(&backlogLock);
+   map<int,ProjectBacklog>::iterator i = backlogs.find(pid);
+   if (i != backlogs.end()) {
+      ProjectBacklog &b = i->second;
+      b.pending -= count < b.pending ? count : b.pending;
+      if (b.paused && b.pending <= backlogLow) {
+         b.paused = false;
+         publishers.swap(b.publishers);
+      }
+   }
+   pthread_mutex_unlock(&backlogLock);
+   for (vector<Client*>::iterator c = publishers.begin(); c != publishers.end(); c++) {
+      (*c)->resume(PAUSE_BACKLOG);
+      (*c)->release();
+   }
 }
 
 static bool termClients(Client *c, void *user) {
@@ -100,8 +439,26 @@ void ConnectionManagerBase::terminate() {
  * @param s the socket to create new client for
  */
 void ConnectionManagerBase::add(NetworkIO *s) {
+   s->setLimits(maxMessage, maxJsonDepth);
+   s->setTcpOptions(tcpNoDelay, tcpCork);
+   s->setKeepAlive(keepAliveIdle, keepAliveInterval, keepAliveCount);
    Client *c = new Client(this, s, basicMode);
-   c->start();
+   if (!polledMode) {
+      c->start();
+   }
+   else if (!reactor->add(c)) {
+      reactor->release(c);
+   }
+}
+
+/**
+ * release disposes of a client whose connection has ended. The Reactor
+ * drops the connection's reference once it no longer uses the client, which
+ * is destroyed when any packets it originated have also been dispatched.
+ * @param c the client to release
+ */
+void ConnectionManagerBase::release(Client *c) {
+   reactor->release(c);
 }
 
 /**
@@ -131,48 +488,97 @@ string ConnectionManagerBase::dumpStats() {
    else {
       sb = "Stats:\n" + sb;
    }
-   return sb;
+   pthread_mutex_lock(&backlogLock);
+   for (map<int,ProjectBacklog>::iterator i = backlogs.begin(); i != backlogs.end(); i++) {
+      char line[128];
+      snprintf(line, sizeof(line), "project %d dispatch backlog %u, peak %u, publishers paused %u times\n",
+               i->first, i->second.pending, i->second.peak, i->second.pauses);
+      sb += line;
+   }
+   pthread_mutex_unlock(&backlogLock);
+   char line[64];
+   snprintf(line, sizeof(line), "%u retired objects awaiting reclamation\n", Epoch::pending());
+   sb += line;
+   sb += Packet::poolStats();
+   sb += control->stats();
+   return sb + reactor->dumpStats() + backendStats();
 }
 
 static bool dispatch(Client *c, void *user) {
    Packet *p = (Packet*)user;
 
    if (c != p->c) {  //only send to other than originator
-      //increment ref count on json object before sending
-      //because writeJson will decrement it and we can't have the object
-      //garbage collected until all clients have received it
-      json_object_get(p->obj);
-      c->post(p->cmd, p->obj);
+      //every recipient shares the packet's single encoding in its own format
+      c->post(p->cmdId, c->isFramed() ? p->frame() : p->wire, p->uid, p->pid);
    }
    else {
       //send updateid back to the originator
-      json_object *obj = json_object_new_object();
-      append_json_uint64_val(obj, "updateid", p->uid);
-      c->send_data(MSG_ACK_UPDATEID, obj);
+      c->ack(p->uid);
    }
 
    return true;
 }
 
+static bool flushClient(Client *c, void *user) {
+   c->flush();
+   return true;
+}
+
 /**
- * run perpetually waits to be notified that a new packet has been queued, then
- * sends this packet to other clients according to permissions and project subscription
- * this also sends the server created unique updateID back to the originator of the packet
+ * run perpetually waits to be notified that new packets have been queued on its
+ * shard, then sends them to other clients according to permissions and
+ * project subscription. this also sends the server created unique updateID back
+ * to the originator of each packet. Packets that queue up while a batch is being
+ * dispatched form the next batch, and each client's share of a batch is written
+ * with as few system calls as possible once the whole batch has been queued.
  */
 void *ConnectionManagerBase::run(void *arg) {
-   ConnectionManagerBase *mgr = (ConnectionManagerBase*)arg;
+   DispatchShard *ds = (DispatchShard*)arg;
+   ConnectionManagerBase *mgr = ds->mgr;
+   vector<int> pids;
+   vector<uint32_t> counts;   //packets dispatched for each of pids
    while (!mgr->done) {
-      sem_wait(&mgr->queueSem);
-      sem_wait(&mgr->queueMutex);
-      Packet *p = mgr->queue[0];
-      //*** does add/remove need to be synchronized on vectors?
-      mgr->queue.erase(mgr->queue.begin());
-      sem_post(&mgr->queueMutex);
-      //get the project associated with this notification
-      mgr->projects.loopProject(p->c->getPid(), dispatch, p);
-      json_object_put(p->obj);
-      delete p;
+      sem_wait(&ds->ready);
+      pthread_mutex_lock(&ds->lock);
+      Packet *batch = ds->head;
+      Packet *last = batch;
+      for (int n = 1; n < DISPATCH_BATCH && last->next != NULL; n++) {
+         last = last->next;
+      }
+      ds->head = last->next;
+      if (ds->head == NULL) {
+         ds->tail = NULL;
+      }
+      last->next = NULL;
+      pthread_mutex_unlock(&ds->lock);
+      for (Packet *p = batch->next; p != NULL; p = p->next) {
+         //ready counted these packets too, a post may be a moment behind its enqueue
+         sem_wait(&ds->ready);
+      }
+      pids.clear();
+      counts.clear();
+      mgr->reactor->beginBatch();
+      for (Packet *p = batch; p != NULL; p = batch) {
+         batch = p->next;
+         //get the project associated with this notification
+         mgr->projects.loopProject(p->pid, dispatch, p);
+         vector<int>::iterator pi = find(pids.begin(), pids.end(), p->pid);
+         if (pi == pids.end()) {
+            pids.push_back(p->pid);
+            counts.push_back(1);
+         }
+         else {
+            counts[pi - pids.begin()]++;
+         }
+         p->release();
+      }
+      for (unsigned int i = 0; i < pids.size(); i++) {
+         mgr->projects.loopProject(pids[i], flushClient, NULL);
+         mgr->retire(pids[i], counts[i]);
+      }
+      mgr->reactor->endBatch();
    }
+   return NULL;
 }
 
 static bool clientList(Client *c, void *user) {
@@ -27,6 +27,7 @@
 #include <string>
 #include <stdint.h>
 #include <sys/types.h>
+#include <pthread.h>
 #include <semaphore.h>
 #include <json-c/json.h>
 
@@ -36,21 +37,92 @@ using namespace std;
 
 class ProjectInfo;
 class NetworkIO;
+class Reactor;
+class ControlPool;
 
 typedef set<Client*>::iterator Client_it;
 typedef map<int,set<Client*>*>::iterator Projects_it;
 
 /**
  * Packet is a helper class to represent a tuple pairing a client
- * with a command posted by that client
+ * with a command posted by that client. The wire image of the update,
+ * including its updateid, is encoded once and shared by every recipient.
+ * The framed image for clients using binary frames is made by the first
+ * such recipient. A packet holds a reference to its originator, so that
+ * the originator can not be destroyed, and its address reused by a new
+ * client, while the packet is still being dispatched.
  */
 class Packet {
 public:
-   Client *c;
-   const char *cmd;
+   Client *c;          //a referenced originator, or NULL
+   const char *cmd;    //points into obj
+   uint16_t cmdId;     //id of cmd, see frameCommandId
    json_object *obj;
    uint64_t uid;
-   Packet(Client *src, const char *cmd, json_object *obj, uint64_t updateid);
+   int pid;            //the originator's project at the time of the post
+   EncodedPacket *wire;
+   EncodedPacket *framed;   //NULL until frame is first called
+   Packet *next;       //link in a dispatch shard's queue
+
+   /**
+    * @param src the client that posted the update
+    * @param cmd the command of the update
+    * @param cmdId the id of cmd
+    * @param obj the update, ownership passes to the Packet
+    * @param updateid the id assigned to the update
+    */
+   Packet(Client *src, const char *cmd, uint16_t cmdId, json_object *obj, uint64_t updateid);
+
+   /**
+    * as above, for an update that was stored after the fact, reusing a
+    * serialization of obj that has already been made
+    * @param pid the originator's project when the update was posted
+    * @param json obj serialized without an updateid
+    * @param jlen the length of json
+    */
+   Packet(Client *src, int pid, const char *cmd, uint16_t cmdId, json_object *obj, uint64_t updateid, const char *json, uint32_t jlen);
+
+   /**
+    * ref adds a reference to this packet
+    * @return this packet
+    */
+   Packet *ref() {
+      __sync_add_and_fetch(&refs, 1);
+      return this;
+   }
+
+   /**
+    * release drops a reference, deleting the packet when none remain
+    */
+   void release() {
+      if (__sync_sub_and_fetch(&refs, 1) == 0) {
+         delete this;
+      }
+   }
+
+   /**
+    * frame gets the update encoded as a binary frame, only the dispatcher
+    * that owns the packet may call this
+    * @return the framed image, still owned by the packet
+    */
+   EncodedPacket *frame();
+
+   /**
+    * packets come from a free list kept by each thread, see cli_mgr.cpp
+    */
+   static void *operator new(size_t size);
+   static void operator delete(void *p);
+
+   /**
+    * poolStats reports how packet allocations were satisfied
+    * @return a printable summary
+    */
+   static string poolStats();
+
+private:
+   ~Packet();
+
+   volatile int refs;
 };
 
 
@@ -62,12 +134,39 @@ public:
    bool done;
 
 protected:
-   vector<Packet*> queue;
    sem_t pidLock;
-   
-   //counting semephore for incoming packets from the server
-   sem_t queueSem;
-   sem_t queueMutex;
+
+private:
+   /**
+    * DispatchShard is a FIFO of packets, linked through Packet::next, along
+    * with the thread that drains it
+    */
+   struct DispatchShard {
+      ConnectionManagerBase *mgr;
+      pthread_mutex_t lock;   //guards head and tail
+      sem_t ready;            //counts queued packets
+      Packet *head;
+      Packet *tail;
+   };
+
+   vector<DispatchShard*> shards;   //DISPATCH_THREADS shards, selected by lpid
+
+   /**
+    * ProjectBacklog counts the updates of a project that have been posted but
+    * not yet dispatched
+    */
+   struct ProjectBacklog {
+      uint32_t pending;
+      uint32_t peak;
+      bool paused;       //publishers stop reading until pending falls to the low-water mark
+      uint32_t pauses;
+      vector<Client*> publishers;   //referenced, paused here until pending falls, wherever they are now
+
+      ProjectBacklog() : pending(0), peak(0), paused(false), pauses(0) {}
+   };
+
+   pthread_mutex_t backlogLock;       //guards backlogs
+   map<int,ProjectBacklog> backlogs;
 
 public:
    ConnectionManagerBase(json_object *conf, bool mode);
@@ -79,6 +178,109 @@ public:
     */
    void add(NetworkIO *s);
 
+   /**
+    * release disposes of a client whose connection has ended. The client is
+    * deleted by the Reactor once it no longer holds any reference to it.
+    * @param c the client to release
+    */
+   void release(Client *c);
+
+   /**
+    * getReactor inspector to get the Reactor that services client sockets
+    * @return the reactor
+    */
+   Reactor *getReactor() {
+      return reactor;
+   }
+
+   /**
+    * getControlPool inspector to get the pool that handles control messages
+    * @return the pool, or NULL if control messages are handled as they are read
+    */
+   ControlPool *getControlPool() {
+      return inlineControl ? NULL : control;
+   }
+
+   /**
+    * getResyncPool inspector to get the pool that replays resync chunks
+    * @return the pool, which exists even when control messages are handled as they are read
+    */
+   ControlPool *getResyncPool() {
+      return control;
+   }
+
+   /**
+    * getQueueHighWater inspector to get the per-client outbound queue limit
+    * @return the limit in bytes
+    */
+   uint32_t getQueueHighWater() {
+      return queueHighWater;
+   }
+
+   /**
+    * resyncOnOverflow inspector to get the outbound queue overflow policy
+    * @return true if overflowing clients are resynced, false if they are disconnected
+    */
+   bool resyncOnOverflow() {
+      return overflowResync;
+   }
+
+   /**
+    * getCompressionLevel inspector to get the zlib level for clients that ask for compression
+    * @return the level, 0 if compression is disabled
+    */
+   int getCompressionLevel() {
+      return compressionLevel;
+   }
+
+   /**
+    * getHeartbeatInterval inspector to get how long a client that asked for heartbeats may be quiet before it is pinged
+    * @return the interval in seconds, 0 if heartbeats are disabled, as they always are with IO_MODEL threads
+    */
+   int getHeartbeatInterval() {
+      return heartbeatInterval;
+   }
+
+   /**
+    * getPublishRate inspector to get the number of updates per second a client may publish
+    * @return the rate, 0 if unlimited
+    */
+   uint32_t getPublishRate() {
+      return publishRate;
+   }
+
+   /**
+    * getPublishBurst inspector to get the number of updates a client may publish at once
+    * @return the burst size, which may exceed PUBLISH_RATE
+    */
+   uint32_t getPublishBurst() {
+      return publishBurst;
+   }
+
+   /**
+    * admit counts an update about to be posted by a client against the dispatch
+    * backlog of its project, pausing reading from the client while the backlog
+    * is at or above PROJECT_BACKLOG_HWM
+    * @param c the publishing client
+    */
+   void admit(Client *c);
+
+   /**
+    * retire releases the backlog held by updates that have been dispatched or
+    * dropped, resuming the project's publishers once it falls to PROJECT_BACKLOG_LWM
+    * @param pid the project the updates were admitted to
+    * @param count the number of updates
+    */
+   void retire(int pid, uint32_t count = 1);
+
+   /**
+    * enqueue hands a packet to the dispatch shard that owns its project.
+    * Packets for the same project are always dispatched in the order they
+    * were enqueued, packets for different projects may be dispatched in parallel.
+    * @param p the packet to dispatch, ownership passes to the dispatcher
+    */
+   void enqueue(Packet *p);
+
    /**
     * remove removes a client from a currently reflecting project 
     * @param c the client to remove (from whatever project it is already connected to)
@@ -138,15 +340,24 @@ public:
     * archives the udpate in the database so that future clients can receive it 
     * @param src the client that made the update
     * @param cmd the 'command' that was performed (comment, rename, etc)
+    * @param cmdId the id of cmd, looked up once as the update was read
     * @param data the 'data' portion of the command (the comment text, etc)
     */
-   virtual void post(Client *src, const char *cmd, json_object *obj) = 0;
+   virtual void post(Client *src, const char *cmd, uint16_t cmdId, json_object *obj) = 0;
 
    /**
     * dumpStats dumps send / receive stats for each connected client 
     */
    string dumpStats();
 
+   /**
+    * backendStats reports statistics specific to a manager implementation
+    * @return a printable summary, empty if there is nothing to report
+    */
+   virtual string backendStats() {
+      return "";
+   }
+
    /**
     * sendLatestUpdates sends updates from LastUpdate to current 
     * it is expected that the client has already joined a project before calling this function
@@ -154,8 +365,10 @@ public:
     * this function is typically called when a user is re-joining a project that they had previously worked on
     * @param c the client requesting updates 
     * @param lastUpdate the last update the client received 
+    * @return true if a full chunk was sent and more updates may follow it, in which
+    *         case the caller continues from the last update queued to the client
     */
-   virtual void sendLatestUpdates(Client *c, uint64_t lastUpdate) = 0;
+   virtual bool sendLatestUpdates(Client *c, uint64_t lastUpdate) = 0;
 
    /**
     * getProjectInfo gets information related to a local project
@@ -198,7 +411,7 @@ public:
    virtual int snapProject(Client *c, uint64_t lastupdateid, const string &desc) = 0;
 
    /**
-    * forkProject  forks a project - creats new project and copies all updates to point to the new project,
+    * forkProject  forks a project - creats new project that shares all updates of the old one up to the fork point,
     * publish and subscribe values are inherited
     * @param c client object invoking the fork
     * @param lastupdateid the updateid value the fork is to occur at
@@ -210,7 +423,7 @@ public:
 
 
    /**
-    * forkProject  forks a project - creats new project and copies all updates to point to the new project
+    * forkProject  forks a project - creats new project that shares all updates of the old one up to the fork point
     * @param c client object invoking the fork
     * @param lastupdateid the updateid value the fork is to occur at
     * @param desc user provided description of the fork
@@ -234,8 +447,8 @@ public:
    /**
     * snapforkProject -  this is a special version of forkProject that is designed to work
     * on snapshots (instead of existing projects) this works exactly like forkProject, execpt
-    * updates are copied from the 'parent' of the snapshot instead of the client's currently 
-    * associated project, also updates are copied until the lastupdateid from the snapshot, 
+    * updates are shared from the 'parent' of the snapshot instead of the client's currently 
+    * associated project, also updates are shared until the lastupdateid from the snapshot, 
     * not from the plugin (last received update is stored in the idb)
     * @param c client invoking the snapforkProject
     * @param spid the pid of the project that is being snapshotted
@@ -287,6 +500,20 @@ public:
     */
    virtual int gpid2lpid(const string &gpid) = 0;
 
+   /**
+    * rejoinProject joins a client to a project it previously worked on, identified by gpid
+    * @param c the client attempting to rejoin
+    * @param gpid the global pid stored in the client's database
+    * @return 0 on success, -1 if gpid is not known on this server, -2 if the join failed
+    */
+   virtual int rejoinProject(Client *c, const string &gpid) {
+      int lpid = gpid2lpid(gpid);
+      if (lpid < 0) {
+         return -1;
+      }
+      return joinProject(c, lpid) >= 0 ? 0 : -2;
+   };
+
    /**
     * lpid2gpid converts an lpid (pid local to a particular server instance) 
     * to a gpid (which is unique across all projects on all servers)
@@ -303,6 +530,34 @@ private:
 
    bool basicMode;
 
+   //drains client outbound queues, and when IO_MODEL is "epoll" or "uring" also
+   //services client reads rather than one thread per client
+   Reactor *reactor;
+   bool polledMode;
+
+   //handles control messages, which mostly wait on the database, off the threads that read from clients
+   ControlPool *control;
+   bool inlineControl;        //CONTROL_THREADS is 0, control keeps one worker for resyncs
+
+   uint32_t queueHighWater;   //CLIENT_QUEUE_HWM
+   bool overflowResync;       //CLIENT_QUEUE_OVERFLOW is "resync"
+
+   uint32_t maxMessage;       //MAX_MESSAGE_SIZE
+   int maxJsonDepth;          //MAX_JSON_DEPTH
+   int compressionLevel;      //COMPRESSION_LEVEL
+   bool tcpNoDelay;           //TCP_NODELAY
+   bool tcpCork;              //TCP_CORK
+
+   int heartbeatInterval;     //HEARTBEAT_INTERVAL
+   int keepAliveIdle;         //TCP_KEEPALIVE_IDLE
+   int keepAliveInterval;     //TCP_KEEPALIVE_INTERVAL
+   int keepAliveCount;        //TCP_KEEPALIVE_COUNT
+
+   uint32_t publishRate;      //PUBLISH_RATE
+   uint32_t publishBurst;     //PUBLISH_BURST
+   uint32_t backlogHigh;      //PROJECT_BACKLOG_HWM, 0 for no limit
+   uint32_t backlogLow;       //PROJECT_BACKLOG_LWM
+
 };
 
 
@@ -22,17 +22,47 @@
 #include <arpa/inet.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <inttypes.h>
 #include <pthread.h>
+#include <sys/epoll.h>
 #include <map>
 #include <json-c/json.h>
 
 #include "utils.h"
+#include "frame.h"
 #include "proj_info.h"
 #include "client.h"
 #include "cli_mgr.h"
+#include "reactor.h"
+#include "epoch.h"
+#include "control_pool.h"
 
-map<string,ClientMsgHandler> *Client::handlers;
-map<string,uint32_t> perms_map;
+/**
+ * CommandInfo is what the server knows about a command, indexed by the
+ * command's id from the frame command table (see frameCommandId). Entry
+ * FRAME_NAMED, for commands without an id, stays empty
+ */
+struct CommandInfo {
+   ClientMsgHandler handler;   //NULL unless this is a control message
+   bool inlined;               //handled where it is read rather than by the ControlPool
+   uint64_t mask;              //permission bit an update of this command needs
+};
+
+static CommandInfo *commands;
+
+/**
+ * commandInfo finds the entry of a command while the table is built
+ */
+static CommandInfo &commandInfo(const char *cmd) {
+   static CommandInfo unused;
+   uint16_t id = frameCommandId(cmd);
+   if (id == FRAME_NAMED) {
+      fprintf(stderr, "command %s is missing from the frame command table\n", cmd);
+      return unused;
+   }
+   return commands[id];
+}
 
 /**
  * Client
@@ -45,10 +75,11 @@ map<string,uint32_t> perms_map;
  * @version 0.4.0, August 2012
  */
 
+//clients may be created by several acceptor threads at once
+static pthread_once_t handlersOnce = PTHREAD_ONCE_INIT;
+
 Client::Client(ConnectionManagerBase *mgr, NetworkIO *s, bool basic) {
-   if (handlers == NULL) {
-      init_handlers();
-   }
+   pthread_once(&handlersOnce, init_handlers);
    hash = "";
    //effective, combined permissions (project & user & requested), used for checks
    publish = 0;
@@ -72,6 +103,49 @@ Client::Client(ConnectionManagerBase *mgr, NetworkIO *s, bool basic) {
    cm = mgr;
    conn = s;
    basicMode = basic;
+
+   pthread_mutexattr_t attr;
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+   pthread_mutex_init(&outLock, &attr);
+   pthread_mutexattr_destroy(&attr);
+   lagging = false;
+   resyncing = false;
+   tailing = false;
+   heldBytes = 0;
+   closing = false;
+   member = -1;
+   refs = 1;
+   lastQueued = 0;
+   resyncMark = 0;
+   peakQueued = 0;
+   overflows = 0;
+   resyncs = 0;
+   dropped = 0;
+   loop = -1;
+   events = 0;
+   registered = false;
+   polled = false;
+   inflight = 0;
+   receiving = false;
+   pollingOut = false;
+   dying = false;
+   recvCancelled = false;
+   wakeAt = 0;
+   wheelNext = wheelPrev = NULL;
+   wheelDue = 0;
+   lastHeard = monotonic_ms();
+   heartbeats = false;
+   paused = 0;
+   pthread_cond_init(&resumed, NULL);
+   memset(pausedAt, 0, sizeof(pausedAt));
+   memset(pauses, 0, sizeof(pauses));
+   memset(pausedMs, 0, sizeof(pausedMs));
+   tokens = cm->getPublishBurst();
+   tokensAt = monotonic_ms();
+   controlBusy = false;
+   optionsReply = NULL;
+   pendingOptions = 0;
    fprintf(stderr, "basicMode is: %u\n", basicMode);
 
 //   ::logln("New Connection", LINFO);
@@ -96,6 +170,28 @@ Client::Client(ConnectionManagerBase *mgr, NetworkIO *s, bool basic) {
    gpid = "deadbeefdeadbeefdeadbeefdeadbeefdeadbeefdeadbeefdeadbeefdeadbeef";
 }
 
+Client::~Client() {
+   for (deque<json_object*>::iterator i = deferred.begin(); i != deferred.end(); i++) {
+      json_object_put(*i);
+   }
+   if (optionsReply != NULL) {
+      json_object_put(optionsReply);
+   }
+   delete conn;
+   pthread_cond_destroy(&resumed);
+   pthread_mutex_destroy(&outLock);
+}
+
+void Client::destroy(void *obj) {
+   delete (Client*)obj;
+}
+
+void Client::release() {
+   if (__sync_sub_and_fetch(&refs, 1) == 0) {
+      Epoch::retire(this, destroy);
+   }
+}
+
 
 /**
  * logs a message to the configured log file (in the ConnectionManager)
@@ -110,25 +206,91 @@ void Client::log(const string &msg, int v) {
 
 /**
  * post is the function that actually posts updates to clients (if subscribing)
- * @param data the bytearray containing the update to send
+ * @param msg the command of the update
+ * @param wire the encoded update, shared with other recipients
+ * @param updateid the id of the update
+ * @param pid the project of the update, which is dropped unless this client is still a member
  */
-void Client::post(const char *msg, json_object *obj) {
-   if (checkPermissions(msg, subscribe)) {
+void Client::post(uint16_t cmd, EncodedPacket *wire, uint64_t updateid, int pid) {
+   if (checkPermissions(cmd, subscribe)) {
       //only post if client is subscribing and is allowed to recieve that particular command
-      conn->writeJson(obj);
-      //::logln("post- datasize: " + data.length);
-//      stats[0][data[7] & 0xff]++;
+      pthread_mutex_lock(&outLock);
+      if (pid != member) {
+         //posted from a ClientSet this client has since left
+      }
+      else if (lagging) {
+         dropped++;
+      }
+      else if (tailing && updateid != 0) {
+         //the resync's last query may or may not have seen this one, it sorts that out once done
+         if (heldBytes + wire->length() > cm->getQueueHighWater()) {
+            //too much to hold, so drop them and let the resync take another chunk
+            releaseHeld(false);
+            lagging = true;
+            dropped++;
+         }
+         else if (held.insert(make_pair(updateid, wire)).second) {
+            wire->ref();
+            heldBytes += wire->length();
+         }
+      }
+      else if (!closing && (updateid == 0 || updateid > resyncMark)) {
+         uint32_t depth = conn->queuedBytes();
+         //a message is always accepted into an empty queue, however large
+         if (depth != 0 && depth + wire->length() > cm->getQueueHighWater()) {
+            overflow(updateid);
+         }
+         else {
+            queue(wire->ref(), false);
+            lastQueued = updateid;
+         }
+      }
+      pthread_mutex_unlock(&outLock);
    }
-   else {
-/*
-      ::logln("Client " + hash + ":" + conn->getInetAddress().getHostAddress()
-                         + ":" + conn->getPeerPort() + " failed to post data. "
-                         + " (probably subscribe permission: "
-                         + parseCommand(data) + ")", LINFO3);
-*/
+}
+
+int Client::setMember(int p) {
+   pthread_mutex_lock(&outLock);
+   int prev = member;
+   member = p;
+   pthread_mutex_unlock(&outLock);
+   return prev;
+}
+
+/**
+ * flush writes everything queued by post, unless the Reactor is already
+ * waiting for the socket to drain
+ */
+void Client::flush() {
+   pthread_mutex_lock(&outLock);
+   if (!closing && conn->queuedBytes() != 0 && !(events & EPOLLOUT)) {
+      updateInterest(conn->flushQueue());
    }
+   pthread_mutex_unlock(&outLock);
 }
 
+/**
+ * replay sends a stored update to this client as part of a catch up. Unlike
+ * post, replayed updates are not subject to the outbound queue high-water mark
+ * @param cmd the id of the command of the update, FRAME_NAMED if it has none
+ * @param updateid the id of the update
+ * @param wire the encoded update, including its updateid, ownership passes to the client,
+ *        NULL to move past an update that can't be sent
+ */
+void Client::replay(uint16_t cmd, uint64_t updateid, EncodedPacket *wire) {
+   pthread_mutex_lock(&outLock);
+   if (wire != NULL) {
+      if (!closing && checkPermissions(cmd, subscribe)) {
+         queue(wire);
+      }
+      else {
+         wire->release();
+      }
+   }
+   //the catch up moves past updates this client may not see as well
+   lastQueued = updateid;
+   pthread_mutex_unlock(&outLock);
+}
 
 /**
  * similar to post, but does not check subscription status, and takes command as a arg
@@ -136,8 +298,9 @@ void Client::post(const char *msg, json_object *obj) {
  * because these messages do not contain an updateid
  * @param command the command to send
  * @param data the data associated with the command
+ * @param flush false to only queue the message, as post does
  */
-void Client::send_data(const char *command, json_object *obj) {
+void Client::send_data(const char *command, json_object *obj, bool flush) {
    //it would be nice to check that command is a valid control message
    //maybe prefix all control messages with "ctrl_"
 //   if (strncmp(command, "mng_", 4) == 0) {
@@ -146,8 +309,9 @@ void Client::send_data(const char *command, json_object *obj) {
       }
       json_object_object_add_ex(obj, "type", json_object_new_string(command), JSON_NEW_CONST_KEY);
 
-      fprintf(stderr, "Client::send_data calling conn->writeJson\n");
-      conn->writeJson(obj);  //calls json_object_put
+      EncodedPacket *msg = isFramed() ? EncodedPacket::fromFrame(obj) : EncodedPacket::fromJson(obj);
+      json_object_put(obj);
+      send(msg, flush);
       //fprintf(stderr, "send_data- cmd: %s\n");
 //      json_object_put(obj);
 //      stats[0][command]++;    //figure out way to count messages - map???
@@ -159,6 +323,21 @@ void Client::send_data(const char *command, json_object *obj) {
 */
 }
 
+void Client::ack(uint64_t updateid) {
+   send(EncodedPacket::ack(updateid, isFramed()), false);
+}
+
+void Client::send(EncodedPacket *msg, bool flush) {
+   pthread_mutex_lock(&outLock);
+   if (!closing) {
+      queue(msg, flush);
+   }
+   else {
+      msg->release();
+   }
+   pthread_mutex_unlock(&outLock);
+}
+
 /**
  * sendForkFollow sends a FORKFOLLOW message to the client, this occurs when another
  * user on the project decided to fork, the plugin is expected to give the user the
@@ -191,8 +370,257 @@ void Client::send_error_msg(string theerror, const char *type) {
 void Client::terminate() {
 //   ::logln("Client " + hash + ":" + conn->getPeerAddr()
 //                      + ":" + conn->getPeerPort() + " terminating", LINFO);
-   conn->close();
+   //remove first so that the dispatcher stops posting before the socket goes away
    cm->remove(this);
+   pthread_mutex_lock(&outLock);
+   closing = true;
+   conn->close();
+   //a reader thread waiting out a pause notices the close
+   pthread_cond_broadcast(&resumed);
+   pthread_mutex_unlock(&outLock);
+}
+
+/**
+ * evict disconnects a client that has stopped answering heartbeats. The
+ * connection is shut down, and torn down by whoever reads from it.
+ */
+void Client::evict() {
+   pthread_mutex_lock(&outLock);
+   if (!closing) {
+      logln("no reply to heartbeats, disconnecting", LINFO);
+      updateInterest(-1);
+   }
+   pthread_mutex_unlock(&outLock);
+}
+
+/**
+ * pause stops reading from this client until resume is called for the same
+ * reason. Messages already read are still processed.
+ * @param why the PAUSE_ reason
+ * @return false if reading was already paused for that reason
+ */
+bool Client::pause(int why) {
+   bool fresh = false;
+   pthread_mutex_lock(&outLock);
+   if (!(paused & (1 << why)) && !closing) {
+      paused |= 1 << why;
+      pauses[why]++;
+      pausedAt[why] = monotonic_ms();
+      fresh = true;
+      if (polled) {
+         cm->getReactor()->watch(this, baseEvents() | (events & EPOLLOUT));
+      }
+   }
+   pthread_mutex_unlock(&outLock);
+   return fresh;
+}
+
+/**
+ * resume lifts a pause, reading continues once no reason for a pause remains
+ * @param why the PAUSE_ reason
+ */
+void Client::resume(int why) {
+   pthread_mutex_lock(&outLock);
+   if (paused & (1 << why)) {
+      paused &= ~(1 << why);
+      pausedMs[why] += monotonic_ms() - pausedAt[why];
+      if (paused != 0) {
+         //still paused for another reason
+      }
+      else if (!polled) {
+         pthread_cond_signal(&resumed);
+      }
+      else if (!closing) {
+         cm->getReactor()->watch(this, baseEvents() | (events & EPOLLOUT));
+      }
+   }
+   pthread_mutex_unlock(&outLock);
+}
+
+/**
+ * throttle charges an update about to be posted against this client's
+ * PUBLISH_RATE, pausing reading for as long as the client is over its rate,
+ * and counts the update against its project's dispatch backlog
+ */
+void Client::throttle() {
+   uint32_t rate = cm->getPublishRate();
+   if (rate != 0) {
+      //a token bucket holding up to PUBLISH_BURST updates, which is allowed to go
+      //into debt so that a burst that has already been read can still be posted
+      uint64_t now = monotonic_ms();
+      tokens += (now - tokensAt) * rate / 1000.0;
+      tokensAt = now;
+      if (tokens > cm->getPublishBurst()) {
+         tokens = cm->getPublishBurst();
+      }
+      tokens -= 1;
+      if (tokens < 0) {
+         uint32_t ms = (uint32_t)(-tokens * 1000 / rate) + 1;
+         if (!polled) {
+            pause(PAUSE_RATE);
+            usleep(ms * 1000);
+            resume(PAUSE_RATE);
+         }
+         else {
+            //updates already read when the pause began run up the debt, and each one extends it
+            pause(PAUSE_RATE);
+            cm->getReactor()->resumeAfter(this, ms);
+         }
+      }
+   }
+   cm->admit(this);
+}
+
+/**
+ * waitWhilePaused blocks a reader thread until reading is no longer paused
+ */
+void Client::waitWhilePaused() {
+   pthread_mutex_lock(&outLock);
+   while (paused != 0 && !closing) {
+      pthread_cond_wait(&resumed, &outLock);
+   }
+   pthread_mutex_unlock(&outLock);
+}
+
+/**
+ * queue appends a message to the outbound queue and writes as much of the
+ * queue as the socket will accept. Must be called with outLock held.
+ * @param msg the message, the queue takes over the caller's reference to it
+ * @param flush false to leave the write to a later flush
+ */
+void Client::queue(EncodedPacket *msg, bool flush) {
+   //a backlog is written by the Reactor in one go once the socket drains
+   bool backlog = conn->queuedBytes() != 0 && (events & EPOLLOUT);
+   conn->queueSend(msg);
+   if (conn->queuedBytes() > peakQueued) {
+      peakQueued = conn->queuedBytes();
+   }
+   if (flush && !backlog) {
+      updateInterest(conn->flushQueue());
+   }
+}
+
+uint32_t Client::baseEvents() {
+   //a closing client is read from regardless, so that its shutdown is noticed
+   return polled && (paused == 0 || closing) ? (EPOLLIN | EPOLLRDHUP) : 0;
+}
+
+/**
+ * updateInterest asks the Reactor for write notifications while output
+ * remains queued. Must be called with outLock held.
+ * @param remain the result of the last flush of the outbound queue
+ * @return false if the connection has failed
+ */
+bool Client::updateInterest(int remain) {
+   uint32_t ev = baseEvents();
+   if (remain < 0) {
+      //whoever is reading from this connection notices the shutdown and tears it down
+      closing = true;
+      conn->shutdown();
+   }
+   else if (remain > 0 || (lagging && !resyncing)) {
+      //a lagging client stays armed so that the Reactor starts its next chunk once drained
+      ev |= EPOLLOUT;
+   }
+   cm->getReactor()->watch(this, ev);
+   return remain >= 0;
+}
+
+/**
+ * overflow applies the configured overflow policy once a live update would
+ * push the outbound queue past its high-water mark. Must be called with outLock held.
+ * @param updateid the id of the update that did not fit
+ */
+void Client::overflow(uint64_t updateid) {
+   overflows++;
+   if (cm->resyncOnOverflow() && !basicMode && updateid != 0) {
+      logln("outbound queue overflow, dropping updates until resync", LINFO);
+      lagging = true;
+      dropped++;
+      //every earlier update is already queued
+      lastQueued = updateid - 1;
+      updateInterest(conn->queuedBytes());
+   }
+   else {
+      logln("outbound queue overflow, disconnecting", LINFO);
+      updateInterest(-1);
+   }
+}
+
+/**
+ * resync replays the next chunk of the updates dropped while this client was
+ * lagging. Once the last chunk is queued live delivery resumes, otherwise the
+ * next chunk follows when this one has drained.
+ */
+void Client::resync() {
+   pthread_mutex_lock(&outLock);
+   if (resyncing) {
+      //the Reactor and a catch up request may both try to start one
+      pthread_mutex_unlock(&outLock);
+      return;
+   }
+   resyncing = true;
+   pthread_mutex_unlock(&outLock);
+   resyncChunk();
+}
+
+/**
+ * resyncChunk replays a chunk of a resync the caller has already claimed by
+ * setting resyncing. A full chunk leaves the client lagging, so the next waits
+ * until the socket has drained. Once a chunk comes up short live posts are held
+ * rather than dropped, and one last query replays anything committed before
+ * they were. outLock is never held across a query, so dispatchers don't wait
+ * on the database.
+ */
+void Client::resyncChunk() {
+   pthread_mutex_lock(&outLock);
+   uint64_t from = lastQueued;
+   pthread_mutex_unlock(&outLock);
+   //live updates are still dropped while the bulk of the backlog is replayed
+   bool more = cm->sendLatestUpdates(this, from);
+   bool done = false;
+   pthread_mutex_lock(&outLock);
+   if (!more && !closing) {
+      lagging = false;
+      tailing = true;
+      from = lastQueued;
+      pthread_mutex_unlock(&outLock);
+      more = cm->sendLatestUpdates(this, from);
+      pthread_mutex_lock(&outLock);
+      //post sets lagging if it had to give up holding
+      done = !more && !lagging && !closing;
+      releaseHeld(done);
+      if (done) {
+         resyncMark = lastQueued;
+         resyncs++;
+      }
+      else {
+         lagging = true;
+      }
+   }
+   //still lagging unless done, so onWritable starts the next chunk once this one is flushed
+   resyncing = false;
+   updateInterest(conn->flushQueue());
+   pthread_mutex_unlock(&outLock);
+   if (done) {
+      logln("resync complete", LINFO);
+   }
+}
+
+void Client::releaseHeld(bool deliver) {
+   for (map<uint64_t, EncodedPacket*>::iterator i = held.begin(); i != held.end(); i++) {
+      if (deliver && i->first > lastQueued) {
+         //replayed updates aren't subject to the high-water mark, and these were bounded by it
+         queue(i->second, false);
+         lastQueued = i->first;
+      }
+      else {
+         i->second->release();
+      }
+   }
+   held.clear();
+   heldBytes = 0;
+   tailing = false;
 }
 
 /**
@@ -201,6 +629,29 @@ void Client::terminate() {
 string Client::dumpStats() {
 //   string sb = "Stats for " + hash + ":" + conn->getPeerAddr() + ":" + conn.getPeerPort() + "\n";
    string sb = "Stats for " + hash + ":" + conn->getPeerAddr() + "\n";
+   char qbuf[192];
+   pthread_mutex_lock(&outLock);
+   snprintf(qbuf, sizeof(qbuf), "outbound queue: %u bytes (%u msgs), peak %u, overflows %u, dropped %" PRIu64 ", resyncs %u\n",
+            conn->queuedBytes(), conn->queuedMessages(), peakQueued, overflows, dropped, resyncs);
+   sb += qbuf;
+   snprintf(qbuf, sizeof(qbuf), "bytes rx %" PRIu64 " (%" PRIu64 " on the wire), tx %" PRIu64 " (%" PRIu64 " on the wire)%s\n",
+            conn->bytesReceived(false), conn->bytesReceived(true), conn->bytesSent(false), conn->bytesSent(true),
+            conn->isCompressed() ? ", compressed" : "");
+   sb += qbuf;
+   snprintf(qbuf, sizeof(qbuf), "send syscalls %" PRIu64 " for %" PRIu64 " messages\n",
+            conn->sendSyscalls(), conn->messagesSent());
+   sb += qbuf;
+   uint64_t ms[PAUSE_REASONS];
+   uint64_t now = monotonic_ms();
+   for (int i = 0; i < PAUSE_REASONS; i++) {
+      //including any pause still in effect
+      ms[i] = pausedMs[i] + ((paused & (1 << i)) ? now - pausedAt[i] : 0);
+   }
+   snprintf(qbuf, sizeof(qbuf), "publish throttled %u times for %" PRIu64 " ms, paused for project backlog %u times for %" PRIu64 " ms%s\n",
+            pauses[PAUSE_RATE], ms[PAUSE_RATE], pauses[PAUSE_BACKLOG], ms[PAUSE_BACKLOG],
+            paused != 0 ? ", paused now" : "");
+   pthread_mutex_unlock(&outLock);
+   sb += qbuf;
    sb += "command     rx     tx\n";
    for (int i = 0; i < 256; i++) {
       if (stats[0][i] != 0 || stats[1][i] != 0) {
@@ -223,19 +674,9 @@ string Client::dumpStats() {
  * for example all the segment operations (add, del, start/end change, etc) are grouped into
  * 'segment' permissions.
  */
-bool Client::checkPermissions(const char *command, uint64_t permType) {
-   bool isallowed = false;
-//   ::logln("checking for permission " + command, LDEBUG);
-   map<string,uint32_t>::iterator mi = perms_map.find(command);
-   
-   if (mi != perms_map.end()) {
-      uint32_t mask = mi->second;
-      isallowed = ((permType & mask) > 0) ?  true : false;
-   }  //end command switch
-   else {
-      //logln("unmatched command " + command + " found in publish switch", LERROR);
-   }      
-   return isallowed;
+bool Client::checkPermissions(uint16_t command, uint64_t permType) {
+   //commands without a permission, including unknown ones, have an empty mask
+   return (permType & commands[command].mask) != 0;
 }
 
 uint32_t Client::getPeerPort() {
@@ -276,154 +717,357 @@ void *Client::run(void *arg) {
             //received something that can't be parsed, bail
             break;
          }
-         const char *cmd = string_from_json(obj, "type");
-         fprintf(stderr, "processing %s\n", cmd);
-         map<string,ClientMsgHandler>::iterator i = handlers->find(cmd);
-         if (i != handlers->end()) {
-            ClientMsgHandler h = i->second;
-            done = (*h)(obj, client);
-            json_object_put(obj);
+         done = client->processMsg(obj);
+         client->waitWhilePaused();
+         client->switchOptions();
+      }
+   } catch (IOException ex) {
+      fprintf(stderr, "An IOException occurred: %s\n", ex.getMessage().c_str());
+   }
+end_loop:
+   //the Reactor may still hold this client for pending writes
+   client->cm->release(client);
+   return NULL;
+}
+
+/**
+ * onEvent is called by a Reactor thread when this client's socket is ready
+ * @param ev the EPOLL* events reported for the socket
+ * @return false if the connection should be torn down
+ */
+bool Client::onEvent(uint32_t ev) {
+   if (ev & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+      if (!onWritable() && polled) {
+         return false;
+      }
+   }
+   if (polled && (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+      return onReadable();
+   }
+   return true;
+}
+
+/**
+ * onWritable drains as much of the outbound queue as the socket will take,
+ * and starts a resync once a lagging client's queue is empty
+ * @return false if the connection has failed
+ */
+bool Client::onWritable() {
+   pthread_mutex_lock(&outLock);
+   int remain = conn->flushQueue();
+   bool catchup = remain == 0 && lagging && !closing && !resyncing;
+   if (catchup) {
+      //claimed here so that a single chunk is started, and so write interest is dropped meanwhile
+      resyncing = true;
+   }
+   bool ok = updateInterest(remain);
+   pthread_mutex_unlock(&outLock);
+   if (catchup) {
+      //the chunk waits on the database, which a Reactor loop must not
+      cm->getResyncPool()->submitResync(ref());
+   }
+   return ok;
+}
+
+/**
+ * onReadable is called by a Reactor thread when this client's socket has data
+ * available. Every complete message is handed to processMsg.
+ * @return false if the connection should be torn down
+ */
+bool Client::onReadable() {
+   vector<json_object*> msgs;
+   bool ok = conn->readJsonAvailable(msgs);
+   return processMsgs(msgs, ok);
+}
+
+/**
+ * onReceived is called by a Reactor thread in uring mode with data that
+ * has been received from this client's socket
+ * @param data the received bytes
+ * @param len the number of bytes received
+ * @return false if the connection should be torn down
+ */
+bool Client::onReceived(const void *data, uint32_t len) {
+   vector<json_object*> msgs;
+   bool ok = conn->readJsonFrom(data, len, msgs);
+   return processMsgs(msgs, ok);
+}
+
+/**
+ * processMsgs hands each message read from the socket to processMsg
+ * @param msgs the messages, all of which are released
+ * @param ok false if reading them ended in an error
+ * @return false if the connection should be torn down
+ */
+bool Client::processMsgs(vector<json_object*> &msgs, bool ok) {
+   bool done = false;
+   for (vector<json_object*>::iterator i = msgs.begin(); i != msgs.end(); i++) {
+      if (done) {
+         json_object_put(*i);
+      }
+      else if (controlBusy) {
+         //read before reading paused for a control message, so handled after it
+         lastHeard = monotonic_ms();
+         deferred.push_back(*i);
+      }
+      else {
+         done = processMsg(*i);
+         switchOptions();
+      }
+   }
+   if (!ok) {
+      fprintf(stderr, "json_object parsing failed\n");
+   }
+   return ok && !done;
+}
+
+/**
+ * processMsg performs the appropriate action for a single incoming message,
+ * either a control message with a registered handler or an update to post
+ * @param obj the message, which is released by this function
+ * @return true if the connection should be closed
+ */
+bool Client::processMsg(json_object *obj) {
+   bool done = false;
+   lastHeard = monotonic_ms();
+   const char *cmd = string_from_json(obj, "type");
+   if (cmd == NULL) {
+      json_object_put(obj);
+      return false;
+   }
+   fprintf(stderr, "processing %s\n", cmd);
+   //the id is looked up once, everything else about the command is indexed by it
+   uint16_t id = frameCommandId(cmd);
+   ClientMsgHandler h = commands[id].handler;
+   if (h != NULL) {
+      if (cm->getControlPool() != NULL && !commands[id].inlined) {
+         submitControl(cmd, obj, h);
+      }
+      else {
+         done = (*h)(obj, this);
+         json_object_put(obj);
+      }
+   }
+   else {
+      //no handler found so this is not a control message, post it
+      //only accept commands if the client is authenticated
+      fprintf(stderr, "no handler found for %s\n", cmd);
+      if (authenticated && (publish > 0)) {
+         //only post if this client chose to publish,
+         //(though they really shouldn't have sent any data if they are not publishing)
+         if (checkPermissions(id, publish)) {
+//               ::logln("posting command " + command + " (allowed to  publish) ", LDEBUG);
+            //updates are stored and relayed without an updateid, it is spliced in as they are sent
+            json_object_object_del(obj, "updateid");
+            throttle();
+            cm->post(this, cmd, id, obj);
          }
          else {
-            //no handler found so this is not a control message, post it
-            //only accept commands if the client is authenticated
-            fprintf(stderr, "no handler found for %s\n", cmd);
-            if (client->authenticated && (client->publish > 0)) {
-               //only post if this client chose to publish,
-               //(though they really shouldn't have sent any data if they are not publishing)
-               if (client->checkPermissions(cmd, client->publish)) {
-   //               ::logln("posting command " + command + " (allowed to  publish) ", LDEBUG);
-                  client->cm->post(client, cmd, obj);
-               }
-               else {
-                  fprintf(stderr, "Skipping update no permissions\n");
-   //               ::logln("not allowed to perform command: " + command, LINFO);
-                      // if (errorAlreadySentMask
-                      // send_error("you are not allowed to byte patch");
-                      // errorAlreadySentMask |= MASK_BYTE_PATCHED;
-                      // ::logln("sent errors is " + errorAlreadySentMask);
-                  json_object_put(obj);
-               }
-            }
-            else {
-               fprintf(stderr, "Skipping update authenticated: %d, publish: 0x%X\n", client->authenticated, (uint32_t)client->publish);
-   /*
-               ::logln("Client " + hash + ":" + conn.getInetAddress().getHostAddress()
-                                  + ":" + conn.getPeerPort() + " skipping post command.", LINFO);
-   */
-               json_object_put(obj);
-            }
+            fprintf(stderr, "Skipping update no permissions\n");
+//               ::logln("not allowed to perform command: " + command, LINFO);
+                   // if (errorAlreadySentMask
+                   // send_error("you are not allowed to byte patch");
+                   // errorAlreadySentMask |= MASK_BYTE_PATCHED;
+                   // ::logln("sent errors is " + errorAlreadySentMask);
+            json_object_put(obj);
          }
+      }
+      else {
+         fprintf(stderr, "Skipping update authenticated: %d, publish: 0x%X\n", authenticated, (uint32_t)publish);
+/*
+         ::logln("Client " + hash + ":" + conn.getInetAddress().getHostAddress()
+                            + ":" + conn.getPeerPort() + " skipping post command.", LINFO);
+*/
+         json_object_put(obj);
+      }
+   }
 
 /*
 #ifdef DEBUG
-         fprintf(stderr, "received data len: %d, cmd: %d\n", len, command);
+   fprintf(stderr, "received data len: %d, cmd: %d\n", len, command);
 #endif
 //      ::logln("received data len: " + len + ", cmd: " + command, LDEBUG);
-         if (command < MAX_COMMAND && command > 0) {
-            client->stats[1][command]++;
-         }
-         if (command < MSG_CONTROL_FIRST) {
-         }
+   if (command < MAX_COMMAND && command > 0) {
+      stats[1][command]++;
+   }
+   if (command < MSG_CONTROL_FIRST) {
+   }
 */
+   return done;
+}
+
+/**
+ * submitControl hands a control message to the ControlPool. Reading from the
+ * client pauses until the message has been handled, and anything already
+ * read behind it waits in deferred, so that the client's messages are still
+ * handled one at a time in the order they were sent.
+ * @param cmd the command of the message
+ * @param obj the message, ownership passes to the pool
+ * @param h the handler of cmd
+ */
+void Client::submitControl(const char *cmd, json_object *obj, ClientMsgHandler h) {
+   pause(PAUSE_CONTROL);
+   //a reader thread waits out the pause, a Reactor loop defers what it has already read
+   controlBusy = polled;
+   cm->getControlPool()->submit(ref(), cmd, obj, h);
+}
+
+/**
+ * runControl handles a control message on a ControlPool worker, then hands
+ * the client back to the thread that reads from it
+ * @param obj the message, which is released by this function
+ * @param h the handler of the message
+ */
+void Client::runControl(json_object *obj, ClientMsgHandler h) {
+   bool done = (*h)(obj, this);
+   json_object_put(obj);
+   if (done) {
+      if (optionsReply != NULL) {
+         //nothing more will be read, so there is no input to switch
+         send_data(MSG_AUTH_REPLY, optionsReply);
+         optionsReply = NULL;
       }
-   } catch (IOException ex) {
-      fprintf(stderr, "An IOException occurred: %s\n", ex.getMessage().c_str());
+      pthread_mutex_lock(&outLock);
+      if (!closing) {
+         //torn down by whoever reads from the connection, as an eviction is
+         updateInterest(-1);
+      }
+      pthread_cond_broadcast(&resumed);
+      pthread_mutex_unlock(&outLock);
+   }
+   if (polled) {
+      //the loop takes over the task's reference
+      cm->getReactor()->controlDone(this);
+   }
+   else {
+      //a reader thread is waiting in waitWhilePaused
+      resume(PAUSE_CONTROL);
+      release();
    }
-end_loop:
-   fprintf(stderr, "Client loop has ended\n");
-   client->terminate();
-   delete client;
-   return NULL;
+}
+
+/**
+ * onControlDone processes the messages deferred while a control message was
+ * being handled, and resumes reading unless one of them is another control
+ * message
+ * @return false if the connection should be torn down
+ */
+bool Client::onControlDone() {
+   controlBusy = false;
+   switchOptions();
+   pthread_mutex_lock(&outLock);
+   bool closed = closing;
+   pthread_mutex_unlock(&outLock);
+   if (closed) {
+      //whoever closed it sees to the teardown
+      return true;
+   }
+   vector<json_object*> msgs(deferred.begin(), deferred.end());
+   deferred.clear();
+   bool ok = processMsgs(msgs, true);
+   if (!controlBusy) {
+      resume(PAUSE_CONTROL);
+   }
+   return ok;
 }
 
 void Client::init_handlers() {
-   handlers = new map<string,ClientMsgHandler>;
-   (*handlers)[MSG_PROJECT_NEW_REQUEST] = msg_project_new_request;
-   (*handlers)[MSG_PROJECT_JOIN_REQUEST] = msg_project_join_request;
-   (*handlers)[MSG_PROJECT_REJOIN_REQUEST] = msg_project_rejoin_request;
-   (*handlers)[MSG_PROJECT_SNAPSHOT_REQUEST] = msg_project_snapshot_request;
-   (*handlers)[MSG_PROJECT_FORK_REQUEST] = msg_project_fork_request;
-   (*handlers)[MSG_PROJECT_SNAPFORK_REQUEST] = msg_project_snapfork_request;
-   (*handlers)[MSG_PROJECT_LEAVE] = msg_project_leave;
-   (*handlers)[MSG_PROJECT_JOIN_REPLY] = msg_project_join_reply;
-   (*handlers)[MSG_AUTH_REQUEST] = msg_auth_request;
-   (*handlers)[MSG_PROJECT_LIST] = msg_project_list;
-   (*handlers)[MSG_SEND_UPDATES] = msg_send_updates;
-   (*handlers)[MSG_SET_REQ_PERMS] = msg_set_req_perms;
-   (*handlers)[MSG_GET_REQ_PERMS] = msg_get_req_perms;
-   (*handlers)[MSG_GET_PROJ_PERMS] = msg_get_proj_perms;
-   (*handlers)[MSG_SET_PROJ_PERMS] = msg_set_proj_perms;
-
-   perms_map[COMMAND_UNDEFINE] = MASK_UNDEFINE;
-   perms_map[COMMAND_MAKE_CODE] = MASK_MAKE_CODE;
-   perms_map[COMMAND_MAKE_DATA] = MASK_MAKE_DATA;
-
-   perms_map[COMMAND_SEGM_ADDED] = MASK_SEGMENTS;
-   perms_map[COMMAND_SEGM_DELETED] = MASK_SEGMENTS;
-   perms_map[COMMAND_SEGM_START_CHANGED] = MASK_SEGMENTS;
-   perms_map[COMMAND_SEGM_END_CHANGED] = MASK_SEGMENTS;
-   perms_map[COMMAND_SEGM_MOVED] = MASK_SEGMENTS;
-   perms_map[COMMAND_MOVE_SEGM] = MASK_SEGMENTS;
-
-
-   perms_map[COMMAND_SET_STACK_VAR_NAME] = MASK_RENAME;
-   perms_map[COMMAND_RENAMED] = MASK_RENAME;
-
-   perms_map[COMMAND_FUNC_TAIL_APPENDED] = MASK_FUNCTIONS;
-   perms_map[COMMAND_FUNC_TAIL_REMOVED] = MASK_FUNCTIONS;
-   perms_map[COMMAND_TAIL_OWNER_CHANGED] = MASK_FUNCTIONS;
-   perms_map[COMMAND_FUNC_NORET_CHANGED] = MASK_FUNCTIONS;
-   perms_map[COMMAND_ADD_FUNC] = MASK_FUNCTIONS;
-   perms_map[COMMAND_DEL_FUNC] = MASK_FUNCTIONS;
-   perms_map[COMMAND_SET_FUNC_START] = MASK_FUNCTIONS;
-   perms_map[COMMAND_SET_FUNC_END] = MASK_FUNCTIONS;
-
-   perms_map[COMMAND_BYTE_PATCHED] = MASK_BYTE_PATCH;
-
-   perms_map[COMMAND_AREA_CMT_CHANGED] = MASK_COMMENTS;
-   perms_map[COMMAND_CMT_CHANGED] = MASK_COMMENTS;
-
-   perms_map[COMMAND_TI_CHANGED] = MASK_OPTYPES;
-   perms_map[COMMAND_OP_TI_CHANGED] = MASK_OPTYPES;
-   perms_map[COMMAND_OP_TYPE_CHANGED] = MASK_OPTYPES;
-
-   perms_map[COMMAND_ENUM_CREATED] = MASK_ENUMS;
-   perms_map[COMMAND_ENUM_DELETED] = MASK_ENUMS;
-   perms_map[COMMAND_ENUM_BF_CHANGED] = MASK_ENUMS;
-   perms_map[COMMAND_ENUM_RENAMED] = MASK_ENUMS;
-   perms_map[COMMAND_ENUM_CMT_CHANGED] = MASK_ENUMS;
-   perms_map[COMMAND_ENUM_CONST_CREATED] = MASK_ENUMS;
-   perms_map[COMMAND_ENUM_CONST_DELETED] = MASK_ENUMS;
-
-   perms_map[COMMAND_STRUC_CREATED] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_DELETED] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_RENAMED] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_EXPANDED] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_CMT_CHANGED] = MASK_STRUCTS;
-   perms_map[COMMAND_CREATE_STRUC_MEMBER_DATA] = MASK_STRUCTS;
-   perms_map[COMMAND_CREATE_STRUC_MEMBER_STRUCT] = MASK_STRUCTS;
-   perms_map[COMMAND_CREATE_STRUC_MEMBER_REF] = MASK_STRUCTS;
-   perms_map[COMMAND_CREATE_STRUC_MEMBER_STROFF] = MASK_STRUCTS;
-   perms_map[COMMAND_CREATE_STRUC_MEMBER_STR] = MASK_STRUCTS;
-   perms_map[COMMAND_CREATE_STRUC_MEMBER_ENUM] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_MEMBER_DELETED] = MASK_STRUCTS;
-   perms_map[COMMAND_SET_STRUCT_MEMBER_NAME] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_MEMBER_CHANGED_DATA] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_MEMBER_CHANGED_STRUCT] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_MEMBER_CHANGED_STR] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_MEMBER_CHANGED_OFFSET] = MASK_STRUCTS;
-   perms_map[COMMAND_STRUC_MEMBER_CHANGED_ENUM] = MASK_STRUCTS;
-   perms_map[COMMAND_CREATE_STRUC_MEMBER_OFFSET] = MASK_STRUCTS;
-
-   perms_map[COMMAND_VALIDATE_FLIRT_FUNC] = MASK_FLIRT;
-
-   perms_map[COMMAND_THUNK_CREATED] = MASK_THUNK;
-
-   perms_map[COMMAND_ADD_CREF] = MASK_XREF;
-   perms_map[COMMAND_ADD_DREF] = MASK_XREF;
-   perms_map[COMMAND_DEL_CREF] = MASK_XREF;
-   perms_map[COMMAND_DEL_DREF] = MASK_XREF;
+   //entry FRAME_NAMED is the zeroed entry shared by every command without an id
+   commands = new CommandInfo[frameCommandCount() + 1];
+   memset(commands, 0, (frameCommandCount() + 1) * sizeof(CommandInfo));
+   commandInfo(MSG_PROJECT_NEW_REQUEST).handler = msg_project_new_request;
+   commandInfo(MSG_PROJECT_JOIN_REQUEST).handler = msg_project_join_request;
+   commandInfo(MSG_PROJECT_REJOIN_REQUEST).handler = msg_project_rejoin_request;
+   commandInfo(MSG_PROJECT_SNAPSHOT_REQUEST).handler = msg_project_snapshot_request;
+   commandInfo(MSG_PROJECT_FORK_REQUEST).handler = msg_project_fork_request;
+   commandInfo(MSG_PROJECT_SNAPFORK_REQUEST).handler = msg_project_snapfork_request;
+   commandInfo(MSG_PROJECT_LEAVE).handler = msg_project_leave;
+   commandInfo(MSG_PROJECT_JOIN_REPLY).handler = msg_project_join_reply;
+   commandInfo(MSG_AUTH_REQUEST).handler = msg_auth_request;
+   commandInfo(MSG_PROJECT_LIST).handler = msg_project_list;
+   commandInfo(MSG_SEND_UPDATES).handler = msg_send_updates;
+   commandInfo(MSG_SET_REQ_PERMS).handler = msg_set_req_perms;
+   commandInfo(MSG_GET_REQ_PERMS).handler = msg_get_req_perms;
+   commandInfo(MSG_GET_PROJ_PERMS).handler = msg_get_proj_perms;
+   commandInfo(MSG_SET_PROJ_PERMS).handler = msg_set_proj_perms;
+   commandInfo(MSG_PING).handler = msg_ping;
+   commandInfo(MSG_PONG).handler = msg_pong;
+
+   //these never wait on the database
+   commandInfo(MSG_PROJECT_LEAVE).inlined = true;
+   commandInfo(MSG_PROJECT_JOIN_REPLY).inlined = true;
+   commandInfo(MSG_PING).inlined = true;
+   commandInfo(MSG_PONG).inlined = true;
+
+   commandInfo(COMMAND_UNDEFINE).mask = MASK_UNDEFINE;
+   commandInfo(COMMAND_MAKE_CODE).mask = MASK_MAKE_CODE;
+   commandInfo(COMMAND_MAKE_DATA).mask = MASK_MAKE_DATA;
+
+   commandInfo(COMMAND_SEGM_ADDED).mask = MASK_SEGMENTS;
+   commandInfo(COMMAND_SEGM_DELETED).mask = MASK_SEGMENTS;
+   commandInfo(COMMAND_SEGM_START_CHANGED).mask = MASK_SEGMENTS;
+   commandInfo(COMMAND_SEGM_END_CHANGED).mask = MASK_SEGMENTS;
+   commandInfo(COMMAND_SEGM_MOVED).mask = MASK_SEGMENTS;
+   commandInfo(COMMAND_MOVE_SEGM).mask = MASK_SEGMENTS;
+
+
+   commandInfo(COMMAND_SET_STACK_VAR_NAME).mask = MASK_RENAME;
+   commandInfo(COMMAND_RENAMED).mask = MASK_RENAME;
+
+   commandInfo(COMMAND_FUNC_TAIL_APPENDED).mask = MASK_FUNCTIONS;
+   commandInfo(COMMAND_FUNC_TAIL_REMOVED).mask = MASK_FUNCTIONS;
+   commandInfo(COMMAND_TAIL_OWNER_CHANGED).mask = MASK_FUNCTIONS;
+   commandInfo(COMMAND_FUNC_NORET_CHANGED).mask = MASK_FUNCTIONS;
+   commandInfo(COMMAND_ADD_FUNC).mask = MASK_FUNCTIONS;
+   commandInfo(COMMAND_DEL_FUNC).mask = MASK_FUNCTIONS;
+   commandInfo(COMMAND_SET_FUNC_START).mask = MASK_FUNCTIONS;
+   commandInfo(COMMAND_SET_FUNC_END).mask = MASK_FUNCTIONS;
+
+   commandInfo(COMMAND_BYTE_PATCHED).mask = MASK_BYTE_PATCH;
+
+   commandInfo(COMMAND_AREA_CMT_CHANGED).mask = MASK_COMMENTS;
+   commandInfo(COMMAND_CMT_CHANGED).mask = MASK_COMMENTS;
+
+   commandInfo(COMMAND_TI_CHANGED).mask = MASK_OPTYPES;
+   commandInfo(COMMAND_OP_TI_CHANGED).mask = MASK_OPTYPES;
+   commandInfo(COMMAND_OP_TYPE_CHANGED).mask = MASK_OPTYPES;
+
+   commandInfo(COMMAND_ENUM_CREATED).mask = MASK_ENUMS;
+   commandInfo(COMMAND_ENUM_DELETED).mask = MASK_ENUMS;
+   commandInfo(COMMAND_ENUM_BF_CHANGED).mask = MASK_ENUMS;
+   commandInfo(COMMAND_ENUM_RENAMED).mask = MASK_ENUMS;
+   commandInfo(COMMAND_ENUM_CMT_CHANGED).mask = MASK_ENUMS;
+   commandInfo(COMMAND_ENUM_CONST_CREATED).mask = MASK_ENUMS;
+   commandInfo(COMMAND_ENUM_CONST_DELETED).mask = MASK_ENUMS;
+
+   commandInfo(COMMAND_STRUC_CREATED).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_STRUC_DELETED).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_STRUC_RENAMED).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_STRUC_EXPANDED).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_STRUC_CMT_CHANGED).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_CREATE_STRUC_MEMBER_DATA).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_CREATE_STRUC_MEMBER_STRUCT).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_CREATE_STRUC_MEMBER_REF).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_CREATE_STRUC_MEMBER_STROFF).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_CREATE_STRUC_MEMBER_STR).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_CREATE_STRUC_MEMBER_ENUM).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_STRUC_MEMBER_DELETED).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_SET_STRUCT_MEMBER_NAME).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_STRUC_MEMBER_CHANGED_DATA).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_STRUC_MEMBER_CHANGED_STRUCT).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_STRUC_MEMBER_CHANGED_STR).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_STRUC_MEMBER_CHANGED_OFFSET).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_STRUC_MEMBER_CHANGED_ENUM).mask = MASK_STRUCTS;
+   commandInfo(COMMAND_CREATE_STRUC_MEMBER_OFFSET).mask = MASK_STRUCTS;
+
+   commandInfo(COMMAND_VALIDATE_FLIRT_FUNC).mask = MASK_FLIRT;
+
+   commandInfo(COMMAND_THUNK_CREATED).mask = MASK_THUNK;
+
+   commandInfo(COMMAND_ADD_CREF).mask = MASK_XREF;
+   commandInfo(COMMAND_ADD_DREF).mask = MASK_XREF;
+   commandInfo(COMMAND_DEL_CREF).mask = MASK_XREF;
+   commandInfo(COMMAND_DEL_DREF).mask = MASK_XREF;
 
 }
 
@@ -499,12 +1143,6 @@ bool Client::msg_project_rejoin_request(json_object *obj, Client *c) {
          return res;
       }
    }
-   int lpid = c->cm->gpid2lpid(gpid);
-   if (lpid < 0) {
-      ::logln("Invalid gpid received for project rejoin request", LERROR);
-      c->send_error("Invalid gpid");      
-      return false;
-   }
    uint64_t tpub, tsub;
    uint64_from_json(obj, "pub", &tpub);
    tpub &= 0x7FFFFFFF;
@@ -519,8 +1157,15 @@ bool Client::msg_project_rejoin_request(json_object *obj, Client *c) {
    c->rpublish = tpub;
    c->rsubscribe = tsub;
 //                  ::logln("plugin requested rpub: " + rpublish + " rsub: " + rsubscribe);
+   //the gpid lookup and the join are a single round trip to the database
+   int joined = c->cm->rejoinProject(c, gpid);
+   if (joined == -1) {
+      ::logln("Invalid gpid received for project rejoin request", LERROR);
+      c->send_error("Invalid gpid");
+      return false;
+   }
    json_object *resp = json_object_new_object();
-   if (c->cm->joinProject(c, lpid) >= 0 ) {
+   if (joined >= 0) {
       append_json_int32_val(resp, "reply", JOIN_REPLY_SUCCESS);
       append_json_string_val(resp, "gpid", gpid);
       c->send_data(MSG_PROJECT_JOIN_REPLY, resp);
@@ -554,7 +1199,7 @@ bool Client::msg_project_snapshot_request(json_object *obj, Client *c) {
    }
    json_object *resp = json_object_new_object();
    append_json_int32_val(resp, "reply", response);
-   c->send_data(MSG_PROJECT_SNAPSHOT_REPLY, obj);
+   c->send_data(MSG_PROJECT_SNAPSHOT_REPLY, resp);
    return false;
 }
 
@@ -632,7 +1277,7 @@ bool Client::msg_auth_request(json_object *obj, Client *c) {
 //                  ::logln("in AUTH REQUEST", LDEBUG);
    int pluginversion;
    int32_from_json(obj, "protocol", &pluginversion);
-   if (pluginversion != PROTOCOL_VERSION) {
+   if (pluginversion != PROTOCOL_VERSION && pluginversion != PROTOCOL_FRAMED_VERSION) {
       char buf[256];
       snprintf(buf, sizeof(buf), "Version mismatch. plugin: %d server: %d", pluginversion, PROTOCOL_VERSION);
 #ifdef DEBUG
@@ -672,19 +1317,89 @@ bool Client::msg_auth_request(json_object *obj, Client *c) {
          c->authTries--;
       }
       append_json_int32_val(response, "reply", reply);
-      c->send_data(MSG_AUTH_REPLY, response);
+      int options = c->acceptOptions(pluginversion, obj, response);
+      c->applyOptions(response, options);
       if (c->authTries == 0) {
          ::logln("too many auth attempts for " + c->getUser(), LERROR);
          return true;
       }
    }
    else {
-      ::logln("recv AUTH REQUEST when already authenticated", LERROR);
-      c->send_error("Attempt to Authenticate, when already authenticated");
+      //basic mode clients are authenticated on connect but may still ask for options
+      json_object *response = json_object_new_object();
+      int options = c->acceptOptions(pluginversion, obj, response);
+      if (options != 0) {
+         append_json_int32_val(response, "reply", AUTH_REPLY_SUCCESS);
+         c->applyOptions(response, options);
+      }
+      else {
+         json_object_put(response);
+         ::logln("recv AUTH REQUEST when already authenticated", LERROR);
+         c->send_error("Attempt to Authenticate, when already authenticated");
+      }
    }
    return false;
 }
 
+int Client::acceptOptions(int version, json_object *request, json_object *reply) {
+   int options = 0;
+   if (version == PROTOCOL_FRAMED_VERSION && !isFramed()) {
+      append_json_int32_val(reply, "protocol", PROTOCOL_FRAMED_VERSION);
+      options |= OPTION_FRAMED;
+   }
+   const char *compress = string_from_json(request, "compress");
+   if (compress != NULL && !conn->isCompressed() && cm->getCompressionLevel() != 0) {
+      if (strcmp(compress, COMPRESS_ZLIB) == 0) {
+         options |= OPTION_ZLIB;
+      }
+      else if (strcmp(compress, COMPRESS_ZLIB_DICT) == 0) {
+         options |= OPTION_ZLIB_DICT;
+      }
+      if (options & (OPTION_ZLIB | OPTION_ZLIB_DICT)) {
+         append_json_string_val(reply, "compress", compress);
+      }
+   }
+   bool heartbeat;
+   if (bool_from_json(request, "heartbeat", &heartbeat) && heartbeat && !heartbeats && cm->getHeartbeatInterval() != 0) {
+      //tell the client how often to expect a ping when it is quiet
+      append_json_int32_val(reply, "heartbeat", cm->getHeartbeatInterval());
+      options |= OPTION_HEARTBEAT;
+   }
+   return options;
+}
+
+void Client::applyOptions(json_object *reply, int options) {
+   if (options == 0) {
+      send_data(MSG_AUTH_REPLY, reply);
+      return;
+   }
+   //the handler may be running on a ControlPool worker
+   optionsReply = reply;
+   pendingOptions = options;
+}
+
+void Client::switchOptions() {
+   if (optionsReply == NULL) {
+      return;
+   }
+   int options = pendingOptions;
+   send_data(MSG_AUTH_REPLY, optionsReply);
+   optionsReply = NULL;
+   //the auth_reply is the last message sent as is, both sides switch right after it
+   pthread_mutex_lock(&outLock);
+   if (options & (OPTION_ZLIB | OPTION_ZLIB_DICT)) {
+      conn->startCompression(cm->getCompressionLevel(), (options & OPTION_ZLIB_DICT) != 0);
+   }
+   if (options & OPTION_FRAMED) {
+      conn->setFramed();
+   }
+   pthread_mutex_unlock(&outLock);
+   if (options & OPTION_HEARTBEAT) {
+      heartbeats = true;
+      cm->getReactor()->track(this);
+   }
+}
+
 bool Client::msg_project_list(json_object *obj, Client *c) {
    if (!c->authenticated) {
       //nice try!!
@@ -750,7 +1465,17 @@ bool Client::msg_send_updates(json_object *obj, Client *c) {
 //      ::logln("Received client->send_UPDATES request for " + lastupdate + " to current", LINFO1);
       uint64_t lastupdate;
       uint64_from_json(obj, "last_update", &lastupdate);
-      c->cm->sendLatestUpdates(c, lastupdate);
+      if (c->basicMode) {
+         c->cm->sendLatestUpdates(c, lastupdate);
+         return false;
+      }
+      //the catch up runs as a resync, one chunk at a time as the client drains
+      //them, with live updates held back until it reaches the newest update
+      pthread_mutex_lock(&c->outLock);
+      c->lastQueued = lastupdate;
+      c->lagging = true;
+      pthread_mutex_unlock(&c->outLock);
+      c->resync();
    }
    return false;
 }
@@ -880,3 +1605,13 @@ bool Client::msg_set_proj_perms(json_object *obj, Client *c) {
    delete pi;
    return false;
 }
+
+bool Client::msg_ping(json_object *obj, Client *c) {
+   c->send_data(MSG_PONG, NULL);
+   return false;
+}
+
+bool Client::msg_pong(json_object *obj, Client *c) {
+   //processMsg has already noted that the client is alive
+   return false;
+}
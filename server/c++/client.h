@@ -22,8 +22,10 @@
 #define __CLIENT_H
 
 #include <map>
+#include <deque>
 #include <string>
 #include <stdint.h>
+#include <pthread.h>
 #include <json-c/json.h>
 #include "utils.h"
 
@@ -31,9 +33,22 @@ using namespace std;
 
 class ConnectionManagerBase;
 class Client;
+class Reactor;
 
 typedef bool (*ClientMsgHandler)(json_object *obj, Client *c);
 
+//connection options a client may negotiate in its auth_request
+#define OPTION_FRAMED       1   //protocol PROTOCOL_FRAMED_VERSION
+#define OPTION_ZLIB         2   //compress COMPRESS_ZLIB
+#define OPTION_ZLIB_DICT    4   //compress COMPRESS_ZLIB_DICT
+#define OPTION_HEARTBEAT    8   //heartbeat, the client answers pings
+
+//reasons reading from a client may be paused
+#define PAUSE_RATE          0   //the client has published faster than PUBLISH_RATE
+#define PAUSE_BACKLOG       1   //its project has PROJECT_BACKLOG_HWM updates waiting to be dispatched
+#define PAUSE_CONTROL       2   //one of its control messages is being handled by the ControlPool
+#define PAUSE_REASONS       3
+
 /**
  * Client
  * This class is responsible for a single client connection
@@ -48,12 +63,47 @@ typedef bool (*ClientMsgHandler)(json_object *obj, Client *c);
 class Client {
 public:
 
+   /**
+    * the new client holds a single reference, owned by its connection and
+    * released once the Reactor has torn the connection down
+    */
    Client(ConnectionManagerBase *mgr, NetworkIO *s, bool basic);
 
+   /**
+    * ref adds a reference to this client, keeping it from being destroyed
+    * @return this client
+    */
+   Client *ref() {
+      __sync_add_and_fetch(&refs, 1);
+      return this;
+   }
+
+   /**
+    * release drops a reference. Once none remain the client is retired
+    * through Epoch, as a dispatcher may still be looping over a ClientSet
+    * snapshot that holds it.
+    */
+   void release();
+
    void start();
    
    static void *run(void *arg);
 
+   /**
+    * onEvent is called by a Reactor thread when this client's socket is ready
+    * @param events the EPOLL* events reported for the socket
+    * @return false if the connection should be torn down
+    */
+   bool onEvent(uint32_t events);
+
+   /**
+    * getFileDescriptor inspector to get the socket underlying this client's connection
+    * @return the socket descriptor
+    */
+   int getFileDescriptor() {
+      return conn->getFileDescriptor();
+   }
+
    /**
     * logs a message to the configured log file (in the ConnectionManager)
     * @param msg the string to log
@@ -137,10 +187,66 @@ public:
    }
 
    /**
-    * post is the function that actually posts updates to clients (if subscribing)
-    * @param data the bytearray containing the update to send
+    * isFramed inspector to see whether this client has negotiated binary frames
+    * @return true if messages to this client must be encoded as frames
+    */
+   bool isFramed() {
+      return conn->isFramed();
+   }
+
+   /**
+    * isCompressed inspector to see whether this client has negotiated compression
+    * @return true if messages to this client are deflated before they are sent
     */
-   void post(const char *msg, json_object *obj);
+   bool isCompressed() {
+      return conn->isCompressed();
+   }
+
+   /**
+    * subscribes checks whether this client may receive updates of a given command
+    * @param command the id of the command of the update (see frameCommandId)
+    * @return true if the client subscribes to command
+    */
+   bool subscribes(uint16_t command) {
+      return checkPermissions(command, subscribe);
+   }
+
+   /**
+    * post is the function that actually posts updates to clients (if subscribing).
+    * The update is only queued, so that a burst of them can be written together,
+    * the caller must call flush once it is done posting.
+    * @param cmd the id of the command of the update
+    * @param wire the encoded update, shared with other recipients
+    * @param updateid the id of the update
+    * @param pid the project of the update, which is dropped unless this client is still a member
+    */
+   void post(uint16_t cmd, EncodedPacket *wire, uint64_t updateid, int pid);
+
+   /**
+    * setMember records the project whose updates this client receives. Once
+    * it returns, updates of any other project are no longer posted to this
+    * client, even by a dispatcher still looping over an older ClientSet.
+    * Only the ProjectMap may call this.
+    * @param p the project, -1 for none
+    * @return the previous project, -1 for none
+    */
+   int setMember(int p);
+
+   /**
+    * flush writes everything queued by post, unless the Reactor is already
+    * waiting for the socket to drain
+    */
+   void flush();
+
+   /**
+    * replay sends a stored update to this client as part of a catch up. Unlike
+    * post, replayed updates are not subject to the outbound queue high-water mark
+    * @param cmd the id of the command of the update, FRAME_NAMED if it has none
+    * @param updateid the id of the update
+    * @param wire the encoded update, including its updateid, ownership passes to the client,
+    *        NULL to move past an update that can't be sent
+    */
+   void replay(uint16_t cmd, uint64_t updateid, EncodedPacket *wire);
    
    /**
     * similar to post, but does not check subscription status, and takes command as a arg
@@ -148,8 +254,16 @@ public:
     * because these messages do not contain an updateid
     * @param command the command to send
     * @param data the data associated with the command
+    * @param flush false to only queue the message, as post does
+    */
+   void send_data(const char *command, json_object *obj, bool flush = true);
+
+   /**
+    * ack queues the ack_updateid that returns the id of an update this
+    * client posted, leaving the write to a later flush
+    * @param updateid the id of the update
     */
-   void send_data(const char *command, json_object *obj);
+   void ack(uint64_t updateid);
 
    /**
     * sendForkFollow sends a FORKFOLLOW message to the client, this occurs when another
@@ -186,6 +300,26 @@ public:
     */
    void terminate();
 
+   /**
+    * evict disconnects a client that has stopped answering heartbeats. The
+    * connection is shut down, and torn down by whoever reads from it.
+    */
+   void evict();
+
+   /**
+    * pause stops reading from this client until resume is called for the same
+    * reason. Messages already read are still processed.
+    * @param why the PAUSE_ reason
+    * @return false if reading was already paused for that reason
+    */
+   bool pause(int why);
+
+   /**
+    * resume lifts a pause, reading continues once no reason for a pause remains
+    * @param why the PAUSE_ reason
+    */
+   void resume(int why);
+
    /**
     * dumpStats displace the receive / transmit stats for each command  
     */
@@ -304,6 +438,12 @@ public:
    }
 
 private:
+   friend class Reactor;
+   friend class ControlPool;
+
+   ~Client();
+   static void destroy(void *obj);
+
    /**
     * checkPermissions checks to see if the current client has permissions to perform an operation
     * @param command the command to check permissions on
@@ -313,10 +453,154 @@ private:
     * for example all the segment operations (add, del, start/end change, etc) are grouped into 
     * 'segment' permissions. 
     */ 
-   bool checkPermissions(const char *command, uint64_t permType);  
+   bool checkPermissions(uint16_t command, uint64_t permType);  
    static void init_handlers(); 
 
+   /**
+    * processMsg dispatches a single incoming message to its handler, or posts it
+    * @param obj the message to process, released by this function
+    * @return true if the connection should be closed
+    */
+   bool processMsg(json_object *obj);
+
+   /**
+    * acceptOptions picks the connection options of an auth_request that the server
+    * supports and that are not already in effect, and adds them to the auth_reply
+    * @param version the protocol version of the request
+    * @param request the auth_request
+    * @param reply the auth_reply to be sent
+    * @return the accepted OPTION_ flags
+    */
+   int acceptOptions(int version, json_object *request, json_object *reply);
+
+   /**
+    * applyOptions sends the auth_reply that accepted a set of options and puts
+    * them into effect. Switching the input side changes the connection's read
+    * state, so unless there are no options the reply is held for the thread
+    * that reads from the client, see switchOptions
+    * @param reply the auth_reply, ownership passes to the client
+    * @param options the result of acceptOptions
+    */
+   void applyOptions(json_object *reply, int options);
+
+   /**
+    * switchOptions sends an auth_reply held by applyOptions and switches both
+    * directions of the connection to the options it accepted. Only the thread
+    * that reads from the client may call this, so that nothing is received
+    * while the input side changes and nothing the peer sends after the reply
+    * is read the old way.
+    */
+   void switchOptions();
+
+   /**
+    * throttle charges an update about to be posted against this client's
+    * PUBLISH_RATE, pausing reading for as long as the client is over its rate,
+    * and counts the update against its project's dispatch backlog
+    */
+   void throttle();
+
+   /**
+    * waitWhilePaused blocks a reader thread until reading is no longer paused
+    */
+   void waitWhilePaused();
+
+   bool onReadable();
+   bool onWritable();
+
+   /**
+    * onReceived is called by a Reactor thread in uring mode with data that
+    * has been received from this client's socket
+    * @param data the received bytes
+    * @param len the number of bytes received
+    * @return false if the connection should be torn down
+    */
+   bool onReceived(const void *data, uint32_t len);
+
+   /**
+    * processMsgs hands each message read from the socket to processMsg
+    * @param msgs the messages, all of which are released
+    * @param ok false if reading them ended in an error
+    * @return false if the connection should be torn down
+    */
+   bool processMsgs(vector<json_object*> &msgs, bool ok);
+
+   /**
+    * submitControl hands a control message to the ControlPool, pausing
+    * reading from this client until it has been handled
+    * @param cmd the command of the message
+    * @param obj the message, ownership passes to the pool
+    * @param h the handler of cmd
+    */
+   void submitControl(const char *cmd, json_object *obj, ClientMsgHandler h);
+
+   /**
+    * runControl is called by a ControlPool worker to handle a control message
+    * submitted by submitControl, and releases the reference the task held
+    * @param obj the message, which is released by this function
+    * @param h the handler of the message
+    */
+   void runControl(json_object *obj, ClientMsgHandler h);
+
+   /**
+    * onControlDone is called by the client's Reactor loop once a control
+    * message has been handled, to process the messages that arrived
+    * meanwhile and resume reading
+    * @return false if the connection should be torn down
+    */
+   bool onControlDone();
+
+   /**
+    * queue appends a message to the outbound queue and writes as much of the
+    * queue as the socket will accept. Must be called with outLock held.
+    * @param msg the message, the queue takes over the caller's reference to it
+    * @param flush false to leave the write to a later flush
+    */
+   void queue(EncodedPacket *msg, bool flush = true);
+
+   /**
+    * send queues a message unless the connection is closing
+    * @param msg the message, the queue takes over the caller's reference to it
+    * @param flush false to leave the write to a later flush
+    */
+   void send(EncodedPacket *msg, bool flush);
+
+   /**
+    * updateInterest asks the Reactor for write notifications while output
+    * remains queued. Must be called with outLock held.
+    * @param remain the result of the last flush of the outbound queue
+    * @return false if the connection has failed
+    */
+   bool updateInterest(int remain);
+
+   /**
+    * overflow applies the configured overflow policy once a live update would
+    * push the outbound queue past its high-water mark. Must be called with outLock held.
+    * @param updateid the id of the update that did not fit
+    */
+   void overflow(uint64_t updateid);
+
+   /**
+    * resync replays the next chunk of the updates dropped while this client was
+    * lagging. Once the last chunk is queued live delivery resumes, otherwise the
+    * next chunk follows when this one has drained.
+    */
+   void resync();
+
+   /**
+    * resyncChunk does the work of resync for a caller that has already set resyncing
+    */
+   void resyncChunk();
+
+   /**
+    * releaseHeld ends tailing. Must be called with outLock held.
+    * @param deliver true to queue the held updates the resync did not replay, false to drop them all
+    */
+   void releaseHeld(bool deliver);
+
+   uint32_t baseEvents();
+
    NetworkIO *conn;
+   volatile int refs;
    string hash;
    string username;
 
@@ -343,7 +627,57 @@ private:
    
    bool basicMode;
 
-   static map<string,ClientMsgHandler> *handlers;
+   //outbound queue state, guarded by outLock (recursive)
+   pthread_mutex_t outLock;
+   bool lagging;          //live updates are dropped until the queue drains and a resync runs
+   bool resyncing;        //a chunk of a resync is queued or being replayed
+   bool tailing;          //the last chunk of a resync is being replayed, live updates are held
+   map<uint64_t, EncodedPacket*> held;   //live updates posted while tailing, by updateid
+   uint32_t heldBytes;
+   bool closing;          //the connection has been shut down, nothing more is queued
+   int member;            //the project whose updates are posted to this client, -1 for none
+   uint64_t lastQueued;   //the last update delivered, or queued for delivery, to this client
+   uint64_t resyncMark;   //live updates up to this id were already delivered by a resync
+   uint32_t peakQueued;
+   uint32_t overflows;
+   uint32_t resyncs;
+   uint64_t dropped;
+
+   //Reactor registration, guarded by outLock
+   int loop;              //index of the owning Reactor loop, -1 if none yet
+   uint32_t events;       //EPOLL* events currently registered
+   bool registered;
+   bool polled;           //reads are serviced by the Reactor rather than a thread
+   //uring mode only
+   volatile int inflight; //recv and poll requests outstanding on the ring
+   bool receiving;        //a recv has been queued
+   bool pollingOut;       //a POLLOUT has been queued
+   bool dying;            //torn down, deleted once nothing is outstanding
+   bool recvCancelled;    //the recv has been cancelled while reading is paused
+   uint64_t wakeAt;       //when the owning loop lifts a PAUSE_RATE, 0 if not scheduled. Only the loop touches this
+
+   //heartbeat timer wheel links, guarded by the owning loop's mutex
+   Client *wheelNext;
+   Client *wheelPrev;
+   uint64_t wheelDue;              //the tick the client is filed under, 0 if not on the wheel
+   volatile uint64_t lastHeard;    //monotonic_ms of the last message received
+   bool heartbeats;                //OPTION_HEARTBEAT is in effect
+
+   //publish flow control, guarded by outLock
+   uint32_t paused;                  //a bit for each PAUSE_ reason in effect
+   pthread_cond_t resumed;           //signalled when a reader thread may continue
+   uint64_t pausedAt[PAUSE_REASONS];
+   uint32_t pauses[PAUSE_REASONS];   //how often reading was paused for each reason
+   uint64_t pausedMs[PAUSE_REASONS]; //and for how long in all
+   //control messages handled by the ControlPool, only touched by the thread reading from the client
+   bool controlBusy;                 //a control message is outstanding, later messages wait in deferred
+   deque<json_object*> deferred;
+   json_object *optionsReply;        //an auth_reply held by applyOptions, NULL if none
+   int pendingOptions;               //the options optionsReply accepted
+   //PUBLISH_RATE token bucket, only touched by the thread reading from the client
+   double tokens;
+   uint64_t tokensAt;
+
 
    static bool msg_project_new_request(json_object *obj, Client *c);
    static bool msg_project_join_request(json_object *obj, Client *c);
@@ -360,6 +694,8 @@ private:
    static bool msg_get_req_perms(json_object *obj, Client *c);
    static bool msg_get_proj_perms(json_object *obj, Client *c);
    static bool msg_set_proj_perms(json_object *obj, Client *c);
+   static bool msg_ping(json_object *obj, Client *c);
+   static bool msg_pong(json_object *obj, Client *c);
 
 };
 
@@ -18,54 +18,115 @@
    Place, Suite 330, Boston, MA 02111-1307 USA
  */
 
+#include <algorithm>
+
 #include "client.h"
 #include "clientset.h"
+#include "epoch.h"
+
+typedef vector<Client*>::iterator Client_it;
 
-typedef set<Client*>::iterator Client_it;
+static void destroySnapshot(void *obj) {
+   delete (vector<Client*>*)obj;
+}
 
 ClientSet::ClientSet() {
-   pthread_mutexattr_t attr;
-   pthread_mutexattr_init(&attr);
-   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-   pthread_mutex_init(&mutex, &attr); 
-   pthread_mutexattr_destroy(&attr);
+   clients = new vector<Client*>;
+   pthread_mutex_init(&mutex, NULL); 
+   refs = 1;
+   closed = false;
 }
 
 ClientSet::~ClientSet() {
+   delete clients;
    pthread_mutex_destroy(&mutex);
 }
 
+void ClientSet::destroy(void *obj) {
+   delete (ClientSet*)obj;
+}
+
+bool ClientSet::tryRef() {
+   int r = refs;
+   while (r != 0) {
+      int prev = __sync_val_compare_and_swap(&refs, r, r + 1);
+      if (prev == r) {
+         return true;
+      }
+      r = prev;
+   }
+   return false;
+}
+
+void ClientSet::release() {
+   if (__sync_sub_and_fetch(&refs, 1) == 0) {
+      Epoch::retire(this, destroy);
+   }
+}
+
+/**
+ * publish replaces the current snapshot, must be called with mutex held
+ * @param next the new snapshot, which may no longer be modified
+ */
+void ClientSet::publish(vector<Client*> *next) {
+   vector<Client*> *prev = clients;
+   __sync_synchronize();
+   clients = next;
+   Epoch::retire(prev, destroySnapshot);
+}
+
 //add a new client
-void ClientSet::add(Client *c) {
+bool ClientSet::add(Client *c) {
    pthread_mutex_lock(&mutex);
-   clients.insert(c);
+   bool ok = !closed;
+   if (ok && find(clients->begin(), clients->end(), c) == clients->end()) {
+      vector<Client*> *next = new vector<Client*>(*clients);
+      next->push_back(c);
+      publish(next);
+   }
    pthread_mutex_unlock(&mutex);
+   return ok;
 }
 
 //remove a client
-void ClientSet::remove(Client *c) {
+int ClientSet::remove(Client *c) {
    pthread_mutex_lock(&mutex);
-   clients.erase(c);
+   Client_it i = find(clients->begin(), clients->end(), c);
+   if (i != clients->end()) {
+      vector<Client*> *next = new vector<Client*>(clients->begin(), i);
+      next->insert(next->end(), i + 1, clients->end());
+      publish(next);
+   }
+   int left = clients->size();
+   pthread_mutex_unlock(&mutex);
+   return left;
+}
+
+//close the set if it is empty
+bool ClientSet::close() {
+   pthread_mutex_lock(&mutex);
+   if (clients->empty()) {
+      closed = true;
+   }
+   bool res = closed;
    pthread_mutex_unlock(&mutex);
+   return res;
 }
 
 //iterate over all clients in the set
 void ClientSet::loop(cb func, void *user) {
-   pthread_mutex_lock(&mutex);
-   for (Client_it i = clients.begin(); i != clients.end(); i++) {
+   EpochGuard guard;
+   vector<Client*> *snap = clients;
+   for (Client_it i = snap->begin(); i != snap->end(); i++) {
       Client *c = *i;
       if (!(*func)(c, user)) {
          break;
       }
    }
-   pthread_mutex_unlock(&mutex);
 }
 
 //return the size of the client set
 int ClientSet::size() {
-   pthread_mutex_lock(&mutex);
-   int res = clients.size();
-   pthread_mutex_unlock(&mutex);
-   return res;
+   EpochGuard guard;
+   return clients->size();
 }
-
@@ -36,17 +36,77 @@ using namespace std;
 
 typedef bool (*cb)(Client *c, void *user);
 
+/**
+ * ClientSet
+ * The clients of a single project. The members are published as an
+ * immutable snapshot that add and remove replace with a modified copy, so
+ * loop and size never take a lock and a membership change never waits for
+ * a loop to finish. Replaced snapshots are reclaimed through Epoch.
+ *
+ * A set is reference counted. Once closed it accepts no more clients, and
+ * when its last reference is released it too is reclaimed through Epoch,
+ * so a loop that found it in a ProjectMap snapshot may still finish.
+ */
 class ClientSet {
 private:
-   set<Client*> clients;
-   pthread_mutex_t mutex;
+   vector<Client*> * volatile clients;   //the current snapshot
+   pthread_mutex_t mutex;                //serializes add, remove and close
+   volatile int refs;
+   bool closed;
+
+   ~ClientSet();
+   static void destroy(void *obj);
+   void publish(vector<Client*> *next);
    
 public:
+   /**
+    * the new set holds a single reference
+    */
    ClientSet();
-   ~ClientSet();
 
-   void add(Client *c);
-   void remove(Client *c);
+   /**
+    * ref adds a reference to this set
+    * @return this set
+    */
+   ClientSet *ref() {
+      __sync_add_and_fetch(&refs, 1);
+      return this;
+   }
+
+   /**
+    * tryRef adds a reference unless the last one has already been released,
+    * for use on a set found without holding any reference to it
+    * @return false if the set is being destroyed
+    */
+   bool tryRef();
+
+   /**
+    * release drops a reference, retiring the set when none remain
+    */
+   void release();
+
+   /**
+    * add a client to the set
+    * @return false if the set has been closed
+    */
+   bool add(Client *c);
+
+   /**
+    * remove a client from the set
+    * @return the number of clients left in the set
+    */
+   int remove(Client *c);
+
+   /**
+    * close stops an empty set from accepting any more clients
+    * @return true if the set was empty and is now closed
+    */
+   bool close();
+   /**
+    * loop calls func for every client in the set as of the call, until func
+    * returns false. Clients added or removed meanwhile may or may not be
+    * visited, but no visited client is destroyed before loop returns.
+    */
    void loop(cb func, void *user);
    int size();
 
@@ -0,0 +1,224 @@
+/*
+   collabREate control_pool.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sched.h>
+
+#include "control_pool.h"
+
+static uint64_t monotonicUs() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+LatencyHistogram::LatencyHistogram() {
+   memset(buckets, 0, sizeof(buckets));
+   n = 0;
+   maxUs = 0;
+}
+
+void LatencyHistogram::add(uint64_t us) {
+   int b = 0;
+   while (b < LATENCY_BUCKETS - 1 && us >= (1ULL << b)) {
+      b++;
+   }
+   buckets[b]++;
+   n++;
+   if (us > maxUs) {
+      maxUs = us;
+   }
+}
+
+uint64_t LatencyHistogram::percentile(int p) {
+   uint64_t rank = (n * p + 99) / 100;
+   uint64_t seen = 0;
+   for (int b = 0; b < LATENCY_BUCKETS; b++) {
+      seen += buckets[b];
+      if (seen >= rank && seen != 0) {
+         //nothing counted exceeds the max, and the last bucket is open ended
+         return b < LATENCY_BUCKETS - 1 && (1ULL << b) < maxUs ? (1ULL << b) : maxUs;
+      }
+   }
+   return 0;
+}
+
+ControlPool::ControlPool(int nthreads) {
+   if (nthreads < 1) {
+      nthreads = 1;
+   }
+   sem_init(&ready, 0, 0);
+   next = 0;
+   stolen = 0;
+   pthread_mutex_init(&statsLock, NULL);
+   for (int i = 0; i < nthreads; i++) {
+      Worker *w = new Worker;
+      w->pool = this;
+      w->index = i;
+      pthread_mutex_init(&w->lock, NULL);
+      workers.push_back(w);
+   }
+}
+
+ControlPool::~ControlPool() {
+   for (vector<Worker*>::iterator i = workers.begin(); i != workers.end(); i++) {
+      pthread_mutex_destroy(&(*i)->lock);
+      delete *i;
+   }
+   pthread_mutex_destroy(&statsLock);
+   sem_destroy(&ready);
+}
+
+void ControlPool::start() {
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   for (vector<Worker*>::iterator i = workers.begin(); i != workers.end(); i++) {
+      pthread_t tid;
+      pthread_create(&tid, &attr, run, (void*)*i);
+   }
+   pthread_attr_destroy(&attr);
+}
+
+void ControlPool::submit(Client *c, const char *cmd, json_object *obj, ClientMsgHandler h) {
+   Task *t = new Task;
+   t->c = c;
+   t->cmd = cmd;
+   t->obj = obj;
+   t->handler = h;
+   place(t);
+}
+
+void ControlPool::submitResync(Client *c) {
+   Task *t = new Task;
+   t->c = c;
+   t->cmd = "resync";
+   t->obj = NULL;
+   t->handler = NULL;
+   place(t);
+}
+
+/**
+ * place queues a new task on the next worker in turn
+ */
+void ControlPool::place(Task *t) {
+   t->queuedUs = monotonicUs();
+   Worker *w = workers[__sync_fetch_and_add(&next, 1) % workers.size()];
+   pthread_mutex_lock(&w->lock);
+   w->tasks.push_back(t);
+   pthread_mutex_unlock(&w->lock);
+   sem_post(&ready);
+}
+
+/**
+ * take gets the next task for a worker, stealing from the other workers
+ * when its own queue is empty. The caller must already have claimed a
+ * task from ready, so one is bound to be queued somewhere.
+ */
+ControlPool::Task *ControlPool::take(Worker *w) {
+   while (true) {
+      pthread_mutex_lock(&w->lock);
+      if (!w->tasks.empty()) {
+         Task *t = w->tasks.front();
+         w->tasks.pop_front();
+         pthread_mutex_unlock(&w->lock);
+         return t;
+      }
+      pthread_mutex_unlock(&w->lock);
+      for (unsigned int i = 1; i < workers.size(); i++) {
+         Worker *victim = workers[(w->index + i) % workers.size()];
+         pthread_mutex_lock(&victim->lock);
+         if (!victim->tasks.empty()) {
+            //the newest task, leaving the victim its oldest
+            Task *t = victim->tasks.back();
+            victim->tasks.pop_back();
+            pthread_mutex_unlock(&victim->lock);
+            __sync_add_and_fetch(&stolen, 1);
+            return t;
+         }
+         pthread_mutex_unlock(&victim->lock);
+      }
+      //another worker took the task meant for us between our looks, try again
+      sched_yield();
+   }
+}
+
+/**
+ * run is the body of a single worker thread
+ */
+void *ControlPool::run(void *arg) {
+   Worker *w = (Worker*)arg;
+   ControlPool *pool = w->pool;
+   while (true) {
+      if (sem_wait(&pool->ready) != 0) {
+         continue;   //EINTR
+      }
+      Task *t = pool->take(w);
+      //the handler releases the message cmd points into
+      string cmd = t->cmd;
+      uint64_t start = monotonicUs();
+      if (t->handler != NULL) {
+         t->c->runControl(t->obj, t->handler);
+      }
+      else {
+         t->c->resyncChunk();
+         t->c->release();
+      }
+      uint64_t end = monotonicUs();
+
+      pthread_mutex_lock(&pool->statsLock);
+      CommandStats &cs = pool->commands[cmd];
+      cs.wait.add(start - t->queuedUs);
+      cs.run.add(end - start);
+      pthread_mutex_unlock(&pool->statsLock);
+      delete t;
+   }
+   return NULL;
+}
+
+string ControlPool::stats() {
+   string sb;
+   char buf[256];
+   unsigned int queued = 0;
+   for (vector<Worker*>::iterator i = workers.begin(); i != workers.end(); i++) {
+      pthread_mutex_lock(&(*i)->lock);
+      queued += (*i)->tasks.size();
+      pthread_mutex_unlock(&(*i)->lock);
+   }
+   snprintf(buf, sizeof(buf), "Control pool: %u threads, %u queued, %" PRIu64 " stolen\n",
+            (unsigned int)workers.size(), queued, stolen);
+   sb += buf;
+   pthread_mutex_lock(&statsLock);
+   for (map<string,CommandStats>::iterator i = commands.begin(); i != commands.end(); i++) {
+      CommandStats &cs = i->second;
+      snprintf(buf, sizeof(buf),
+               "   %s: %" PRIu64 " tasks, wait p50 <= %" PRIu64 " us, p99 <= %" PRIu64 " us, max %" PRIu64 " us"
+               ", run p50 <= %" PRIu64 " us, p99 <= %" PRIu64 " us, max %" PRIu64 " us\n",
+               i->first.c_str(), cs.run.count(),
+               cs.wait.percentile(50), cs.wait.percentile(99), cs.wait.max(),
+               cs.run.percentile(50), cs.run.percentile(99), cs.run.max());
+      sb += buf;
+   }
+   pthread_mutex_unlock(&statsLock);
+   return sb;
+}
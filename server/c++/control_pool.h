@@ -0,0 +1,155 @@
+/*
+   collabREate control_pool.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __CONTROL_POOL_H
+#define __CONTROL_POOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <json-c/json.h>
+
+#include "client.h"
+
+using namespace std;
+
+#define LATENCY_BUCKETS 32
+
+/**
+ * LatencyHistogram counts latencies in power of 2 microsecond buckets
+ */
+class LatencyHistogram {
+public:
+   LatencyHistogram();
+
+   /**
+    * add counts a single latency
+    * @param us the latency in microseconds
+    */
+   void add(uint64_t us);
+
+   /**
+    * percentile estimates a percentile of the latencies counted so far
+    * @param p the percentile, 0 to 100
+    * @return the upper bound of the bucket the percentile falls in, or the max if lower
+    */
+   uint64_t percentile(int p);
+
+   uint64_t count() {
+      return n;
+   }
+
+   uint64_t max() {
+      return maxUs;
+   }
+
+private:
+   uint64_t buckets[LATENCY_BUCKETS];   //bucket i counts latencies below 2^i us
+   uint64_t n;
+   uint64_t maxUs;
+};
+
+/**
+ * ControlPool
+ * A fixed number of worker threads that run the handlers of client control
+ * messages, and the chunks of lagging clients' resyncs, most of which wait
+ * on the database, away from the threads that read from clients. Each worker owns a queue of tasks, takes work from the
+ * front of its own queue, and steals from the back of another worker's
+ * queue when its own is empty. At most one control message of a client is
+ * outstanding at a time, as reading from the client pauses until its task
+ * has completed (see Client::submitControl), so the queues are bounded by
+ * the number of clients and messages are still handled in the order they
+ * were sent. Queue wait and run time are kept per command.
+ */
+class ControlPool {
+public:
+   /**
+    * @param nthreads the number of worker threads
+    */
+   ControlPool(int nthreads);
+   ~ControlPool();
+
+   /**
+    * start launches the worker threads
+    */
+   void start();
+
+   /**
+    * submit queues a control message to be handled by a worker, which calls
+    * Client::runControl
+    * @param c the client, the task takes over the caller's reference to it
+    * @param cmd the command of the message, which points into obj
+    * @param obj the message, ownership passes to the task
+    * @param h the handler of cmd
+    */
+   void submit(Client *c, const char *cmd, json_object *obj, ClientMsgHandler h);
+
+   /**
+    * submitResync queues the next chunk of a lagging client's resync, which
+    * a worker replays with Client::resyncChunk
+    * @param c the client, the task takes over the caller's reference to it
+    */
+   void submitResync(Client *c);
+
+   /**
+    * stats reports task counts and latency percentiles for each command
+    * @return a printable summary
+    */
+   string stats();
+
+private:
+   struct Task {
+      Client *c;
+      const char *cmd;
+      json_object *obj;
+      ClientMsgHandler handler;   //NULL for a resync
+      uint64_t queuedUs;
+   };
+
+   struct Worker {
+      ControlPool *pool;
+      unsigned int index;
+      pthread_mutex_t lock;   //guards tasks
+      deque<Task*> tasks;
+   };
+
+   struct CommandStats {
+      LatencyHistogram wait;   //submit to start
+      LatencyHistogram run;
+   };
+
+   static void *run(void *arg);
+   void place(Task *t);
+   Task *take(Worker *w);
+
+   vector<Worker*> workers;
+   sem_t ready;               //counts queued tasks across all workers
+   volatile unsigned int next;   //round robin placement of new tasks
+   volatile uint64_t stolen;
+
+   pthread_mutex_t statsLock;   //guards commands
+   map<string,CommandStats> commands;
+};
+
+#endif
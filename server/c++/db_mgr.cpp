@@ -26,16 +26,20 @@
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <time.h>
+#include <unistd.h>
 #include <openssl/md5.h>
 #include <json-c/json.h>
 
 #include "utils.h"
 #include "db_mgr.h"
 #include "proj_info.h"
-#include "clientset.h"
+#include "frame.h"
 
 using namespace std;
 
+//number of fresh gpids tried before giving up on creating a fork
+#define FORK_ATTEMPTS 8
+
 uint8_t *HmacMD5(const uint8_t *msg, int mlen, const uint8_t *key, int klen) {
    uint8_t ipad[64];
    uint8_t opad[64];
@@ -66,8 +70,12 @@ uint8_t *HmacMD5(const uint8_t *msg, int mlen, const uint8_t *key, int klen) {
    return res;
 }
 
-void DatabaseConnectionManager::init_queries() {
-   sem_init(&pu_sem, 0, 1);
+/**
+ * init_queries prepares every statement used by the manager on a single
+ * pooled connection
+ * @param dbConn a newly established connection
+ */
+void DatabaseConnectionManager::init_queries(PGconn *dbConn) {
    PGresult *res = PQprepare(dbConn, "postUpdate", 
                        "insert into updates (username,pid,cmd,json) values ($1,$2,$3,$4) returning updateid;",
                        0, NULL);
@@ -75,7 +83,13 @@ void DatabaseConnectionManager::init_queries() {
       fprintf(stderr, "postUpdate: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&ap_sem, 0, 1);
+   res = PQprepare(dbConn, "reserveUpdateIds",
+                   "select nextval('updates_updateid_seq') from generate_series(1, $1::integer);",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "reserveUpdateIds: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
    res = PQprepare(dbConn, "addProject", 
                    "insert into projects (hash,gpid,description,owner,pub,sub,protocol) values ($1,$2,$3,$4,$5,$6,$7) returning pid;",
                    0, NULL);
@@ -83,7 +97,6 @@ void DatabaseConnectionManager::init_queries() {
       fprintf(stderr, "addProject: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&aps_sem, 0, 1);
    res = PQprepare(dbConn, "addProjectSnap", 
                    "insert into projects (hash,gpid,description,owner,snapupdateid,protocol) values ($1,$2,$3,$4,$5,$6) returning pid;",
                    0, NULL);
@@ -91,7 +104,6 @@ void DatabaseConnectionManager::init_queries() {
       fprintf(stderr, "addProjectSnap: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&apf_sem, 0, 1);
    res = PQprepare(dbConn, "addProjectFork", 
                    "insert into forklist (child,parent) values ($1,$2) returning fid;",
                    0, NULL);
@@ -99,7 +111,22 @@ void DatabaseConnectionManager::init_queries() {
       fprintf(stderr, "addProjectFork: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&fpbh_sem, 0, 1);
+   //$5/$6 null inherit pub/sub from project $8, $9 null requires $8 to be a snapshot
+   res = PQprepare(dbConn, "addProjectFrom", 
+                   "insert into projects (hash,gpid,description,owner,pub,sub,protocol) select $1,$2,$3,$4,coalesce($5,p.pub),coalesce($6,p.sub),$7 from projects p left join forklist f on f.child = p.pid where p.pid = $8 and coalesce($9,f.parent) is not null returning pid;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "addProjectFrom: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
+   //$3/$4 null take the source and fork point from snapshot $2
+   res = PQprepare(dbConn, "addForkOfNew", 
+                   "insert into forklist (child,parent,source,forkupdateid) select c.pid,p.pid,coalesce($3,f.parent),coalesce($4,p.snapupdateid) from projects c, projects p left join forklist f on f.child = p.pid where c.gpid = $1 and p.pid = $2 returning fid;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "addForkOfNew: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
    res = PQprepare(dbConn, "findProjectsByHash", 
                    "select p.pid,p.hash,p.gpid,p.description,f.parent,p.snapupdateid,q.description,p.pub,p.sub,p.owner,p.protocol from projects p left join (forklist f left join projects q on f.parent=q.pid) on p.pid = f.child where p.hash = $1 order by p.pid asc;",
                    0, NULL);
@@ -107,7 +134,6 @@ void DatabaseConnectionManager::init_queries() {
       fprintf(stderr, "findProjectsByHash: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&fpbp_sem, 0, 1);
    res = PQprepare(dbConn, "findProjectByPid", 
                    "select p.pid,p.hash,p.gpid,p.snapupdateid,p.description,f.parent,q.description,p.pub,p.sub,p.owner,p.protocol from projects p left join (forklist f left join projects q on f.parent=q.pid) on p.pid=f.child where p.pid = $1 order by p.pid asc;",
                    0, NULL);
@@ -115,7 +141,6 @@ void DatabaseConnectionManager::init_queries() {
       fprintf(stderr, "findProjectByPid: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&fpbg_sem, 0, 1);
    res = PQprepare(dbConn, "findProjectByGpid", 
                    "select pid,hash,gpid,protocol from projects where gpid = $1 order by pid asc;",
                    0, NULL);
@@ -123,7 +148,13 @@ void DatabaseConnectionManager::init_queries() {
       fprintf(stderr, "findProjectByGpid: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&gui_sem, 0, 1);
+   res = PQprepare(dbConn, "findProjectByGpidInfo", 
+                   "select p.pid,p.hash,p.gpid,p.snapupdateid,p.description,f.parent,q.description,p.pub,p.sub,p.owner,p.protocol from projects p left join (forklist f left join projects q on f.parent=q.pid) on p.pid=f.child where p.gpid = $1 order by p.pid asc;",
+                   0, NULL);
+   if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      fprintf(stderr, "findProjectByGpidInfo: %s\n", PQerrorMessage(dbConn));
+   }
+   PQclear(res);
    res = PQprepare(dbConn, "getUserInfo", 
                    "select userid,pwhash,pub,sub from users where username = $1 order by userid asc;",
                    0, NULL);
@@ -131,24 +162,20 @@ void DatabaseConnectionManager::init_queries() {
       fprintf(stderr, "getUserInfo: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&glu_sem, 0, 1);
    res = PQprepare(dbConn, "getLatestUpdates", 
-                   "select updateid,cmd,json from updates where updateid > $1 and pid = $2 order by updateid asc;",
+                   "select u.updateid,u.cmd,u.json from project_lineage($2) l join updates u on u.pid = l.pid where u.updateid > $1 and u.updateid <= l.maxid order by u.updateid asc limit $3::integer;",
                    0, NULL);
    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
       fprintf(stderr, "getLatestUpdates: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&cu_sem, 0, 1);
-   res = PQprepare(dbConn, "copyUpdates", 
-                   "select copy_updates($1, $2, $3);",
-//                   "begin; create temporary table tmptable (like updates) on commit drop; insert into tmptable select * from updates where pid = $1 and updateid <= $2; update only tmptable set pid=$3; insert into updates (select * from tmptable); commit;",
+   res = PQprepare(dbConn, "lastProjectUpdate", 
+                   "select coalesce(max(updateid), 0)::bigint from updates where pid = $1;",
                    0, NULL);
    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-      fprintf(stderr, "copyUpdates: %s\n", PQerrorMessage(dbConn));
+      fprintf(stderr, "lastProjectUpdate: %s\n", PQerrorMessage(dbConn));
    }
    PQclear(res);
-   sem_init(&ppu_sem, 0, 1);
    res = PQprepare(dbConn, "projectPermsUpdate", 
                    "update projects set pub=$1,sub=$2 where pid=$3",
                    0, NULL);
@@ -189,48 +216,69 @@ DatabaseConnectionManager::DatabaseConnectionManager(json_object *conf) : Connec
       fprintf(stderr, "%s:%s\n", (*i).first.c_str(), (*i).second.c_str());
    }
    keywords[idx] = values[idx] = NULL;
-   dbConn = PQconnectdbParams(keywords, values, 0);
+   int poolSize = getIntOption(conf, "DB_POOL_SIZE", 4);
+   pool = new DbPool(keywords, values, poolSize, init_queries);
 //   memset(dbPass, 0, strlen(dbPass));
+   delete [] keywords;
+   delete [] values;
 
-   /* Check to see that the backend connection was successfully made */
-   if (PQstatus(dbConn) != CONNECTION_OK) {
-      fprintf(stderr, "Connection to database failed: %s\n", PQerrorMessage(dbConn));
-      PQfinish(dbConn);
+   catchupChunk = getIntOption(conf, "CATCHUP_CHUNK", 1000);
+   if (catchupChunk < 1) {
+      catchupChunk = 1;
    }
-   else {
-      init_queries();
+   archive = NULL;
+   string archiveDir = getStringOption(conf, "ARCHIVE_DIR", "");
+   if (archiveDir.length() > 0) {
+      archive = new UpdateArchive(archiveDir);
+      verifyArchive();
    }
-   delete [] keywords;
-   delete [] values;
+   writer = new UpdateWriter(this, pool, getIntOption(conf, "DB_BATCH_SIZE", 256),
+                             getIntOption(conf, "DB_BATCH_LINGER_MS", 2), archive);
+   writer->start();
 }
 
 DatabaseConnectionManager::~DatabaseConnectionManager() {
-   PGresult *res = PQexec(dbConn, "DEALLOCATE postUpdate;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE postUpdate;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE addProject;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE addProjectSnap;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE addProjectFork;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE findProjectsByHash;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE findProjectByPid;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE findProjectByGpid;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE getUserInfo;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE getLatestUpdates;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE copyUpdates;");
-   PQclear(res);
-   res = PQexec(dbConn, "DEALLOCATE projectPermsUpdate;");
-   PQclear(res);
-   PQfinish(dbConn);
-   dbConn = NULL;
+   delete pool;
+}
+
+/**
+ * verifyArchive checks each update log left by an earlier run against the
+ * updates table, as a log that missed the last updates stored before the
+ * server went down can't be used
+ */
+void DatabaseConnectionManager::verifyArchive() {
+   static const int plens[1] = {4};
+   static const int pformats[1] = {1};
+
+   vector<int> pids = archive->projects();
+   for (vector<int>::iterator i = pids.begin(); i != pids.end(); i++) {
+      int pid = htonl(*i);
+      const char * const parms[1] = {(char*)&pid};
+      PGconn *dbConn = pool->checkout();
+      PGresult *rset = PQexecPrepared(dbConn, "lastProjectUpdate",
+                          1, //int nParams,   size of arrays that follow
+                          parms, //parms,  //const char * const *paramValues, array of string values
+                          plens, //const int *paramLengths,
+                          pformats, //const int *paramFormats,
+                          1); //int resultFormat); 0 == text, 1 == binary
+      pool->checkin(dbConn);
+      if (PQresultStatus(rset) != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
+         //left unverified, the log is started over by the project's next update
+         fprintf(stderr, "lastProjectUpdate: %s\n", PQresultErrorMessage(rset));
+      }
+      else {
+         archive->verify(*i, ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0)));
+      }
+      PQclear(rset);
+   }
+}
+
+/**
+ * backendStats reports the group commit statistics of the update writer
+ * @return a printable summary
+ */
+string DatabaseConnectionManager::backendStats() {
+   return archive != NULL ? writer->stats() + archive->stats() : writer->stats();
 }
 
 /**
@@ -248,18 +296,18 @@ int DatabaseConnectionManager::authenticate(Client *c, const char *user, const u
    //insert into files values(stream_id, fname);
    const char * const parms[1] = {user};
 
-   sem_wait(&gui_sem);
+   PGconn *dbConn = pool->checkout();
    PGresult *rset = PQexecPrepared(dbConn, "getUserInfo",
                        1, //int nParams,   size of arrays that follow
                        parms, //parms,  //const char * const *paramValues, array of string values
                        plens, //const int *paramLengths,
                        pformats, //const int *paramFormats,
                        1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&gui_sem);
+   pool->checkin(dbConn);
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
-      fprintf(stderr, "authenticate: %s (%s), %d\n", PQerrorMessage(dbConn), user, qres);
+      fprintf(stderr, "authenticate: %s (%s), %d\n", PQresultErrorMessage(rset), user, qres);
    }
    else {
 //         fprintf(stderr, "authenticate: good add file for %d\n", htonl(id));
@@ -309,26 +357,37 @@ void DatabaseConnectionManager::migrateUpdate(const char *newowner, int pid, con
    const int plens[4] = {0, 4, 0, 0};
    static const int pformats[4] = {0, 1, 0, 0};
 
+   if (archive != NULL) {
+      //the update bypasses the writer, so the project's log would miss it
+      archive->discard(pid);
+   }
    pid = htonl(pid);
 
+   //the migrated project's updateids are assigned here, the stored text never carries one
+   json_object_object_del(obj, "updateid");
    size_t jlen;
    const char *jstr = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &jlen);
    const char * const parms[4] = {newowner, (char*)&pid, cmd, jstr};
 
-   sem_wait(&pu_sem);
+   PGconn *dbConn = pool->checkout();
    PGresult *rset = PQexecPrepared(dbConn, "postUpdate",
                        4, //int nParams,   size of arrays that follow
                        parms, //parms,  //const char * const *paramValues, array of string values
                        plens, //const int *paramLengths,
                        pformats, //const int *paramFormats,
                        1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&pu_sem);
+   pool->checkin(dbConn);
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-      fprintf(stderr, "postUpdate: %s\n", PQerrorMessage(dbConn));
+      fprintf(stderr, "postUpdate: %s\n", PQresultErrorMessage(rset));
+      json_object_put(obj);
    }
    else {
       updateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
+      if (archive != NULL) {
+         //in case the writer started the log over in the meantime
+         archive->discard(ntohl(pid));
+      }
 //      logln("migrated update: " + updateid + "cmd: " + cmd + "pid: " + pid + " size: " + dlen, LINFO4);
    }
    PQclear(rset);
@@ -339,48 +398,113 @@ void DatabaseConnectionManager::migrateUpdate(const char *newowner, int pid, con
  * archives the udpate in the database so that future clients can receive it 
  * @param src the client that made the update
  * @param cmd the 'command' that was performed (comment, rename, etc)
+ * @param cmdId the id of cmd, looked up once as the update was read
  * @param data the 'data' portion of the command (the comment text, etc)
             note that this data array already has 8 bytes (8-15) reserved to receive the updateid
             when updates are requested in the future
  */
-void DatabaseConnectionManager::post(Client *c, const char *cmd, json_object *obj) {
-   uint64_t updateid = 0;
-   //db insert
-   const int plens[4] = {0, 4, 0, 0};
-   static const int pformats[4] = {0, 1, 0, 0};
-
-   int pid = htonl(c->getPid());
-
-   size_t jlen;
-   const char *jstr = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &jlen);
-   
-   const char * const parms[4] = {c->getUser().c_str(), (char*)&pid, cmd, jstr};
+void DatabaseConnectionManager::post(Client *c, const char *cmd, uint16_t cmdId, json_object *obj) {
+   //the writer stores the update with others in its batch, then queues it for dispatch
+   writer->submit(c, cmd, cmdId, obj);
+}
 
-   sem_wait(&pu_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "postUpdate",
-                       4, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&pu_sem);
-   ExecStatusType qres = PQresultStatus(rset);
-   if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-      fprintf(stderr, "postUpdate: %s\n", PQerrorMessage(dbConn));
+/**
+ * replayRow queues a single stored update to a client. The stored text is sent
+ * as is, with its updateid spliced onto the end, without ever being parsed.
+ * Only rows stored by older servers, which still carry a (possibly stale) updateid,
+ * are parsed so that it can be replaced (see database/postgresql/strip_updateid.sql),
+ * as are all rows sent to a client using binary frames.
+ * @param c the client catching up
+ * @param rset a result holding a single row of getLatestUpdates
+ */
+static void replayRow(Client *c, PGresult *rset) {
+   //integer values coming from database are big endian so swap if neccessary
+   uint64_t updateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
+   uint16_t cmd = frameCommandId((const char*)PQgetvalue(rset, 0, 1));
+   const char *json = (const char*)PQgetvalue(rset, 0, 2);
+   int dlen = PQgetlength(rset, 0, 2);
+
+//   fprintf(stderr, "posting %lld (cmd %d)\n", updateid, cmd);
+
+   EncodedPacket *wire = NULL;
+   if (c->isFramed()) {
+      json_object *obj = json_tokener_parse(json);
+      if (obj != NULL) {
+         wire = EncodedPacket::fromFrame(obj, updateid);   //replaces any old updateid
+         json_object_put(obj);
+      }
+      else {
+         c->replay(cmd, updateid, NULL);
+         return;
+      }
    }
-   else {
-      //postgres integers are big endian so swap if necessary
-      updateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 0));
-//      fprintf(stderr, "Added update: %lld\n", updateid);
-//      fprintf(stderr, "Added update: %lld, cmd: %d, pid: %d, size: %d\n", updateid, cmd, pid, dlen);
-//      logln("Added update: " + updateid + ", cmd: " + cmd + ", pid: " + pid + ", size: " + data.length, LINFO4);
-      sem_wait(&queueMutex);
-      queue.push_back(new Packet(c, cmd, obj, updateid));   //add a new packet with the binary data to the queue
-      sem_post(&queueMutex);
+   else if (memmem(json, dlen, "\"updateid\"", 10) != NULL) {
+      json_object *obj = json_tokener_parse(json);
+      if (obj != NULL) {
+         json_object_object_del(obj, "updateid");  //make sure key doesn't exist from old update
+         append_json_uint64_val(obj, "updateid", updateid);
+         wire = EncodedPacket::fromJson(obj);
+         json_object_put(obj);
+      }
    }
-   PQclear(rset);
+   if (wire == NULL) {
+      wire = new EncodedPacket(json, dlen, updateid);
+   }
+   c->replay(cmd, updateid, wire);
+}
 
-   sem_post(&queueSem);
+/**
+ * replayArchived queues the next chunk of a catch up from the project's update
+ * log. Each run of updates the client subscribes to is queued as a single
+ * packet referring to the log, which the client's connection hands to the
+ * socket with sendfile, so the updates are never copied through user space.
+ * Only clients receiving plain json can be served this way.
+ * @param c the client catching up
+ * @param lastUpdate the last update the client received
+ * @return the number of updates moved past, or -1 if the log can't serve the catch up
+ */
+int DatabaseConnectionManager::replayArchived(Client *c, uint64_t lastUpdate) {
+   UpdateLog *log = archive->get(c->getPid());
+   if (log == NULL) {
+      return -1;
+   }
+   UpdateLogEntry *entries = new UpdateLogEntry[catchupChunk];
+   int fd = -1;
+   int rows = log->find(lastUpdate, entries, catchupChunk, &fd);
+   uint64_t bytes = 0;
+   uint32_t runLength = 0;
+   for (int i = 0; i <= rows; i++) {
+      //ids beyond the table come from a log written with a newer command table
+      if (i < rows && entries[i].cmd <= frameCommandCount() && c->subscribes(entries[i].cmd)) {
+         runLength += entries[i].length;
+         continue;
+      }
+      if (runLength > 0) {
+         //the updates before this one, which the client may all see
+         UpdateLogEntry &last = entries[i - 1];
+         off_t start = last.offset + last.length - runLength;
+         int runFd = dup(fd);
+         if (runFd != -1) {
+            c->replay(last.cmd, last.updateid, new EncodedPacket(runFd, start, runLength));
+            bytes += runLength;
+         }
+         else {
+            c->replay(last.cmd, last.updateid, NULL);
+         }
+         runLength = 0;
+      }
+      if (i < rows) {
+         c->replay(FRAME_NAMED, entries[i].updateid, NULL);
+      }
+   }
+   if (fd != -1) {
+      close(fd);
+   }
+   delete [] entries;
+   if (rows > 0) {
+      archive->replayed(rows, bytes);
+   }
+   return rows;
 }
 
 /**
@@ -388,52 +512,55 @@ void DatabaseConnectionManager::post(Client *c, const char *cmd, json_object *ob
  * it is expected that the client has already joined a project before calling this function
  * it is expected that the client has already received updates from 0 - lastUpdate 
  * this function is typically called when a user is re-joining a project that they had previously worked on
+ * at most CATCHUP_CHUNK updates are sent per call and each row is queued to the client as
+ * soon as it arrives, so neither the server nor the client's queue holds a whole backlog
  * @param c the client requesting updates 
  * @param lastUpdate the last update the client received 
+ * @return true if a full chunk was sent and more updates may follow it
  */
-void DatabaseConnectionManager::sendLatestUpdates(Client *c, uint64_t lastUpdate) {
-   static const int plens[2] = {8, 4};
-   static const int pformats[2] = {1, 1};
+bool DatabaseConnectionManager::sendLatestUpdates(Client *c, uint64_t lastUpdate) {
+   static const int plens[3] = {8, 4, 4};
+   static const int pformats[3] = {1, 1, 1};
+
+   if (archive != NULL && !c->isFramed() && !c->isCompressed()) {
+      int sent = replayArchived(c, lastUpdate);
+      if (sent >= 0) {
+         return sent == catchupChunk;
+      }
+   }
 
    int pid = htonl(c->getPid());
+   int limit = htonl(catchupChunk);
    
    lastUpdate = htonll(lastUpdate);
-   const char * const parms[2] = {(char*)&lastUpdate, (char*)&pid};
-
-   sem_wait(&glu_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "getLatestUpdates",
-                       2, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&glu_sem);
-   ExecStatusType qres = PQresultStatus(rset);
-   if (qres != PGRES_TUPLES_OK) {
-      fprintf(stderr, "getLatestUpdates: %s\n", PQerrorMessage(dbConn));
-   }
-   else {
-      int rows = PQntuples(rset);
-      for (int i = 0; i < rows; i++) {
-         //integer values coming from database are big endian so swap if neccessary
-         uint64_t updateid = *(uint64_t*)PQgetvalue(rset, i, 0);
-         updateid = ntohll(updateid);
-         const char *cmd = (const char*)PQgetvalue(rset, i, 1);
-         const char *json = (const char*)PQgetvalue(rset, i, 2);
-         json_object *obj = json_tokener_parse(json);
-
-         int dlen = PQgetlength(rset, i, 2);
-
-//         fprintf(stderr, "posting %lld (cmd %d)\n", ntohll(updateid), cmd);
-//         logln("posting " + updateid + " (cmd " + cmd + ")");
-
-         json_object_object_del(obj, "updateid");  //make sure key doesn't exist from old update
-         append_json_uint64_val(obj, "updateid", updateid);
-         c->post(cmd, obj);
+   const char * const parms[3] = {(char*)&lastUpdate, (char*)&pid, (char*)&limit};
+
+   int rows = 0;
+   bool failed = true;
+   PGconn *dbConn = pool->checkout();
+   {
+      DbPipeline pipe(dbConn);
+      if (pipe.send("getLatestUpdates", 3, parms, plens, pformats) && pipe.singleRow()) {
+         PGresult *rset;
+         while ((rset = pipe.part()) != NULL) {
+            ExecStatusType qres = PQresultStatus(rset);
+            if (qres == PGRES_SINGLE_TUPLE) {
+               replayRow(c, rset);
+               rows++;
+            }
+            else if (qres == PGRES_TUPLES_OK) {
+               //the empty result that ends the rows
+               failed = false;
+            }
+            else {
+               fprintf(stderr, "getLatestUpdates: %s\n", PQresultErrorMessage(rset));
+            }
+            PQclear(rset);
+         }
       }
    }
-   PQclear(rset);
-
+   pool->checkin(dbConn);
+   return !failed && rows == catchupChunk;
 }
 
 /**
@@ -450,19 +577,19 @@ ProjectInfo *DatabaseConnectionManager::getProjectInfo(int pid) {
    pid = htonl(pid);
    const char * const parms[1] = {(char*)&pid};
 
-   sem_wait(&fpbp_sem);
+   PGconn *dbConn = pool->checkout();
    PGresult *rset = PQexecPrepared(dbConn, "findProjectByPid",
                        1, //int nParams,   size of arrays that follow
                        parms, //parms,  //const char * const *paramValues, array of string values
                        plens, //const int *paramLengths,
                        pformats, //const int *paramFormats,
                        1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbp_sem);
+   pool->checkin(dbConn);
 
    ExecStatusType qres = PQresultStatus(rset);
    //expecting a single row returned
    if (qres != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
-      fprintf(stderr, "findProjectByPid: %s\n", PQerrorMessage(dbConn));
+      fprintf(stderr, "findProjectByPid: %s\n", PQresultErrorMessage(rset));
    }
    else {
       uint32_t proto = ntohl(*(uint32_t*)PQgetvalue(rset, 0, 10));
@@ -486,10 +613,7 @@ ProjectInfo *DatabaseConnectionManager::getProjectInfo(int pid) {
          pinfo->sub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 8));
          pinfo->owner = PQgetvalue(rset, 0, 9);
          pinfo->proto = proto;
-         ClientSet *cs = projects.get(lpid);
-         if (cs != NULL) {
-            pinfo->connected = cs->size();
-         }
+         pinfo->connected = projects.numClients(lpid);
       }
    }
    PQclear(rset);
@@ -511,18 +635,18 @@ vector<ProjectInfo*> *DatabaseConnectionManager::getProjectList(const string &ph
 
    const char * const parms[1] = {phash.c_str()};
 
-   sem_wait(&fpbh_sem);
+   PGconn *dbConn = pool->checkout();
    PGresult *rset = PQexecPrepared(dbConn, "findProjectsByHash",
                        1, //int nParams,   size of arrays that follow
                        parms, //parms,  //const char * const *paramValues, array of string values
                        plens, //const int *paramLengths,
                        pformats, //const int *paramFormats,
                        1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbh_sem);
+   pool->checkin(dbConn);
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK) {
-      fprintf(stderr, "findProjectsByHash: %s\n", PQerrorMessage(dbConn));
+      fprintf(stderr, "findProjectsByHash: %s\n", PQresultErrorMessage(rset));
    }
    else {
       int rows = PQntuples(rset);
@@ -550,10 +674,7 @@ vector<ProjectInfo*> *DatabaseConnectionManager::getProjectList(const string &ph
          pinfo->sub = ntohll(*(uint64_t*)PQgetvalue(rset, i, 8));
          pinfo->owner = PQgetvalue(rset, i, 9);
          pinfo->proto = proto;
-         ClientSet *cs = projects.get(lpid);
-         if (cs != NULL) {
-            pinfo->connected = cs->size();
-         }
+         pinfo->connected = projects.numClients(lpid);
 
          plist->push_back(pinfo);
          
@@ -571,10 +692,6 @@ vector<ProjectInfo*> *DatabaseConnectionManager::getProjectList(const string &ph
  * @return 0 on success, negative value on failure
  */
 int DatabaseConnectionManager::joinProject(Client *c, int lpid) {
-   int rval = -1;
-
-   bool foundPid = false;
-
    int tpid = htonl(lpid);
    static const int plens[1] = {sizeof(tpid)};
    static const int pformats[1] = {1};
@@ -584,84 +701,128 @@ int DatabaseConnectionManager::joinProject(Client *c, int lpid) {
 #ifdef DEBUG
    fprintf(stderr, "trying to join project %d\n", lpid);
 #endif
-   sem_wait(&fpbp_sem);
+   PGconn *dbConn = pool->checkout();
    PGresult *rset = PQexecPrepared(dbConn, "findProjectByPid",
                        1, //int nParams,   size of arrays that follow
                        parms, //parms,  //const char * const *paramValues, array of string values
                        plens, //const int *paramLengths,
                        pformats, //const int *paramFormats,
                        1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbp_sem);
+   pool->checkin(dbConn);
 
    ExecStatusType qres = PQresultStatus(rset);
+   int rval = -1;
    //expecting a single row returned
    if (qres != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
-      fprintf(stderr, "findProjectByPid: %s\n", PQerrorMessage(dbConn));
+      fprintf(stderr, "findProjectByPid: %s\n", PQresultErrorMessage(rset));
    }
    else {
-      uint32_t proto = ntohl(*(uint32_t*)PQgetvalue(rset, 0, 10));
-      if (proto == PROTOCOL_VERSION) {     
-         const char *hash = PQgetvalue(rset, 0, 1);
-   
-         uint64_t snapupdateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 3));
-   //      logln("in joinProject: " + lpid + " " + hash + " " + snapupdateid + " " + rs.getString(5) + " " + rs.getString(7), LDEBUG);
-         if (snapupdateid > 0) {  //pid is a snapshot pid
-            //this should now be an error condition
-            
-            //logln("Attempt to join snapshot " + lpid + " forking instead");
-            //return forkProject(c, rs.getLong(4), rs.getString(7) + " + " + rs.getString(5));
-            c->send_error("can't join a snapshot, you MUST fork a snapshot");
-            logln("attempted to join a snapshop instead of forking", LERROR);
-            return -1;
-         }
-         c->setPid(lpid);
-         c->setHash(hash);
-   
-         const char *gpid = PQgetvalue(rset, 0, 2);
-         c->setGpid(gpid);
-   
-         const char *owner = PQgetvalue(rset, 0, 9);
-   
-         if (c->getUser() == owner) { //project owner gets full perms, regardless of user, project, or requested perms
-            logln("Project Owner joined! yay!", LINFO3);
-            c->setPub(FULL_PERMISSIONS);
-            c->setSub(FULL_PERMISSIONS);
-         }
-         else { //effective permissions are user perms ANDed with project perms ANDed with the perms requested by the user
-            uint64_t pub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 7));
-   /*
-            logln("effective publish  : " + 
-                  Long.toHexString(pub)) + " & " + 
-                  Long.toHexString(c->getReqPub()) + " & " + 
-                  Long.toHexString(c->getUserPub()) + " = " + 
-                  Long.toHexString(pub & c->getUserPub() & c->getReqPub()),LINFO1);
-   */
-            uint64_t sub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 8));
-   /*
-            logln("effective subscribe: " + 
-                  Long.toHexString(sub) + " & " + 
-                  Long.toHexString(c->getReqSub()) + " & " + 
-                  Long.toHexString(c->getUserSub()) + " = " + 
-                  Long.toHexString(sub & c->getUserSub() & c->getReqSub()),LINFO1);
-   */
-            c->setPub(pub & c->getUserPub() & c->getReqPub());
-            c->setSub(sub & c->getUserSub() & c->getReqSub());
-         }
-   
-         foundPid = true;
-      }
+      rval = joinResult(c, rset);
    }
    PQclear(rset);
+   return rval;
+}
 
-   if (foundPid) {
-      projects.addClient(c);
-      rval = 0;
+/**
+ * rejoinProject joins a client to a project it previously worked on, the
+ * gpid lookup and the project details are fetched by a single statement
+ * @param c the client attempting to rejoin
+ * @param gpid the global pid stored in the client's database
+ * @return 0 on success, -1 if gpid is not known on this server, -2 if the join failed
+ */
+int DatabaseConnectionManager::rejoinProject(Client *c, const string &gpid) {
+   static const int plens[1] = {0};
+   static const int pformats[1] = {0};
+
+   const char * const parms[1] = {gpid.c_str()};
+
+   PGconn *dbConn = pool->checkout();
+   PGresult *rset = PQexecPrepared(dbConn, "findProjectByGpidInfo",
+                       1, //int nParams,   size of arrays that follow
+                       parms, //parms,  //const char * const *paramValues, array of string values
+                       plens, //const int *paramLengths,
+                       pformats, //const int *paramFormats,
+                       1); //int resultFormat); 0 == text, 1 == binary
+   pool->checkin(dbConn);
+
+   ExecStatusType qres = PQresultStatus(rset);
+   int rval = -1;
+   //expecting exactly 1 row
+   if (qres != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
+      fprintf(stderr, "findProjectByGpidInfo: %s\n", PQresultErrorMessage(rset));
+   }
+   else if (joinResult(c, rset) < 0) {
+      rval = -2;
    }
    else {
+      rval = 0;
+   }
+   PQclear(rset);
+   return rval;
+}
+
+/**
+ * joinResult completes a join using a row shaped like those returned by findProjectByPid
+ * @param c the client attempting to join
+ * @param rset a result holding exactly one project row
+ * @return 0 on success, negative value on failure
+ */
+int DatabaseConnectionManager::joinResult(Client *c, PGresult *rset) {
+   uint32_t proto = ntohl(*(uint32_t*)PQgetvalue(rset, 0, 10));
+   if (proto != PROTOCOL_VERSION) {
 //      logln("ERROR: attempt to join a non-existant project: " + lpid, LERROR);
+      return -1;
    }
+   int lpid = ntohl(*(int*)PQgetvalue(rset, 0, 0));
+   const char *hash = PQgetvalue(rset, 0, 1);
+
+   uint64_t snapupdateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 3));
+//   logln("in joinProject: " + lpid + " " + hash + " " + snapupdateid + " " + rs.getString(5) + " " + rs.getString(7), LDEBUG);
+   if (snapupdateid > 0) {  //pid is a snapshot pid
+      //this should now be an error condition
+
+      //logln("Attempt to join snapshot " + lpid + " forking instead");
+      //return forkProject(c, rs.getLong(4), rs.getString(7) + " + " + rs.getString(5));
+      c->send_error("can't join a snapshot, you MUST fork a snapshot");
+      logln("attempted to join a snapshop instead of forking", LERROR);
+      return -1;
+   }
+   c->setPid(lpid);
+   c->setHash(hash);
 
-   return rval;
+   const char *gpid = PQgetvalue(rset, 0, 2);
+   c->setGpid(gpid);
+
+   const char *owner = PQgetvalue(rset, 0, 9);
+
+   if (c->getUser() == owner) { //project owner gets full perms, regardless of user, project, or requested perms
+      logln("Project Owner joined! yay!", LINFO3);
+      c->setPub(FULL_PERMISSIONS);
+      c->setSub(FULL_PERMISSIONS);
+   }
+   else { //effective permissions are user perms ANDed with project perms ANDed with the perms requested by the user
+      uint64_t pub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 7));
+/*
+      logln("effective publish  : " + 
+            Long.toHexString(pub)) + " & " + 
+            Long.toHexString(c->getReqPub()) + " & " + 
+            Long.toHexString(c->getUserPub()) + " = " + 
+            Long.toHexString(pub & c->getUserPub() & c->getReqPub()),LINFO1);
+*/
+      uint64_t sub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 8));
+/*
+      logln("effective subscribe: " + 
+            Long.toHexString(sub) + " & " + 
+            Long.toHexString(c->getReqSub()) + " & " + 
+            Long.toHexString(c->getUserSub()) + " = " + 
+            Long.toHexString(sub & c->getUserSub() & c->getReqSub()),LINFO1);
+*/
+      c->setPub(pub & c->getUserPub() & c->getReqPub());
+      c->setSub(sub & c->getUserSub() & c->getReqSub());
+   }
+
+   projects.addClient(c);
+   return 0;
 }
 
 /**
@@ -696,18 +857,18 @@ int DatabaseConnectionManager::snapProject(Client *c, uint64_t lastupdateid, con
       const char * const parms[6] = {c->getHash().c_str(), gpid.c_str(),
                                      desc.c_str(), c->getUser().c_str(), (char*)&lastupdateid, (char*)&proto};
    
-      sem_wait(&aps_sem);
+      PGconn *dbConn = pool->checkout();
       PGresult *rset = PQexecPrepared(dbConn, "addProjectSnap",
                           6, //int nParams,   size of arrays that follow
                           parms, //parms,  //const char * const *paramValues, array of string values
                           plens, //const int *paramLengths,
                           pformats, //const int *paramFormats,
                           1); //int resultFormat); 0 == text, 1 == binary
-      sem_post(&aps_sem);
+      pool->checkin(dbConn);
 
       ExecStatusType qres = PQresultStatus(rset);
       if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-         fprintf(stderr, "addProjectSnap: %s\n", PQerrorMessage(dbConn));
+         fprintf(stderr, "addProjectSnap: %s\n", PQresultErrorMessage(rset));
       }
       else {
          spid = *(int*)PQgetvalue(rset, 0, 0);  //leave in network byte order for now
@@ -722,18 +883,18 @@ int DatabaseConnectionManager::snapProject(Client *c, uint64_t lastupdateid, con
 
    const char * const parms[2] = {(char*)&spid, (char*)&oldpid};
 
-   sem_wait(&apf_sem);
+   PGconn *dbConn = pool->checkout();
    PGresult *rset = PQexecPrepared(dbConn, "addProjectFork",
                        2, //int nParams,   size of arrays that follow
                        parms, //parms,  //const char * const *paramValues, array of string values
                        plens, //const int *paramLengths,
                        pformats, //const int *paramFormats,
                        1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&apf_sem);
+   pool->checkin(dbConn);
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-      fprintf(stderr, "addProjectFork: %s\n", PQerrorMessage(dbConn));
+      fprintf(stderr, "addProjectFork: %s\n", PQresultErrorMessage(rset));
    }
    else {
       int fid = ntohl(*(int*)PQgetvalue(rset, 0, 0));
@@ -750,7 +911,7 @@ int DatabaseConnectionManager::snapProject(Client *c, uint64_t lastupdateid, con
 
 
 /**
- * forkProject  forks a project - creats new project and copies all updates to point to the new project,
+ * forkProject  forks a project - creats new project that shares all updates of the old one up to the fork point,
  * publish and subscribe values are inherited
  * @param c client object invoking the fork
  * @param lastupdateid the updateid value the fork is to occur at
@@ -759,43 +920,13 @@ int DatabaseConnectionManager::snapProject(Client *c, uint64_t lastupdateid, con
  */
 
 int DatabaseConnectionManager::forkProject(Client *c, uint64_t lastupdateid, const string &desc) {
-   int rval = -1;
-
-   static const int plens[1] = {4};
-   static const int pformats[1] = {1};
-
-   int pid = htonl(c->getPid());
-   const char * const parms[1] = {(char*)&pid};
-
-   sem_wait(&fpbp_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "findProjectByPid",
-                       1, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbp_sem);
-
-   ExecStatusType qres = PQresultStatus(rset);
-   //expecting a single row returned
-   if (qres != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
-      fprintf(stderr, "findProjectByPid: %s\n", PQerrorMessage(dbConn));
-   }
-   else {
-      uint64_t pub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 7));
-      uint64_t sub = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 8));
-
-//      logln("forking " + pid + " pub is " + pub + " sub is " + sub);
-      rval = forkProject(c, lastupdateid, desc, pub, sub); 
-   }
-   PQclear(rset);
-
-   return rval;
+   //pub and sub are copied from the old project by the insert itself
+   return forkCurrent(c, lastupdateid, desc, true, 0, 0);
 }
 
 
 /**
- * forkProject  forks a project - creats new project and copies all updates to point to the new project
+ * forkProject  forks a project - creats new project that shares all updates of the old one up to the fork point
  * @param c client object invoking the fork
  * @param lastupdateid the updateid value the fork is to occur at
  * @param desc user provided description of the fork
@@ -804,73 +935,30 @@ int DatabaseConnectionManager::forkProject(Client *c, uint64_t lastupdateid, con
  * @return the new projectid on success, -1 on failure
  */
 int DatabaseConnectionManager::forkProject(Client *c, uint64_t lastupdateid, const string &desc, uint64_t pub, uint64_t sub) {
-   logln("in forkProject ", LDEBUG);
-   int rval = -1;
+   return forkCurrent(c, lastupdateid, desc, false, pub, sub);
+}
 
+/**
+ * forkCurrent moves c onto a fork of its current project, or back onto the current
+ * project if the fork could not be created
+ * @param c client object invoking the fork
+ * @param lastupdateid the updateid value the fork is to occur at
+ * @param desc user provided description of the fork
+ * @param inherit true to copy pub and sub from the current project, ignoring the next two arguments
+ * @param pub specified publish permissions
+ * @param sub specified subscribe permissions
+ * @return the new projectid on success, -1 on failure
+ */
+int DatabaseConnectionManager::forkCurrent(Client *c, uint64_t lastupdateid, const string &desc, bool inherit, uint64_t pub, uint64_t sub) {
+   logln("in forkProject ", LDEBUG);
    int oldlpid = c->getPid();
-   int told = htonl(oldlpid);
    remove(c);
-   int lpid = addProject(c, c->getHash(), desc, pub, sub);  //could add "forked from" to desc at this point
+   //could add "forked from" to desc at this point
+   int lpid = createFork(c, oldlpid, oldlpid, lastupdateid, desc, inherit, pub, sub);
    if (lpid >= 0) {
-      //gpid and lpid are set in addProject
-      //add to forklist
-
-      static const int plens[2] = {4, 4};
-      static const int pformats[2] = {1, 1};
-   
-      int tlpid = htonl(lpid);
-      const char * const parms[2] = {(char*)&tlpid, (char*)&told};
-   
-      sem_wait(&apf_sem);
-      PGresult *rset = PQexecPrepared(dbConn, "addProjectFork",
-                          2, //int nParams,   size of arrays that follow
-                          parms, //parms,  //const char * const *paramValues, array of string values
-                          plens, //const int *paramLengths,
-                          pformats, //const int *paramFormats,
-                          1); //int resultFormat); 0 == text, 1 == binary
-      sem_post(&apf_sem);
-   
-      ExecStatusType qres = PQresultStatus(rset);
-      if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-         fprintf(stderr, "addProjectFork: %s\n", PQerrorMessage(dbConn));
-      }
-      else {
-         int fid  = ntohl(*(int*)PQgetvalue(rset, 0, 0));    
-//         logln("Forked (" + fid + "): Project " + lpid + " forked from " + oldlpid, LINFO);
-      }
-      PQclear(rset);
-
-      //dup update records
-      static const int plens2[3] = {4, 8, 4};
-      static const int pformats2[3] = {1, 1, 1};
-   
-      uint64_t last = htonll(lastupdateid);
-      const char * const parms2[3] = {(char*)&told, (char*)&last, (char*)&tlpid};
-   
-      sem_wait(&cu_sem);
-      rset = PQexecPrepared(dbConn, "copyUpdates",
-                          3, //int nParams,   size of arrays that follow
-                          parms, //parms,  //const char * const *paramValues, array of string values
-                          plens, //const int *paramLengths,
-                          pformats, //const int *paramFormats,
-                          1); //int resultFormat); 0 == text, 1 == binary
-      sem_post(&cu_sem);
-   
-      qres = PQresultStatus(rset);
-      if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-         fprintf(stderr, "copyUpdates: %s\n", PQerrorMessage(dbConn));
-      }
-      else {
-//         uint64_t lastinserted = *(uint64_t*)PQgetvalue(rset, 0, 0); 
-//         logln("Last inserted was " + lastinserted + ", lastupdateid was " + lastupdateid, LINFO);
-         rval = lpid;
-      }
-      PQclear(rset);
-
       //at this point the project has forked and the plugin that forked is on the new project
       
       //allow anyone else on the project (w/ exactly the same updates) to follow the fork
-      string gpid = lpid2gpid(lpid);
       logln("sending fork follows", LINFO);
       sendForkFollows(c, oldlpid, lastupdateid, desc);
    }
@@ -880,7 +968,119 @@ int DatabaseConnectionManager::forkProject(Client *c, uint64_t lastupdateid, con
       //send fork error
       c->send_error("Fork Failed, could not create forked project");
    }
-   return rval;
+   return lpid;
+}
+
+/**
+ * pipelineResult checks the result of one statement from a pipeline
+ * @param rset the result, may be NULL if the connection failed
+ * @param stmt the name of the statement, for error reporting
+ * @return true if the statement succeeded
+ */
+static bool pipelineResult(PGresult *rset, const char *stmt) {
+   if (rset == NULL) {
+      fprintf(stderr, "%s: no result, database connection failed\n", stmt);
+      return false;
+   }
+   ExecStatusType qres = PQresultStatus(rset);
+   if (qres == PGRES_TUPLES_OK || qres == PGRES_COMMAND_OK) {
+      return true;
+   }
+   //statements queued after a failure are skipped, only the failure itself is interesting
+   if (qres != PGRES_PIPELINE_ABORTED) {
+      fprintf(stderr, "%s: %s\n", stmt, PQresultErrorMessage(rset));
+   }
+   return false;
+}
+
+/**
+ * createFork creates a new project owned by c and records its lineage in the forklist.
+ * No updates are copied, catch up on the new project reads the source project's updates
+ * up to lastupdateid followed by the new project's own. Anything the fork needs from
+ * the parent is read by the inserts themselves, so both statements are pipelined
+ * and cost a single round trip and commit or fail together. On success the client
+ * is moved onto the new project.
+ * @param c client object invoking the fork
+ * @param parent the pid recorded in the forklist as the parent of the new project
+ * @param source the pid whose history the new project shares, -1 if parent is a snapshot
+ *        and the new project shares the snapshot's history up to its snapupdateid
+ * @param lastupdateid the last update of source that belongs to the new project, ignored when source is -1
+ * @param desc user provided description of the new project
+ * @param inherit true to copy pub and sub from parent, ignoring the next two arguments
+ * @param pub publish permissions for the new project
+ * @param sub subscribe permissions for the new project
+ * @return the new projectid on success, -1 on failure
+ */
+int DatabaseConnectionManager::createFork(Client *c, int parent, int source, uint64_t lastupdateid, const string &desc,
+                                          bool inherit, uint64_t pub, uint64_t sub) {
+   static const int plens[9] = {0, 0, 0, 0, 8, 8, 4, 4, 4};
+   static const int pformats[9] = {0, 0, 0, 0, 1, 1, 1, 1, 1};
+   static const int flens[4] = {0, 4, 4, 8};
+   static const int fformats[4] = {0, 1, 1, 1};
+
+   int lpid = -1;
+   string gpid;
+
+   int proto = htonl(PROTOCOL_VERSION);
+   int tparent = htonl(parent);
+   int tsource = htonl(source);
+   uint64_t last = htonll(lastupdateid);
+   pub = htonll(pub);
+   sub = htonll(sub);
+
+   //null parameters are filled in from the parent's row
+   const char *ppub = inherit ? NULL : (char*)&pub;
+   const char *psub = inherit ? NULL : (char*)&sub;
+   const char *psource = source < 0 ? NULL : (char*)&tsource;
+   const char *plast = source < 0 ? NULL : (char*)&last;
+
+   for (int attempt = 0; attempt < FORK_ATTEMPTS; attempt++) {
+      //generate a new GPID; We optimistically insert, assuming
+      //this gpid is unique, and retry if the insert fails
+      uint8_t gpid_bytes[32];
+      fill_random(gpid_bytes, sizeof(gpid_bytes));
+      gpid = toHexString(gpid_bytes, sizeof(gpid_bytes));
+
+      const char * const parms[9] = {c->getHash().c_str(), gpid.c_str(), desc.c_str(), c->getUser().c_str(),
+                                     ppub, psub, (char*)&proto, (char*)&tparent, psource};
+      const char * const fparms[4] = {gpid.c_str(), (char*)&tparent, psource, plast};
+
+      bool done = false;
+      PGconn *dbConn = pool->checkout();
+      {
+         //the forklist entry finds the new project by its gpid
+         DbPipeline pipe(dbConn);
+         pipe.send("addProjectFrom", 9, parms, plens, pformats);
+         pipe.send("addForkOfNew", 4, fparms, flens, fformats);
+
+         PGresult *project = pipe.next();
+         PGresult *fork = pipe.next();
+         if (pipelineResult(project, "addProjectFrom") && pipelineResult(fork, "addForkOfNew")) {
+            //no rows means parent is missing or is not a snapshot, retrying won't help
+            done = true;
+            if (PQntuples(project) == 1 && PQntuples(fork) == 1) {
+               lpid = ntohl(*(int*)PQgetvalue(project, 0, 0));
+            }
+         }
+         PQclear(project);
+         PQclear(fork);
+      }
+      pool->checkin(dbConn);
+      if (done) {
+         break;
+      }
+   }
+
+   if (lpid >= 0) {
+//      logln("Forked: Project " + lpid + " forked from " + parent, LINFO);
+      c->setPid(lpid);
+      c->setGpid(gpid);
+      //this is a newly created project, user of c must be the owner
+      c->setPub(FULL_PERMISSIONS);
+      c->setSub(FULL_PERMISSIONS);
+      projects.addClient(c);
+   }
+   return lpid;
 }
 
 struct ForkArgs {
@@ -918,8 +1118,8 @@ void DatabaseConnectionManager::sendForkFollows(Client *originator, int oldlpid,
 /**
  * snapforkProject -  this is a special version of forkProject that is designed to work
  * on snapshots (instead of existing projects) this works exactly like forkProject, execpt
- * updates are copied from the 'parent' of the snapshot instead of the client's currently 
- * associated project, also updates are copied until the lastupdateid from the snapshot, 
+ * updates are shared from the 'parent' of the snapshot instead of the client's currently 
+ * associated project, also updates are shared until the lastupdateid from the snapshot, 
  * not from the plugin (last received update is stored in the idb)
  * @param c client invoking the snapforkProject
  * @param spid the pid of the project that is being snapshotted
@@ -928,103 +1128,11 @@ void DatabaseConnectionManager::sendForkFollows(Client *originator, int oldlpid,
  */
 
 int DatabaseConnectionManager::snapforkProject(Client *c, int spid, const string &desc, uint64_t pub, uint64_t sub) {
-   int rval = -1;
-
-   int oldlpid = htonl(spid);
-   
-   //get lastupdateid from snapshot record
-   uint64_t lastupdateid = -1;
-   int parentlpid = -1;
-   
-   static const int plens[1] = {4};
-   static const int pformats[1] = {1};
-
-   const char * const parms[1] = {(char*)&oldlpid};
-
-   sem_wait(&fpbp_sem);
-   PGresult *rset = PQexecPrepared(dbConn, "findProjectByPid",
-                       1, //int nParams,   size of arrays that follow
-                       parms, //parms,  //const char * const *paramValues, array of string values
-                       plens, //const int *paramLengths,
-                       pformats, //const int *paramFormats,
-                       1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbp_sem);
-
-   ExecStatusType qres = PQresultStatus(rset);
-   //expecting a single row returned
-   if (qres != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
-      fprintf(stderr, "findProjectByPid: %s\n", PQerrorMessage(dbConn));
-   }
-   else {
-      if (!PQgetisnull(rset, 0, 5)) {
-         parentlpid = ntohl(*(int*)PQgetvalue(rset, 0, 5));
-      }
-      lastupdateid = ntohll(*(uint64_t*)PQgetvalue(rset, 0, 3));
-   }
-   PQclear(rset);
-   
-   if (lastupdateid >= 0 && parentlpid >= 0 ) {
-      int lpid = addProject(c, c->getHash(), desc, pub, sub);  
-      if (lpid >= 0) {
-         //gpid and lpid are set in addProject
-         //add to forklist
-
-         static const int plens[2] = {4, 4};
-         static const int pformats[2] = {1, 1};
-      
-         int tlpid = htonl(lpid);
-         const char * const parms[2] = {(char*)&tlpid, (char*)&oldlpid};
-      
-         sem_wait(&apf_sem);
-         PGresult *rset = PQexecPrepared(dbConn, "addProjectFork",
-                             2, //int nParams,   size of arrays that follow
-                             parms, //parms,  //const char * const *paramValues, array of string values
-                             plens, //const int *paramLengths,
-                             pformats, //const int *paramFormats,
-                             1); //int resultFormat); 0 == text, 1 == binary
-         sem_post(&apf_sem);
-      
-         ExecStatusType qres = PQresultStatus(rset);
-         if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-            fprintf(stderr, "addProjectFork: %s\n", PQerrorMessage(dbConn));
-         }
-         else {
-            int fid = ntohl(*(int*)PQgetvalue(rset, 0, 0));
-//            logln("Forked (" + fid + "): Project " + lpid + " forked from snapshot " + oldlpid + "(original project " + parentlpid + ")", LINFO);
-         }
-         PQclear(rset);
-   
-         //dup update records
-         static const int plens2[3] = {4, 8, 4};
-         static const int pformats2[3] = {1, 1, 1};
-         
-         parentlpid = htonl(parentlpid);
-         lastupdateid = htonll(lastupdateid);
-         const char * const parms2[3] = {(char*)&parentlpid, (char*)&lastupdateid, (char*)&tlpid};
-      
-         sem_wait(&cu_sem);
-         rset = PQexecPrepared(dbConn, "copyUpdates",
-                             3, //int nParams,   size of arrays that follow
-                             parms, //parms,  //const char * const *paramValues, array of string values
-                             plens, //const int *paramLengths,
-                             pformats, //const int *paramFormats,
-                             1); //int resultFormat); 0 == text, 1 == binary
-         sem_post(&cu_sem);
-      
-         qres = PQresultStatus(rset);
-         if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-            fprintf(stderr, "copyUpdates: %s\n", PQerrorMessage(dbConn));
-         }
-         else {
-//            uint64_t lastinserted = *(uint64_t*)PQgetvalue(rset, 0, 0); 
-//            logln("Last inserted was " + lastinserted + ", lastupdateid was " + lastupdateid, LINFO);
-            rval = lpid;
-         }
-         PQclear(rset);
-      }
-      else {
-         c->send_error("attempt to snapfork a project (not a snapshot)");
-      }
+   //the snapshot's parent and snapupdateid are read by the inserts, which add
+   //nothing if spid is not a snapshot
+   int rval = createFork(c, spid, -1, 0, desc, false, pub, sub);
+   if (rval < 0) {
+      c->send_error("attempt to snapfork a project (not a snapshot)");
    }
    return rval;
 }
@@ -1057,18 +1165,18 @@ int DatabaseConnectionManager::migrateProject(const char *owner, const string &g
                                   desc.c_str(), owner, (char*)&pub, (char*)&sub, (char*)&proto};
    pub = htonll(pub);
    sub = htonll(sub);
-   sem_wait(&ap_sem);
+   PGconn *dbConn = pool->checkout();
    PGresult *rset = PQexecPrepared(dbConn, "addProject",
                        7, //int nParams,   size of arrays that follow
                        parms, //parms,  //const char * const *paramValues, array of string values
                        plens, //const int *paramLengths,
                        pformats, //const int *paramFormats,
                        1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&ap_sem);
+   pool->checkin(dbConn);
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-      fprintf(stderr, "addProject: %s\n", PQerrorMessage(dbConn));
+      fprintf(stderr, "addProject: %s\n", PQresultErrorMessage(rset));
    }
    else {
       lpid = ntohl(*(int*)PQgetvalue(rset, 0, 0));
@@ -1116,18 +1224,18 @@ int DatabaseConnectionManager::addProject(Client *c, const string &hash, const s
       const char * const parms[7] = {hash.c_str(), gpid.c_str(),
                                      desc.c_str(), c->getUser().c_str(), (char*)&pub, (char*)&sub, (char*)&proto};
    
-      sem_wait(&ap_sem);
+      PGconn *dbConn = pool->checkout();
       PGresult *rset = PQexecPrepared(dbConn, "addProject",
                           7, //int nParams,   size of arrays that follow
                           parms, //parms,  //const char * const *paramValues, array of string values
                           plens, //const int *paramLengths,
                           pformats, //const int *paramFormats,
                           1); //int resultFormat); 0 == text, 1 == binary
-      sem_post(&ap_sem);
+      pool->checkin(dbConn);
 
       ExecStatusType qres = PQresultStatus(rset);
       if (qres != PGRES_TUPLES_OK && qres != PGRES_COMMAND_OK) {
-         fprintf(stderr, "addProject: %s\n", PQerrorMessage(dbConn));
+         fprintf(stderr, "addProject: %s\n", PQresultErrorMessage(rset));
       }
       else {
          lpid = ntohl(*(int*)PQgetvalue(rset, 0, 0));
@@ -1142,6 +1250,9 @@ int DatabaseConnectionManager::addProject(Client *c, const string &hash, const s
       PQclear(rset);
    }
    if (lpid != -1) {
+      if (archive != NULL) {
+         archive->create(lpid);
+      }
       projects.addClient(c);
    }
    return lpid;
@@ -1191,18 +1302,18 @@ void DatabaseConnectionManager::updateProjectPerms(Client *c, uint64_t pub, uint
    const char * const parms[3] = {(char*)&tpub, (char*)&tsub, (char*)&pid};
 
 //   logln("Setting project " + pid + " permissions to p " + pub + " s " + sub, LINFO2);
-   sem_wait(&ppu_sem);
+   PGconn *dbConn = pool->checkout();
    PGresult *rset = PQexecPrepared(dbConn, "projectPermsUpdate",
                        3, //int nParams,   size of arrays that follow
                        parms, //parms,  //const char * const *paramValues, array of string values
                        plens, //const int *paramLengths,
                        pformats, //const int *paramFormats,
                        1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&ppu_sem);
+   pool->checkin(dbConn);
 
    ExecStatusType qres = PQresultStatus(rset);
    if (qres != PGRES_COMMAND_OK) {
-      fprintf(stderr, "projectPermsUpdate: %s\n", PQerrorMessage(dbConn));
+      fprintf(stderr, "projectPermsUpdate: %s\n", PQresultErrorMessage(rset));
    }
    PQclear(rset);
          
@@ -1227,19 +1338,19 @@ int DatabaseConnectionManager::gpid2lpid(const string &gpid) {
 
    const char * const parms[1] = {gpid.c_str()};
 
-   sem_wait(&fpbg_sem);
+   PGconn *dbConn = pool->checkout();
    PGresult *rset = PQexecPrepared(dbConn, "findProjectByGpid",
                        1, //int nParams,   size of arrays that follow
                        parms, //parms,  //const char * const *paramValues, array of string values
                        plens, //const int *paramLengths,
                        pformats, //const int *paramFormats,
                        1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbg_sem);
+   pool->checkin(dbConn);
 
    ExecStatusType qres = PQresultStatus(rset);
    //expecting exactly 1 row
    if (qres != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
-      fprintf(stderr, "findProjectByGpid: %s\n", PQerrorMessage(dbConn));
+      fprintf(stderr, "findProjectByGpid: %s\n", PQresultErrorMessage(rset));
    }
    else {
       lpid = ntohl(*(int*)PQgetvalue(rset, 0, 0));
@@ -1265,19 +1376,19 @@ string DatabaseConnectionManager::lpid2gpid(int lpid) {
    lpid = htonl(lpid);
    const char * const parms[1] = {(char*)&lpid};
 
-   sem_wait(&fpbp_sem);
+   PGconn *dbConn = pool->checkout();
    PGresult *rset = PQexecPrepared(dbConn, "findProjectByPid",
                        1, //int nParams,   size of arrays that follow
                        parms, //parms,  //const char * const *paramValues, array of string values
                        plens, //const int *paramLengths,
                        pformats, //const int *paramFormats,
                        1); //int resultFormat); 0 == text, 1 == binary
-   sem_post(&fpbp_sem);
+   pool->checkin(dbConn);
 
    ExecStatusType qres = PQresultStatus(rset);
    //expecting exactly 1 result row
    if (qres != PGRES_TUPLES_OK || PQntuples(rset) != 1) {
-      fprintf(stderr, "findProjectByPid: %s\n", PQerrorMessage(dbConn));
+      fprintf(stderr, "findProjectByPid: %s\n", PQresultErrorMessage(rset));
    }
    else {
       rval = PQgetvalue(rset, 0, 2);
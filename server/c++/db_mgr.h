@@ -27,6 +27,10 @@
 #include <semaphore.h>
 
 #include "cli_mgr.h"
+#include "db_pool.h"
+#include "db_pipeline.h"
+#include "update_writer.h"
+#include "update_log.h"
 #include "client.h"
 #include "proj_info.h"
 
@@ -39,8 +43,8 @@ public:
    
    int authenticate(Client *c, const char *user, const uint8_t *challenge, uint32_t clen, const uint8_t *response, uint32_t rlen);
    void migrateUpdate(const char *newowner, int pid, const char *cmd, json_object *obj);
-   void post(Client *src, const char *cmd, json_object *obj);
-   void sendLatestUpdates(Client *c, uint64_t lastUpdate);
+   void post(Client *src, const char *cmd, uint16_t cmdId, json_object *obj);
+   bool sendLatestUpdates(Client *c, uint64_t lastUpdate);
    ProjectInfo *getProjectInfo(int pid);
 
    vector<ProjectInfo*> *getProjectList(const string & phash);
@@ -54,24 +58,30 @@ public:
    int addProject(Client *c, const string &hash, const string &desc, uint64_t pub, uint64_t sub);
    void updateProjectPerms(Client *c, uint64_t pub, uint64_t sub);
    int gpid2lpid(const string &gpid);
+   int rejoinProject(Client *c, const string &gpid);
    string lpid2gpid(int lpid);
+   string backendStats();
 
 private:
-   void init_queries();
-   
-   sem_t pu_sem;
-   sem_t ap_sem;
-   sem_t aps_sem;
-   sem_t apf_sem;
-   sem_t fpbh_sem;
-   sem_t fpbp_sem;
-   sem_t fpbg_sem;
-   sem_t gui_sem;
-   sem_t glu_sem;
-   sem_t cu_sem;
-   sem_t ppu_sem;
-
-   PGconn *dbConn;
+   static void init_queries(PGconn *dbConn);
+   int replayArchived(Client *c, uint64_t lastUpdate);
+   void verifyArchive();
+   int joinResult(Client *c, PGresult *rset);
+   int forkCurrent(Client *c, uint64_t lastupdateid, const string &desc, bool inherit, uint64_t pub, uint64_t sub);
+   int createFork(Client *c, int parent, int source, uint64_t lastupdateid, const string &desc,
+                  bool inherit, uint64_t pub, uint64_t sub);
+
+   //DB_POOL_SIZE connections, each checked out for a single statement
+   DbPool *pool;
+
+   //group commits updates from post
+   UpdateWriter *writer;
+
+   //ARCHIVE_DIR, catch ups are served from here when possible, NULL if not configured
+   UpdateArchive *archive;
+
+   //most updates sent by a single call to sendLatestUpdates
+   int catchupChunk;
 };
 
 #endif
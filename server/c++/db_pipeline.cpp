@@ -0,0 +1,149 @@
+/*
+   collabREate db_pipeline.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+
+#include "db_pipeline.h"
+
+DbPipeline::DbPipeline(PGconn *conn) {
+   this->conn = conn;
+   unsynced = false;
+   partial = false;
+   queued = 0;
+   syncs = 0;
+   pipelined = PQenterPipelineMode(conn) == 1;
+   if (!pipelined) {
+      fprintf(stderr, "PQenterPipelineMode: %s\n", PQerrorMessage(conn));
+   }
+}
+
+DbPipeline::~DbPipeline() {
+   if (!pipelined) {
+      return;
+   }
+   sync();
+   PGresult *res;
+   while (queued > 0 && (res = next()) != NULL) {
+      PQclear(res);
+   }
+   while (syncs > 0 && PQstatus(conn) != CONNECTION_BAD) {
+      res = PQgetResult(conn);
+      if (res == NULL) {
+         break;
+      }
+      if (PQresultStatus(res) == PGRES_PIPELINE_SYNC) {
+         syncs--;
+      }
+      PQclear(res);
+   }
+   if (PQexitPipelineMode(conn) != 1) {
+      fprintf(stderr, "PQexitPipelineMode: %s\n", PQerrorMessage(conn));
+   }
+}
+
+bool DbPipeline::send(const char *stmt, int nParams, const char * const *values,
+                      const int *lengths, const int *formats, int resultFormat) {
+   if (!pipelined) {
+      return false;
+   }
+   if (PQsendQueryPrepared(conn, stmt, nParams, values, lengths, formats, resultFormat) != 1) {
+      fprintf(stderr, "%s: %s\n", stmt, PQerrorMessage(conn));
+      return false;
+   }
+   queued++;
+   unsynced = true;
+   return true;
+}
+
+bool DbPipeline::sync() {
+   if (!unsynced) {
+      return true;
+   }
+   if (PQpipelineSync(conn) != 1) {
+      fprintf(stderr, "PQpipelineSync: %s\n", PQerrorMessage(conn));
+      return false;
+   }
+   unsynced = false;
+   syncs++;
+   return true;
+}
+
+bool DbPipeline::singleRow() {
+   if (PQsetSingleRowMode(conn) != 1) {
+      fprintf(stderr, "PQsetSingleRowMode failed\n");
+      return false;
+   }
+   return true;
+}
+
+PGresult *DbPipeline::part() {
+   if (queued == 0 || !sync()) {
+      return NULL;
+   }
+   if (!partial) {
+      PGresult *res = first();
+      partial = res != NULL;
+      return res;
+   }
+   PGresult *res = PQgetResult(conn);
+   if (res == NULL) {
+      partial = false;
+      queued--;
+   }
+   return res;
+}
+
+PGresult *DbPipeline::next() {
+   PGresult *res;
+   //finish off a statement that was being read with part
+   while (partial && (res = part()) != NULL) {
+      PQclear(res);
+   }
+   if (queued == 0 || !sync()) {
+      return NULL;
+   }
+   res = first();
+   if (res == NULL) {
+      //only happens if the connection has failed
+      return NULL;
+   }
+   queued--;
+   //each statement's results are terminated by a NULL
+   PGresult *extra;
+   while ((extra = PQgetResult(conn)) != NULL) {
+      PQclear(extra);
+   }
+   return res;
+}
+
+/**
+ * first waits for the first result of the oldest outstanding statement
+ * @return the result, or NULL if the connection has failed
+ */
+PGresult *DbPipeline::first() {
+   PGresult *res = PQgetResult(conn);
+   //skip the markers of syncs whose statements have all been collected
+   while (res != NULL && PQresultStatus(res) == PGRES_PIPELINE_SYNC) {
+      syncs--;
+      PQclear(res);
+      res = PQgetResult(conn);
+   }
+   return res;
+}
@@ -0,0 +1,109 @@
+/*
+   collabREate db_pipeline.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __DB_PIPELINE_H
+#define __DB_PIPELINE_H
+
+#include <libpq-fe.h>
+
+/**
+ * DbPipeline
+ * This class queues prepared statements on a connection in libpq pipeline
+ * mode, so a whole sequence of statements costs a single round trip to the
+ * database. Statements sent between two syncs run in one implicit transaction:
+ * if any of them fails, the ones before it are rolled back and the ones after
+ * it are skipped (their results are PGRES_PIPELINE_ABORTED). Results are
+ * collected with next in the order the statements were sent.
+ */
+
+class DbPipeline {
+public:
+   /**
+    * @param conn a connection checked out of a DbPool, it must stay checked out
+    *        until this pipeline has been destroyed
+    */
+   DbPipeline(PGconn *conn);
+
+   /**
+    * discards any results not yet collected and leaves pipeline mode
+    */
+   ~DbPipeline();
+
+   /**
+    * send queues a prepared statement without waiting for its result
+    * @param stmt the name of the prepared statement
+    * @param nParams size of the arrays that follow
+    * @param values parameter values
+    * @param lengths lengths of the binary parameter values
+    * @param formats 0 for text parameters, 1 for binary
+    * @param resultFormat 0 == text, 1 == binary
+    * @return true if the statement was queued
+    */
+   bool send(const char *stmt, int nParams, const char * const *values,
+             const int *lengths, const int *formats, int resultFormat = 1);
+
+   /**
+    * sync ends the current implicit transaction and flushes everything
+    * queued so far to the server
+    * @return true on success
+    */
+   bool sync();
+
+   /**
+    * next waits for the result of the oldest statement whose result has not
+    * yet been collected, syncing first if necessary
+    * @return the result, which the caller must PQclear, or NULL if no
+    *         statement is outstanding or the connection failed
+    */
+   PGresult *next();
+
+   /**
+    * singleRow asks for the rows of the most recently sent statement to be
+    * returned one at a time, only valid while no earlier statement is outstanding
+    * @return true if single row mode was activated
+    */
+   bool singleRow();
+
+   /**
+    * part waits for the next result belonging to the oldest outstanding statement,
+    * for use with singleRow where a statement yields one PGRES_SINGLE_TUPLE result per
+    * row followed by a final PGRES_TUPLES_OK (or error) result
+    * @return the result, which the caller must PQclear, or NULL once the statement
+    *         has no more results
+    */
+   PGresult *part();
+
+   /**
+    * ok tells whether the connection could be put into pipeline mode
+    */
+   bool ok() {return pipelined;};
+
+private:
+   PGresult *first();
+
+   PGconn *conn;
+   bool pipelined;
+   bool unsynced;
+   bool partial;  //some but not all results of the oldest statement have been collected
+   int queued;    //statements whose result has not been collected
+   int syncs;     //sync markers not yet read back
+};
+
+#endif
@@ -0,0 +1,100 @@
+/*
+   collabREate db_pool.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+
+#include "db_pool.h"
+
+DbPool::DbPool(const char * const *keywords, const char * const *values, int size, DbPrepare prepare) {
+   this->prepare = prepare;
+   pthread_mutex_init(&lock, NULL);
+   pthread_cond_init(&avail, NULL);
+   if (size < 1) {
+      size = 1;
+   }
+   for (int i = 0; i < size; i++) {
+      PGconn *conn = PQconnectdbParams(keywords, values, 0);
+      if (conn == NULL) {
+         continue;
+      }
+      /* Check to see that the backend connection was successfully made */
+      if (PQstatus(conn) != CONNECTION_OK) {
+         //keep it anyway, it will be reset when it is next checked out
+         fprintf(stderr, "Connection to database failed: %s\n", PQerrorMessage(conn));
+      }
+      else {
+         prepare(conn);
+      }
+      conns.push_back(conn);
+      idle.push_back(conn);
+   }
+}
+
+DbPool::~DbPool() {
+   //prepared statements are discarded along with their sessions
+   for (vector<PGconn*>::iterator i = conns.begin(); i != conns.end(); i++) {
+      PQfinish(*i);
+   }
+   pthread_cond_destroy(&avail);
+   pthread_mutex_destroy(&lock);
+}
+
+PGconn *DbPool::checkout() {
+   pthread_mutex_lock(&lock);
+   while (idle.empty()) {
+      pthread_cond_wait(&avail, &lock);
+   }
+   PGconn *conn = idle.back();
+   idle.pop_back();
+   pthread_mutex_unlock(&lock);
+   if (PQstatus(conn) == CONNECTION_BAD) {
+      repair(conn);
+   }
+   return conn;
+}
+
+void DbPool::checkin(PGconn *conn) {
+   if (PQstatus(conn) == CONNECTION_BAD) {
+      repair(conn);
+   }
+   else if (PQtransactionStatus(conn) != PQTRANS_IDLE) {
+      //never hand a connection in the middle of a transaction to someone else
+      PQclear(PQexec(conn, "ROLLBACK;"));
+   }
+   pthread_mutex_lock(&lock);
+   idle.push_back(conn);
+   pthread_cond_signal(&avail);
+   pthread_mutex_unlock(&lock);
+}
+
+/**
+ * repair reconnects a connection whose backend has gone away and prepares
+ * its statements again, since they do not survive the reset
+ */
+void DbPool::repair(PGconn *conn) {
+   fprintf(stderr, "Database connection lost (%s), reconnecting\n", PQerrorMessage(conn));
+   PQreset(conn);
+   if (PQstatus(conn) == CONNECTION_OK) {
+      prepare(conn);
+   }
+   else {
+      fprintf(stderr, "Reconnect to database failed: %s\n", PQerrorMessage(conn));
+   }
+}
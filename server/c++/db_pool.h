@@ -0,0 +1,79 @@
+/*
+   collabREate db_pool.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __DB_POOL_H
+#define __DB_POOL_H
+
+#include <vector>
+#include <pthread.h>
+#include <libpq-fe.h>
+
+using namespace std;
+
+/**
+ * callback used to prepare statements on a newly opened (or reset) connection
+ */
+typedef void (*DbPrepare)(PGconn *conn);
+
+/**
+ * DbPool
+ * This class maintains a fixed size pool of libpq connections. A connection
+ * is checked out for the duration of a single statement and then checked back
+ * in, so independent operations may proceed in parallel. Connections whose
+ * backend has gone away are reset and their statements re-prepared.
+ * Never check out a second connection while already holding one, or
+ * a small pool can deadlock.
+ */
+
+class DbPool {
+public:
+   /**
+    * @param keywords NULL terminated libpq connection keywords
+    * @param values values corresponding to keywords
+    * @param size the number of connections to open
+    * @param prepare prepares statements on each connection
+    */
+   DbPool(const char * const *keywords, const char * const *values, int size, DbPrepare prepare);
+   ~DbPool();
+
+   /**
+    * checkout waits for an idle connection and takes it out of the pool
+    * @return the connection, which must be returned with checkin
+    */
+   PGconn *checkout();
+
+   /**
+    * checkin returns a connection to the pool, resetting it first if
+    * its backend has been lost
+    * @param conn a connection obtained from checkout
+    */
+   void checkin(PGconn *conn);
+
+private:
+   void repair(PGconn *conn);
+
+   vector<PGconn*> conns;
+   vector<PGconn*> idle;
+   pthread_mutex_t lock;
+   pthread_cond_t avail;
+   DbPrepare prepare;
+};
+
+#endif
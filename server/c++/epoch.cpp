@@ -0,0 +1,156 @@
+/*
+   collabREate epoch.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+
+#include "epoch.h"
+
+using namespace std;
+
+/**
+ * EpochThread is the reader state of a single thread. Records are never
+ * freed, the record of a thread that has exited is reused by the next
+ * thread to start reading.
+ */
+struct EpochThread {
+   volatile uint64_t active;   //the epoch the current read section began in, 0 outside of one
+   int depth;                  //nesting of read sections
+   volatile int used;          //owned by a live thread
+   EpochThread *next;
+};
+
+struct Retired {
+   void *obj;
+   void (*destroy)(void *obj);
+   uint64_t epoch;             //the epoch obj was retired in
+};
+
+static volatile uint64_t globalEpoch = 1;
+static EpochThread * volatile threads = NULL;
+static __thread EpochThread *self = NULL;
+static pthread_key_t threadKey;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t limboLock = PTHREAD_MUTEX_INITIALIZER;   //guards limbo
+static vector<Retired> limbo;
+
+static void releaseThread(void *arg) {
+   EpochThread *t = (EpochThread*)arg;
+   t->depth = 0;
+   t->active = 0;
+   __sync_synchronize();
+   t->used = 0;
+}
+
+static void makeKey() {
+   pthread_key_create(&threadKey, releaseThread);
+}
+
+/**
+ * thisThread finds the record of the calling thread, claiming one the first time
+ */
+static EpochThread *thisThread() {
+   if (self == NULL) {
+      pthread_once(&keyOnce, makeKey);
+      EpochThread *t;
+      for (t = threads; t != NULL; t = t->next) {
+         if (!t->used && __sync_bool_compare_and_swap(&t->used, 0, 1)) {
+            break;
+         }
+      }
+      if (t == NULL) {
+         t = new EpochThread;
+         t->active = 0;
+         t->depth = 0;
+         t->used = 1;
+         do {
+            t->next = threads;
+         } while (!__sync_bool_compare_and_swap(&threads, t->next, t));
+      }
+      pthread_setspecific(threadKey, t);
+      self = t;
+   }
+   return self;
+}
+
+void Epoch::enter() {
+   EpochThread *t = thisThread();
+   if (t->depth++ == 0) {
+      t->active = globalEpoch;
+      //the epoch must be visible before any shared pointer is read
+      __sync_synchronize();
+   }
+}
+
+void Epoch::exit() {
+   EpochThread *t = self;
+   if (--t->depth == 0) {
+      __sync_synchronize();
+      t->active = 0;
+   }
+}
+
+void Epoch::retire(void *obj, void (*destroy)(void *obj)) {
+   Retired r;
+   r.obj = obj;
+   r.destroy = destroy;
+   //readers entering from here on are in a later epoch, and can't find obj
+   r.epoch = __sync_fetch_and_add(&globalEpoch, 1);
+   pthread_mutex_lock(&limboLock);
+   limbo.push_back(r);
+   pthread_mutex_unlock(&limboLock);
+   reclaim();
+}
+
+void Epoch::reclaim() {
+   uint64_t oldest = UINT64_MAX;
+   __sync_synchronize();
+   for (EpochThread *t = threads; t != NULL; t = t->next) {
+      uint64_t a = t->active;
+      if (a != 0 && a < oldest) {
+         oldest = a;
+      }
+   }
+   vector<Retired> done;
+   pthread_mutex_lock(&limboLock);
+   for (size_t i = 0; i < limbo.size(); ) {
+      if (limbo[i].epoch < oldest) {
+         done.push_back(limbo[i]);
+         limbo[i] = limbo.back();
+         limbo.pop_back();
+      }
+      else {
+         i++;
+      }
+   }
+   pthread_mutex_unlock(&limboLock);
+   for (vector<Retired>::iterator i = done.begin(); i != done.end(); i++) {
+      (*i->destroy)(i->obj);
+   }
+}
+
+uint32_t Epoch::pending() {
+   pthread_mutex_lock(&limboLock);
+   uint32_t n = limbo.size();
+   pthread_mutex_unlock(&limboLock);
+   return n;
+}
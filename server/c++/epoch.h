@@ -0,0 +1,79 @@
+/*
+   collabREate epoch.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __EPOCH_H
+#define __EPOCH_H
+
+#include <stdint.h>
+
+/**
+ * Epoch
+ * Epoch based reclamation for data that is read without taking locks.
+ * Readers bracket their use of shared pointers with enter and exit (or an
+ * EpochGuard). A writer first unpublishes an object, so that no reader
+ * arriving later can find it, then hands it to retire, which destroys it
+ * once every reader that might still hold it has exited. Read sections
+ * may nest and may block, which only delays reclamation.
+ */
+class Epoch {
+public:
+   /**
+    * enter starts a read section on the calling thread
+    */
+   static void enter();
+
+   /**
+    * exit ends the innermost read section of the calling thread
+    */
+   static void exit();
+
+   /**
+    * retire destroys obj once no read section that began before the call remains
+    * @param obj an object that can no longer be reached by new readers
+    * @param destroy called with obj to destroy it
+    */
+   static void retire(void *obj, void (*destroy)(void *obj));
+
+   /**
+    * reclaim destroys every retired object that no reader can still hold
+    */
+   static void reclaim();
+
+   /**
+    * pending inspector to get the number of objects waiting to be destroyed
+    * @return the object count
+    */
+   static uint32_t pending();
+};
+
+/**
+ * EpochGuard holds a read section for as long as it is in scope
+ */
+class EpochGuard {
+public:
+   EpochGuard() {
+      Epoch::enter();
+   }
+   ~EpochGuard() {
+      Epoch::exit();
+   }
+};
+
+#endif
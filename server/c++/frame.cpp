@@ -0,0 +1,481 @@
+/*
+   collabREate frame.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <string.h>
+
+#include "utils.h"
+#include "frame.h"
+
+/*
+ * The wire ids of the commands, a command's id is its index in this table plus
+ * one. Ids are part of the protocol: add new commands to the end, never reorder
+ * or remove an entry.
+ */
+static const char * const frameCommands[] = {
+   COMMAND_BYTE_PATCHED, COMMAND_CMT_CHANGED, COMMAND_TI_CHANGED,
+   COMMAND_OP_TI_CHANGED, COMMAND_OP_TYPE_CHANGED, COMMAND_ENUM_CREATED,
+   COMMAND_ENUM_DELETED, COMMAND_ENUM_BF_CHANGED, COMMAND_ENUM_RENAMED,
+   COMMAND_ENUM_CMT_CHANGED, COMMAND_ENUM_CONST_CREATED, COMMAND_ENUM_CONST_DELETED,
+   COMMAND_STRUC_CREATED, COMMAND_STRUC_DELETED, COMMAND_STRUC_RENAMED,
+   COMMAND_STRUC_EXPANDED, COMMAND_STRUC_CMT_CHANGED,
+   COMMAND_CREATE_STRUC_MEMBER_DATA, COMMAND_CREATE_STRUC_MEMBER_STRUCT,
+   COMMAND_CREATE_STRUC_MEMBER_REF, COMMAND_CREATE_STRUC_MEMBER_STROFF,
+   COMMAND_CREATE_STRUC_MEMBER_STR, COMMAND_CREATE_STRUC_MEMBER_ENUM,
+   COMMAND_STRUC_MEMBER_DELETED, COMMAND_SET_STACK_VAR_NAME,
+   COMMAND_SET_STRUCT_MEMBER_NAME, COMMAND_STRUC_MEMBER_CHANGED_DATA,
+   COMMAND_STRUC_MEMBER_CHANGED_STRUCT, COMMAND_STRUC_MEMBER_CHANGED_STR,
+   COMMAND_THUNK_CREATED, COMMAND_FUNC_TAIL_APPENDED, COMMAND_FUNC_TAIL_REMOVED,
+   COMMAND_TAIL_OWNER_CHANGED, COMMAND_FUNC_NORET_CHANGED, COMMAND_SEGM_ADDED,
+   COMMAND_SEGM_DELETED, COMMAND_SEGM_START_CHANGED, COMMAND_SEGM_END_CHANGED,
+   COMMAND_SEGM_MOVED, COMMAND_AREA_CMT_CHANGED, COMMAND_STRUC_MEMBER_CHANGED_OFFSET,
+   COMMAND_STRUC_MEMBER_CHANGED_ENUM, COMMAND_CREATE_STRUC_MEMBER_OFFSET,
+   COMMAND_UNDEFINE, COMMAND_MAKE_CODE, COMMAND_MAKE_DATA, COMMAND_MOVE_SEGM,
+   COMMAND_RENAMED, COMMAND_ADD_FUNC, COMMAND_DEL_FUNC, COMMAND_SET_FUNC_START,
+   COMMAND_SET_FUNC_END, COMMAND_VALIDATE_FLIRT_FUNC, COMMAND_ADD_CREF,
+   COMMAND_ADD_DREF, COMMAND_DEL_CREF, COMMAND_DEL_DREF, COMMAND_USER_MESSAGE,
+
+   MSG_INITIAL_CHALLENGE, MSG_AUTH_REQUEST, MSG_AUTH_REPLY, MSG_PROJECT_LIST,
+   MSG_PROJECT_JOIN_REQUEST, MSG_PROJECT_JOIN_REPLY, MSG_PROJECT_NEW_REQUEST,
+   MSG_SEND_UPDATES, MSG_PROJECT_REJOIN_REQUEST, MSG_ACK_UPDATEID,
+   MSG_PROJECT_SNAPSHOT_REQUEST, MSG_PROJECT_SNAPSHOT_REPLY, MSG_PROJECT_FORK_REQUEST,
+   MSG_PROJECT_SNAPFORK_REQUEST, MSG_PROJECT_FORK_FOLLOW, MSG_PROJECT_LEAVE,
+   MSG_GET_REQ_PERMS, MSG_GET_REQ_PERMS_REPLY, MSG_SET_REQ_PERMS,
+   MSG_SET_REQ_PERMS_REPLY, MSG_GET_PROJ_PERMS, MSG_GET_PROJ_PERMS_REPLY,
+   MSG_SET_PROJ_PERMS, MSG_SET_PROJ_PERMS_REPLY, MSG_ERROR, MSG_FATAL,
+   MSG_PING, MSG_PONG
+};
+
+#define NUM_FRAME_COMMANDS (sizeof(frameCommands) / sizeof(frameCommands[0]))
+
+#define COMMAND_HASH_SIZE   2048         //slots in the command hash, a power of 2 large enough for a seed to be found quickly
+#define COMMAND_HASH_SEED   0x811c9dc5   //the FNV-1a offset basis, tried first
+
+static uint32_t commandHash(uint32_t seed, const char *cmd) {
+   uint32_t h = seed;
+   for (const unsigned char *p = (const unsigned char*)cmd; *p; p++) {
+      h = (h ^ *p) * 16777619;
+   }
+   return h & (COMMAND_HASH_SIZE - 1);
+}
+
+/**
+ * CommandIds indexes the command table by name with a perfect hash, so that
+ * finding the id of a command costs one FNV-1a hash and one strcmp, and no
+ * allocation. The seed is the first, counting up from COMMAND_HASH_SEED,
+ * that hashes every command to its own slot. It is chosen before main
+ * runs, and the table is only read after that.
+ */
+class CommandIds {
+public:
+   CommandIds() {
+      for (seed = COMMAND_HASH_SEED; !fill(); seed++) {
+      }
+   }
+
+   uint16_t find(const char *cmd) {
+      uint16_t id = slots[commandHash(seed, cmd)];
+      return id != FRAME_NAMED && strcmp(frameCommands[id - 1], cmd) == 0 ? id : FRAME_NAMED;
+   }
+
+private:
+   bool fill() {
+      memset(slots, 0, sizeof(slots));
+      for (uint16_t i = 0; i < NUM_FRAME_COMMANDS; i++) {
+         uint16_t &slot = slots[commandHash(seed, frameCommands[i])];
+         if (slot != FRAME_NAMED) {
+            return false;
+         }
+         slot = i + 1;
+      }
+      return true;
+   }
+
+   uint32_t seed;
+   uint16_t slots[COMMAND_HASH_SIZE];   //command ids, FRAME_NAMED for an empty slot
+};
+
+static CommandIds commandIds;
+
+uint16_t frameCommandId(const char *cmd) {
+   return commandIds.find(cmd);
+}
+
+uint16_t frameCommandCount() {
+   return NUM_FRAME_COMMANDS;
+}
+
+const char *frameCommandName(uint16_t id) {
+   if (id == FRAME_NAMED || id > NUM_FRAME_COMMANDS) {
+      return NULL;
+   }
+   return frameCommands[id - 1];
+}
+
+//CBOR major types
+#define CBOR_UINT     0
+#define CBOR_NEGINT   1
+#define CBOR_TEXT     3
+#define CBOR_ARRAY    4
+#define CBOR_MAP      5
+#define CBOR_SIMPLE   7
+
+#define CBOR_FALSE    0xf4
+#define CBOR_TRUE     0xf5
+#define CBOR_NULL     0xf6
+#define CBOR_DOUBLE   0xfb
+
+static void putBE(string &out, uint64_t val, int size) {
+   for (int shift = (size - 1) * 8; shift >= 0; shift -= 8) {
+      out += (char)(val >> shift);
+   }
+}
+
+static uint64_t getBE(const unsigned char *p, int size) {
+   uint64_t val = 0;
+   for (int i = 0; i < size; i++) {
+      val = (val << 8) | p[i];
+   }
+   return val;
+}
+
+/**
+ * putHead writes the initial bytes of a CBOR item in their shortest form
+ * @param major the major type of the item
+ * @param val the value, length or element count of the item
+ */
+static void putHead(string &out, int major, uint64_t val) {
+   unsigned char mt = major << 5;
+   if (val < 24) {
+      out += (char)(mt | val);
+   }
+   else if (val <= 0xff) {
+      out += (char)(mt | 24);
+      putBE(out, val, 1);
+   }
+   else if (val <= 0xffff) {
+      out += (char)(mt | 25);
+      putBE(out, val, 2);
+   }
+   else if (val <= 0xffffffffULL) {
+      out += (char)(mt | 26);
+      putBE(out, val, 4);
+   }
+   else {
+      out += (char)(mt | 27);
+      putBE(out, val, 8);
+   }
+}
+
+static void putItem(string &out, json_object *val) {
+   switch (json_object_get_type(val)) {
+      case json_type_null:
+         out += (char)CBOR_NULL;
+         break;
+      case json_type_boolean:
+         out += (char)(json_object_get_boolean(val) ? CBOR_TRUE : CBOR_FALSE);
+         break;
+      case json_type_double: {
+         double d = json_object_get_double(val);
+         uint64_t bits;
+         memcpy(&bits, &d, sizeof(bits));
+         out += (char)CBOR_DOUBLE;
+         putBE(out, bits, 8);
+         break;
+      }
+      case json_type_int: {
+         int64_t i = json_object_get_int64(val);
+         if (i >= 0) {
+            putHead(out, CBOR_UINT, (uint64_t)i);
+         }
+         else {
+            putHead(out, CBOR_NEGINT, (uint64_t)(-(i + 1)));
+         }
+         break;
+      }
+      case json_type_string: {
+         int len = json_object_get_string_len(val);
+         putHead(out, CBOR_TEXT, len);
+         out.append(json_object_get_string(val), len);
+         break;
+      }
+      case json_type_array: {
+         int len = json_object_array_length(val);
+         putHead(out, CBOR_ARRAY, len);
+         for (int i = 0; i < len; i++) {
+            putItem(out, json_object_array_get_idx(val, i));
+         }
+         break;
+      }
+      case json_type_object: {
+         putHead(out, CBOR_MAP, json_object_object_length(val));
+         json_object_object_foreach(val, key, child) {
+            putHead(out, CBOR_TEXT, strlen(key));
+            out += key;
+            putItem(out, child);
+         }
+         break;
+      }
+   }
+}
+
+/**
+ * headerField decides whether a member of a message travels in the frame header
+ * @param key the member's name
+ * @param val the member's value
+ * @return the member's FRAME_HAS_ flag, or 0 if it stays in the body
+ */
+static uint16_t headerField(const char *key, json_object *val) {
+   if (!json_object_is_type(val, json_type_int)) {
+      return 0;
+   }
+   if (strcmp(key, "updateid") == 0) {
+      return FRAME_HAS_UPDATEID;
+   }
+   if (strcmp(key, "addr") == 0) {
+      return FRAME_HAS_ADDR;
+   }
+   if (strcmp(key, "pid") == 0) {
+      int64_t pid = json_object_get_int64(val);
+      return pid == (int32_t)pid ? FRAME_HAS_PID : 0;
+   }
+   return 0;
+}
+
+void encodeFrame(json_object *obj, uint64_t updateid, string &out) {
+   uint16_t command = FRAME_NAMED;
+   uint16_t flags = 0;
+   uint64_t addr = 0;
+   int32_t pid = 0;
+   int members = 0;
+   json_object_object_foreach(obj, key, val) {
+      uint16_t field = headerField(key, val);
+      if (field == FRAME_HAS_UPDATEID) {
+         if (updateid == 0) {
+            updateid = json_object_get_int64(val);
+         }
+      }
+      else if (field == FRAME_HAS_ADDR) {
+         addr = json_object_get_int64(val);
+      }
+      else if (field == FRAME_HAS_PID) {
+         pid = json_object_get_int(val);
+      }
+      else if (strcmp(key, "type") == 0 && frameCommandId(json_object_get_string(val)) != FRAME_NAMED) {
+         command = frameCommandId(json_object_get_string(val));
+      }
+      else {
+         members++;
+      }
+      flags |= field;
+   }
+   if (updateid != 0) {
+      flags |= FRAME_HAS_UPDATEID;
+   }
+
+   size_t start = out.length();
+   putBE(out, 0, FRAME_LENGTH_SIZE);   //filled in once the body is known
+   putBE(out, command, 2);
+   putBE(out, flags, 2);
+   putBE(out, updateid, 8);
+   putBE(out, addr, 8);
+   putBE(out, (uint32_t)pid, 4);
+
+   putHead(out, CBOR_MAP, members);
+   json_object_object_foreach(obj, k, v) {
+      if (headerField(k, v) != 0 || (command != FRAME_NAMED && strcmp(k, "type") == 0)) {
+         continue;
+      }
+      putHead(out, CBOR_TEXT, strlen(k));
+      out += k;
+      putItem(out, v);
+   }
+
+   uint32_t len = out.length() - start - FRAME_LENGTH_SIZE;
+   for (int i = 0; i < FRAME_LENGTH_SIZE; i++) {
+      out[start + i] = (char)(len >> (24 - 8 * i));
+   }
+}
+
+/**
+ * CborReader walks the body of a received frame
+ */
+struct CborReader {
+   const unsigned char *p;
+   const unsigned char *end;
+   int maxDepth;
+
+   /**
+    * head reads the initial bytes of an item
+    * @param major receives the major type
+    * @param val receives the value, length or element count
+    * @param info receives the additional information bits
+    * @return false if the item is truncated or uses an unsupported encoding
+    */
+   bool head(int *major, uint64_t *val, int *info) {
+      if (p >= end) {
+         return false;
+      }
+      *major = *p >> 5;
+      *info = *p & 0x1f;
+      p++;
+      if (*info < 24) {
+         *val = *info;
+         return true;
+      }
+      if (*info > 27) {
+         return false;   //indefinite lengths are never sent
+      }
+      int size = 1 << (*info - 24);
+      if (end - p < size) {
+         return false;
+      }
+      *val = getBE(p, size);
+      p += size;
+      return true;
+   }
+
+   /**
+    * fail releases a partially decoded container
+    * @param res the container, which is set to NULL
+    * @return false
+    */
+   bool fail(json_object **res) {
+      json_object_put(*res);
+      *res = NULL;
+      return false;
+   }
+
+   /**
+    * item decodes a single item and everything nested within it
+    * @param res receives the item, NULL for a CBOR null
+    * @param depth the nesting depth of the item
+    * @return false if the item is malformed
+    */
+   bool item(json_object **res, int depth) {
+      int major;
+      int info;
+      uint64_t val;
+      *res = NULL;
+      if (!head(&major, &val, &info)) {
+         return false;
+      }
+      switch (major) {
+         case CBOR_UINT:
+            *res = json_object_new_int64((int64_t)val);
+            return true;
+         case CBOR_NEGINT:
+            *res = json_object_new_int64(-1 - (int64_t)val);
+            return true;
+         case CBOR_TEXT:
+            if (val > (uint64_t)(end - p)) {
+               return false;
+            }
+            *res = json_object_new_string_len((const char*)p, (int)val);
+            p += val;
+            return true;
+         case CBOR_ARRAY:
+         case CBOR_MAP: {
+            //every element takes at least a byte, which bounds the count
+            if (depth >= maxDepth || val > (uint64_t)(end - p)) {
+               return false;
+            }
+            if (major == CBOR_ARRAY) {
+               *res = json_object_new_array();
+               for (uint64_t i = 0; i < val; i++) {
+                  json_object *elt;
+                  if (!item(&elt, depth + 1)) {
+                     return fail(res);
+                  }
+                  json_object_array_add(*res, elt);
+               }
+               return true;
+            }
+            *res = json_object_new_object();
+            for (uint64_t i = 0; i < val; i++) {
+               json_object *member;
+               uint64_t klen;
+               if (!head(&major, &klen, &info) || major != CBOR_TEXT ||
+                   klen > (uint64_t)(end - p)) {
+                  return fail(res);
+               }
+               string key((const char*)p, klen);
+               p += klen;
+               if (!item(&member, depth + 1)) {
+                  return fail(res);
+               }
+               json_object_object_add(*res, key.c_str(), member);
+            }
+            return true;
+         }
+         case CBOR_SIMPLE:
+            if (info == 20 || info == 21) {
+               *res = json_object_new_boolean(info == 21);
+               return true;
+            }
+            if (info == 22) {
+               return true;
+            }
+            if (info == 27) {
+               double d;
+               memcpy(&d, &val, sizeof(d));
+               *res = json_object_new_double(d);
+               return true;
+            }
+            return false;
+      }
+      return false;
+   }
+};
+
+json_object *decodeFrame(const unsigned char *frame, uint32_t len, int maxDepth) {
+   if (len < FRAME_HEADER_SIZE) {
+      return NULL;
+   }
+   uint16_t command = getBE(frame + 4, 2);
+   uint16_t flags = getBE(frame + 6, 2);
+   const char *type = NULL;
+   if (command != FRAME_NAMED && (type = frameCommandName(command)) == NULL) {
+      return NULL;
+   }
+
+   CborReader body;
+   body.p = frame + FRAME_HEADER_SIZE;
+   body.end = frame + len;
+   body.maxDepth = maxDepth;
+   json_object *obj;
+   if (!body.item(&obj, 0) || body.p != body.end || !json_object_is_type(obj, json_type_object)) {
+      json_object_put(obj);
+      return NULL;
+   }
+
+   if (type != NULL) {
+      json_object_object_add(obj, "type", json_object_new_string(type));
+   }
+   if (flags & FRAME_HAS_UPDATEID) {
+      json_object_object_add(obj, "updateid", json_object_new_int64(getBE(frame + 8, 8)));
+   }
+   if (flags & FRAME_HAS_ADDR) {
+      json_object_object_add(obj, "addr", json_object_new_int64(getBE(frame + 16, 8)));
+   }
+   if (flags & FRAME_HAS_PID) {
+      json_object_object_add(obj, "pid", json_object_new_int((int32_t)getBE(frame + 24, 4)));
+   }
+   return obj;
+}
@@ -0,0 +1,102 @@
+/*
+   collabREate frame.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __COLLAB_FRAME_H
+#define __COLLAB_FRAME_H
+
+#include <stdint.h>
+#include <string>
+#include <json-c/json.h>
+
+using namespace std;
+
+/*
+ * Binary framing, negotiated by a client that sends an auth_request with
+ * "protocol" set to PROTOCOL_FRAMED_VERSION. The auth_reply is the last
+ * newline delimited message the server sends and the auth_request the last one
+ * it reads, every message after those is a frame. A client must not send
+ * anything else until it has seen the auth_reply.
+ *
+ * Every frame starts with a fixed header, all fields big endian:
+ *
+ *    u32 length     bytes that follow this field, the header included
+ *    u16 command    index of "type" in the command table, FRAME_NAMED if
+ *                   the body carries "type" itself
+ *    u16 flags      which of the following fields hold a value
+ *    u64 updateid
+ *    u64 addr
+ *    i32 pid
+ *
+ * followed by a body holding the rest of the message as a CBOR map (RFC 7049),
+ * of which only definite length integers, text strings, arrays, maps, doubles,
+ * false, true and null are used.
+ */
+
+#define FRAME_LENGTH_SIZE   4
+#define FRAME_HEADER_SIZE   28    //the length field included
+#define FRAME_UPDATEID_AT   8     //where the updateid starts in the header
+
+#define FRAME_NAMED         0
+
+#define FRAME_HAS_UPDATEID  0x0001
+#define FRAME_HAS_ADDR      0x0002
+#define FRAME_HAS_PID       0x0004
+
+/**
+ * frameCommandId looks up the wire id of a command. Ids are dense, so they
+ * also index tables kept per command, such as the handlers and permissions
+ * of Client
+ * @param cmd the "type" of a message
+ * @return the command's id or FRAME_NAMED if it has none
+ */
+uint16_t frameCommandId(const char *cmd);
+
+/**
+ * frameCommandCount inspector to get the number of commands with an id,
+ * which run from 1 to the count
+ * @return the count
+ */
+uint16_t frameCommandCount();
+
+/**
+ * frameCommandName looks up the command a wire id stands for
+ * @param id a command id received in a frame header
+ * @return the command or NULL if id is not in the table
+ */
+const char *frameCommandName(uint16_t id);
+
+/**
+ * encodeFrame appends the frame for a message to out
+ * @param obj the message, which is not modified
+ * @param updateid if non-zero, the updateid to send in place of any in obj
+ * @param out receives the frame
+ */
+void encodeFrame(json_object *obj, uint64_t updateid, string &out);
+
+/**
+ * decodeFrame rebuilds the message carried by a frame
+ * @param frame the frame, starting with its length field
+ * @param len the length of the whole frame
+ * @param maxDepth the deepest nesting of maps and arrays to accept
+ * @return the message, or NULL if the frame is malformed
+ */
+json_object *decodeFrame(const unsigned char *frame, uint32_t len, int maxDepth);
+
+#endif
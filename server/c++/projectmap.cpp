@@ -21,124 +21,169 @@
 #include "client.h"
 #include "projectmap.h"
 #include "clientset.h"
+#include "epoch.h"
 
 typedef map<int,ClientSet*>::iterator Projects_it;
 
+static void destroyTable(void *obj) {
+   delete (map<int,ClientSet*>*)obj;
+}
+
 ProjectMap::ProjectMap() {
-   pthread_mutexattr_t attr;
-   pthread_mutexattr_init(&attr);
-   pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-   pthread_mutex_init(&mutex, &attr); 
-   pthread_mutexattr_destroy(&attr);
+   projects = new map<int,ClientSet*>;
+   pthread_mutex_init(&mutex, NULL); 
 }
 
 ProjectMap::~ProjectMap() {
+   delete projects;
    pthread_mutex_destroy(&mutex);
 }
 
 //iterate over all projects in the set
 void ProjectMap::loop(pcb func, void *user) {
-   pthread_mutex_lock(&mutex);
-   for (Projects_it i = projects.begin(); i != projects.end(); i++) {
+   EpochGuard guard;
+   map<int,ClientSet*> *snap = projects;
+   for (Projects_it i = snap->begin(); i != snap->end(); i++) {
       ClientSet *s = (*i).second;
       if (!(*func)(s, user)) {
          break;
       }
    }
-   pthread_mutex_unlock(&mutex);
 }
 
 //loop across all clients in a single project
 void ProjectMap::loopProject(int key, ccb func, void *user) {
-   ClientSet *s = get(key);
-   s->loop(func, user);
+   //the read section keeps a set dropped meanwhile from being destroyed
+   EpochGuard guard;
+   ClientSet *s = getPriv(key);
+   if (s != NULL) {
+      s->loop(func, user);
+   }
 }
 
 //loop across all clients in all projects
 void ProjectMap::loopClients(ccb func, void *user) {
-   pthread_mutex_lock(&mutex);
-   for (Projects_it i = projects.begin(); i != projects.end(); i++) {
+   EpochGuard guard;
+   map<int,ClientSet*> *snap = projects;
+   for (Projects_it i = snap->begin(); i != snap->end(); i++) {
       ClientSet *s = (*i).second;
       s->loop(func, user);
    }
-   pthread_mutex_unlock(&mutex);
 }
 
 //add a new project
 void ProjectMap::put(int key, ClientSet *val) {
    pthread_mutex_lock(&mutex);
-   projects[key] = val;
+   putPriv(key, val);
    pthread_mutex_unlock(&mutex);
 }
 
-//call this only if you already hold a lock
+//publish a copy of the table with key added, call this only if you already hold a lock
+void ProjectMap::putPriv(int key, ClientSet *val) {
+   map<int,ClientSet*> *next = new map<int,ClientSet*>(*projects);
+   ClientSet *&slot = (*next)[key];
+   ClientSet *prev = slot;
+   slot = val;
+   publish(next);
+   if (prev != NULL) {
+      prev->release();
+   }
+}
+
+//replace the table, call this only if you already hold a lock
+void ProjectMap::publish(map<int,ClientSet*> *next) {
+   map<int,ClientSet*> *prev = projects;
+   __sync_synchronize();
+   projects = next;
+   Epoch::retire(prev, destroyTable);
+}
+
+//the caller must be in a read section or hold mutex
 ClientSet *ProjectMap::getPriv(int key) {
    ClientSet *res = NULL;
-   Projects_it it = projects.find(key);
-   if (it != projects.end()) {
+   map<int,ClientSet*> *snap = projects;
+   Projects_it it = snap->find(key);
+   if (it != snap->end()) {
       res = (*it).second;
    }
    return res;
 }
 
-//add client to the given project
+//add client to the given project, moving it from any other
 void ProjectMap::addClient(int key, Client *c) {
-   pthread_mutex_lock(&mutex);
-   ClientSet *proj = getPriv(key);
-   if (proj == NULL) {
-      proj = new ClientSet;
-      //already have a lock don't neet to call put
-      projects[key] = proj;
+   int prev = c->setMember(key);
+   if (prev != -1 && prev != key) {
+      leave(prev, c);
+   }
+   ClientSet *proj = get(key);
+   if (proj == NULL || !proj->add(c)) {
+      //there is no set, or it is being dropped, so add one while no set can be dropped
+      pthread_mutex_lock(&mutex);
+      ClientSet *cur = getPriv(key);
+      if (cur == NULL) {
+         cur = new ClientSet;
+         putPriv(key, cur);
+      }
+      cur->add(c);
+      pthread_mutex_unlock(&mutex);
+   }
+   if (proj != NULL) {
+      proj->release();
    }
-   proj->add(c);
-   pthread_mutex_unlock(&mutex);
 }
 
-//add client to the given project
+//add client to the project it has joined
 void ProjectMap::addClient(Client *c) {
-   pthread_mutex_lock(&mutex);
-   ClientSet *proj = getPriv(c->getPid());
-   if (proj == NULL) {
-      proj = new ClientSet;
-      //already have a lock don't neet to call put
-      projects[c->getPid()] = proj;
-   }
-   proj->add(c);
-   pthread_mutex_unlock(&mutex);
+   addClient(c->getPid(), c);
 }
 
-//add client to the given project
+//remove client from whatever project it receives updates from
 void ProjectMap::removeClient(Client *c) {
-   pthread_mutex_lock(&mutex);
-   ClientSet *proj = getPriv(c->getPid());
+   //stops posts from any loop already under way, before the set has changed
+   int prev = c->setMember(-1);
+   if (prev != -1) {
+      leave(prev, c);
+   }
+}
+
+//remove client from the set of the given project, dropping the set if that empties it
+void ProjectMap::leave(int key, Client *c) {
+   ClientSet *proj = get(key);
    if (proj != NULL) {
-      proj->remove(c);
+      if (proj->remove(c) == 0) {
+         drop(key, proj);
+      }
+      proj->release();
+   }
+}
+
+//drop the set of a project unless a client has joined it in the meantime
+void ProjectMap::drop(int key, ClientSet *proj) {
+   pthread_mutex_lock(&mutex);
+   if (getPriv(key) == proj && proj->close()) {
+      map<int,ClientSet*> *next = new map<int,ClientSet*>(*projects);
+      next->erase(key);
+      publish(next);
+      //the table's reference
+      proj->release();
    }
    pthread_mutex_unlock(&mutex);
 }
 
 //number of clients connected to the given project
 int ProjectMap::numClients(int key) {
-   int res = 0;
-   pthread_mutex_lock(&mutex);
+   EpochGuard guard;
    ClientSet *proj = getPriv(key);
-   if (proj != NULL) {
-      res = proj->size();
-   }
-   pthread_mutex_unlock(&mutex);
-   return res;
+   return proj != NULL ? proj->size() : 0;
 }
 
-//get the list of clients connected to the given project
-//should this be a cloned set ?? probably
+//get the set of clients connected to the given project
 ClientSet *ProjectMap::get(int key) {
-   ClientSet *res = NULL;
-   pthread_mutex_lock(&mutex);
-   Projects_it it = projects.find(key);
-   if (it != projects.end()) {
-      res = (*it).second;
+   EpochGuard guard;
+   ClientSet *proj = getPriv(key);
+   if (proj != NULL && !proj->tryRef()) {
+      //released by a drop since this snapshot was published
+      proj = NULL;
    }
-   pthread_mutex_unlock(&mutex);
-   return res;
+   return proj;
 }
-
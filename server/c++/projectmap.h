@@ -39,21 +39,42 @@ typedef bool (*pcb)(ClientSet *c, void *user);
 //client callback function
 typedef bool (*ccb)(Client *c, void *user);
 
+/**
+ * ProjectMap
+ * The ClientSet of every project with connected clients. Like a ClientSet,
+ * the table is an immutable snapshot that is copied when a project is
+ * added or dropped, so lookups take no lock. The table holds a reference
+ * to each of its ClientSets, and a set is dropped and released when its
+ * last client leaves. Only adding or dropping a set takes the table's
+ * lock, joining and leaving an existing set does not.
+ */
 class ProjectMap {
 private:
-   map<int,ClientSet*> projects;
-   pthread_mutex_t mutex;
+   map<int,ClientSet*> * volatile projects;   //the current snapshot
+   pthread_mutex_t mutex;                     //serializes changes to projects
 
    ClientSet *getPriv(int key);
+   void putPriv(int key, ClientSet *val);
+   void publish(map<int,ClientSet*> *next);
+   void leave(int key, Client *c);
+   void drop(int key, ClientSet *proj);
 
 public:
    ProjectMap();
    ~ProjectMap();
 
+   /**
+    * put adds a project, replacing any set it already has
+    * @param val the project's clients, the table takes over the caller's reference
+    */
    void put(int key, ClientSet *val);
    void addClient(int key, Client *c);
    void addClient(Client *c);
    void removeClient(Client *c);
+   /**
+    * get the set of clients connected to a project
+    * @return a new reference to the set, which the caller must release, or NULL
+    */
    ClientSet *get(int key);
    int numClients(int key);
    //loop across all projects
@@ -0,0 +1,734 @@
+/*
+   collabREate reactor.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "utils.h"
+#include "client.h"
+#include "reactor.h"
+#include "uring.h"
+
+#define MAX_EVENTS 64
+
+//the low bits of a ring request's user data name the kind of request,
+//the rest is the Client it was queued for
+#define OP_WAKE     0   //the loop's eventfd is readable
+#define OP_RECV     1
+#define OP_SEND     2
+#define OP_POLL     3   //a oneshot POLLOUT
+#define OP_CANCEL   4
+#define OP_TIMEOUT  5   //the earliest of the loop's timers is due
+#define OP_MASK     7
+
+static uint64_t tag(Client *c, int op) {
+   return (uint64_t)(uintptr_t)c | op;
+}
+
+Reactor::Reactor(int nthreads, bool uring) {
+   next = 0;
+   hbInterval = hbTimeout = 0;
+   this->uring = uring;
+   pthread_mutex_init(&mutex, NULL);
+   if (nthreads < 1) {
+      nthreads = 1;
+   }
+   for (int i = 0; i < nthreads; i++) {
+      int epfd = -1;
+      Uring *ring = NULL;
+      if (uring) {
+         ring = new Uring(URING_ENTRIES);
+         if (!ring->isValid() || !ring->provideBuffers()) {
+            fprintf(stderr, "io_uring setup failed\n");
+            delete ring;
+            continue;
+         }
+      }
+      else {
+         epfd = epoll_create1(EPOLL_CLOEXEC);
+         if (epfd == -1) {
+            perror("epoll_create1");
+            continue;
+         }
+      }
+      int evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.ptr = NULL;
+      //a ring polls evfd once its loop starts
+      if (evfd == -1 || (!uring && epoll_ctl(epfd, EPOLL_CTL_ADD, evfd, &ev) == -1)) {
+         perror("eventfd");
+         if (epfd != -1) {
+            close(epfd);
+         }
+         delete ring;
+         if (evfd != -1) {
+            close(evfd);
+         }
+         continue;
+      }
+      Loop *l = new Loop;
+      l->owner = this;
+      l->epfd = epfd;
+      l->ring = ring;
+      l->multishot = true;
+      l->evfd = evfd;
+      l->timeoutAt = UINT64_MAX;
+      memset(l->wheel, 0, sizeof(l->wheel));
+      l->wheelTick = 0;
+      l->tracked = 0;
+      l->pings = l->evictions = 0;
+      pthread_mutex_init(&l->mutex, NULL);
+      loops.push_back(l);
+   }
+}
+
+Reactor::~Reactor() {
+   for (vector<Loop*>::iterator i = loops.begin(); i != loops.end(); i++) {
+      if ((*i)->epfd != -1) {
+         close((*i)->epfd);
+      }
+      delete (*i)->ring;
+      close((*i)->evfd);
+      pthread_mutex_destroy(&(*i)->mutex);
+      delete *i;
+   }
+   pthread_mutex_destroy(&mutex);
+}
+
+void Reactor::start() {
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   for (vector<Loop*>::iterator i = loops.begin(); i != loops.end(); i++) {
+      pthread_t tid;
+      pthread_create(&tid, &attr, uring ? runUring : run, (void*)*i);
+   }
+   pthread_attr_destroy(&attr);
+}
+
+int Reactor::assign() {
+   if (loops.size() == 0) {
+      return -1;
+   }
+   pthread_mutex_lock(&mutex);
+   int l = next++ % loops.size();
+   pthread_mutex_unlock(&mutex);
+   return l;
+}
+
+bool Reactor::add(Client *c) {
+   pthread_mutex_lock(&c->outLock);
+   c->polled = true;
+   bool res = watch(c, c->baseEvents() | (c->events & EPOLLOUT));
+   pthread_mutex_unlock(&c->outLock);
+   return res;
+}
+
+bool Reactor::watch(Client *c, uint32_t events) {
+   if (c->loop == -1) {
+      c->loop = assign();
+      if (c->loop == -1) {
+         return false;
+      }
+      if (uring) {
+         c->conn->sendVia(loops[c->loop]->ring, tag(c, OP_SEND));
+      }
+   }
+   if (uring) {
+      return watchRing(c, events);
+   }
+   if (events == c->events && c->registered == (events != 0)) {
+      return true;
+   }
+   int epfd = loops[c->loop]->epfd;
+   struct epoll_event ev;
+   ev.events = events;
+   ev.data.ptr = c;
+   int op;
+   if (events == 0) {
+      op = EPOLL_CTL_DEL;
+   }
+   else {
+      op = c->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+   }
+   if (epoll_ctl(epfd, op, c->getFileDescriptor(), &ev) == -1) {
+      perror("epoll_ctl");
+      return false;
+   }
+   c->registered = events != 0;
+   c->events = events;
+   return true;
+}
+
+void Reactor::release(Client *c) {
+   if (c->loop == -1) {
+      //never registered, so no loop can hold a reference to it
+      teardown(c);
+      return;
+   }
+   Loop *l = loops[c->loop];
+   pthread_mutex_lock(&l->mutex);
+   l->pending.push_back(c);
+   pthread_mutex_unlock(&l->mutex);
+   wake(l);
+}
+
+void Reactor::controlDone(Client *c) {
+   Loop *l = loops[c->loop];
+   pthread_mutex_lock(&l->mutex);
+   l->controlled.push_back(c);
+   pthread_mutex_unlock(&l->mutex);
+   wake(l);
+}
+
+/**
+ * wake interrupts a loop's wait for events
+ */
+void Reactor::wake(Loop *l) {
+   uint64_t one = 1;
+   if (::write(l->evfd, &one, sizeof(one)) != sizeof(one)) {
+      perror("eventfd write");
+   }
+}
+
+/**
+ * watchRing queues the ring requests that stand in for the epoll events of
+ * interest. A multishot recv, once queued, stays in place for the life of the
+ * connection. A POLLOUT is only needed while no send is outstanding, as a
+ * send's completion wakes the client just as well. The caller must hold the
+ * client's output lock.
+ */
+bool Reactor::watchRing(Client *c, uint32_t events) {
+   Loop *l = loops[c->loop];
+   int fd = c->getFileDescriptor();
+   bool ok = true;
+   if (fd != -1 && (events & EPOLLIN) && !c->receiving) {
+      __sync_add_and_fetch(&c->inflight, 1);
+      c->receiving = l->ring->recv(fd, tag(c, OP_RECV), l->multishot);
+      if (!c->receiving) {
+         __sync_sub_and_fetch(&c->inflight, 1);
+         ok = false;
+      }
+   }
+   if (fd != -1 && !(events & EPOLLIN) && c->receiving && !c->recvCancelled) {
+      //reading is paused, completeRecv queues a new recv if it resumes in the meantime
+      c->recvCancelled = l->ring->cancel(tag(c, OP_RECV), tag(NULL, OP_CANCEL));
+   }
+   if (fd != -1 && (events & EPOLLOUT) && !c->pollingOut && !c->conn->isSending()) {
+      __sync_add_and_fetch(&c->inflight, 1);
+      c->pollingOut = l->ring->poll(fd, POLLOUT, tag(c, OP_POLL), false);
+      if (!c->pollingOut) {
+         __sync_sub_and_fetch(&c->inflight, 1);
+         ok = false;
+      }
+   }
+   c->registered = events != 0;
+   c->events = events;
+   return ok;
+}
+
+/**
+ * teardown deregisters a client before closing its socket, so the
+ * descriptor can not be reused while it is still in an epoll set. In uring
+ * mode the socket is shut down so that the client's outstanding requests
+ * complete, and the connection's reference to it is released once they all have.
+ */
+void Reactor::teardown(Client *c) {
+   if (c->loop != -1) {
+      cancelTimer(loops[c->loop], c);
+      unfile(loops[c->loop], c);
+   }
+   pthread_mutex_lock(&c->outLock);
+   //nothing may register the client again
+   c->closing = true;
+   if (c->registered) {
+      watch(c, 0);
+   }
+   pthread_mutex_unlock(&c->outLock);
+   fprintf(stderr, "Client loop has ended\n");
+   if (uring && c->loop != -1) {
+      Uring *ring = loops[c->loop]->ring;
+      c->conn->shutdown();
+      ring->cancel(tag(c, OP_RECV), tag(NULL, OP_CANCEL));
+      ring->cancel(tag(c, OP_POLL), tag(NULL, OP_CANCEL));
+      c->terminate();
+      c->dying = true;
+      finish(c);
+      return;
+   }
+   c->terminate();
+   c->release();
+}
+
+/**
+ * finish releases a torn down client once the last of its ring requests has completed
+ */
+void Reactor::finish(Client *c) {
+   pthread_mutex_lock(&c->outLock);
+   bool idle = c->inflight == 0 && !c->conn->isSending();
+   pthread_mutex_unlock(&c->outLock);
+   if (idle) {
+      c->release();
+   }
+}
+
+void Reactor::resumeAfter(Client *c, uint32_t ms) {
+   Loop *l = loops[c->loop];
+   cancelTimer(l, c);
+   c->wakeAt = monotonic_ms() + ms;
+   l->timers.insert(make_pair(c->wakeAt, c));
+}
+
+/**
+ * cancelTimer forgets a client's pending resume
+ */
+void Reactor::cancelTimer(Loop *l, Client *c) {
+   if (c->wakeAt == 0) {
+      return;
+   }
+   pair<multimap<uint64_t,Client*>::iterator,multimap<uint64_t,Client*>::iterator> r = l->timers.equal_range(c->wakeAt);
+   for (multimap<uint64_t,Client*>::iterator i = r.first; i != r.second; i++) {
+      if (i->second == c) {
+         l->timers.erase(i);
+         break;
+      }
+   }
+   c->wakeAt = 0;
+}
+
+/**
+ * runTimers resumes every client whose pause has ended and runs the timer wheel
+ * @return the milliseconds until the next timer is due, -1 if there is none
+ */
+int Reactor::runTimers(Loop *l) {
+   uint64_t now = monotonic_ms();
+   int wait = runWheel(l, now);
+   if (l->timers.empty()) {
+      return wait;
+   }
+   while (!l->timers.empty() && l->timers.begin()->first <= now) {
+      Client *c = l->timers.begin()->second;
+      l->timers.erase(l->timers.begin());
+      c->wakeAt = 0;
+      c->resume(PAUSE_RATE);
+   }
+   if (!l->timers.empty()) {
+      int due = (int)(l->timers.begin()->first - now);
+      if (wait == -1 || due < wait) {
+         wait = due;
+      }
+   }
+   return wait;
+}
+
+void Reactor::setHeartbeat(uint32_t interval, uint32_t timeout) {
+   hbInterval = interval;
+   hbTimeout = timeout;
+}
+
+void Reactor::track(Client *c) {
+   if (c->loop == -1 || hbInterval == 0) {
+      return;
+   }
+   Loop *l = loops[c->loop];
+   c->lastHeard = monotonic_ms();
+   pthread_mutex_lock(&l->mutex);
+   bool idle = l->tracked == 0;
+   file(l, c, c->lastHeard + hbInterval);
+   pthread_mutex_unlock(&l->mutex);
+   if (idle) {
+      //the loop may be waiting with no timeout
+      wake(l);
+   }
+}
+
+/**
+ * file puts a client in the wheel slot for the tick holding due. Must be
+ * called with the loop's mutex held.
+ * @param due when the client should next be looked at, in monotonic_ms
+ */
+void Reactor::file(Loop *l, Client *c, uint64_t due) {
+   if (l->tracked == 0) {
+      //the wheel has not been turning
+      l->wheelTick = monotonic_ms() / WHEEL_TICK_MS;
+   }
+   uint64_t tick = due / WHEEL_TICK_MS;
+   if (tick < l->wheelTick) {
+      tick = l->wheelTick;
+   }
+   Client **slot = &l->wheel[tick % WHEEL_SLOTS];
+   c->wheelDue = tick;
+   c->wheelPrev = NULL;
+   c->wheelNext = *slot;
+   if (*slot != NULL) {
+      (*slot)->wheelPrev = c;
+   }
+   *slot = c;
+   l->tracked++;
+}
+
+/**
+ * detach takes a client out of its wheel slot. Must be called with the loop's mutex held.
+ */
+void Reactor::detach(Loop *l, Client *c) {
+   if (c->wheelPrev != NULL) {
+      c->wheelPrev->wheelNext = c->wheelNext;
+   }
+   else {
+      l->wheel[c->wheelDue % WHEEL_SLOTS] = c->wheelNext;
+   }
+   if (c->wheelNext != NULL) {
+      c->wheelNext->wheelPrev = c->wheelPrev;
+   }
+   c->wheelDue = 0;
+   l->tracked--;
+}
+
+/**
+ * unfile takes a client off the wheel, if it is on it
+ */
+void Reactor::unfile(Loop *l, Client *c) {
+   pthread_mutex_lock(&l->mutex);
+   if (c->wheelDue != 0) {
+      detach(l, c);
+   }
+   pthread_mutex_unlock(&l->mutex);
+}
+
+/**
+ * runWheel runs every tick of the timer wheel up to now, handing each client
+ * that has come due to heartbeat
+ * @return the milliseconds until the next tick, -1 if the wheel is empty
+ */
+int Reactor::runWheel(Loop *l, uint64_t now) {
+   uint64_t tick = now / WHEEL_TICK_MS;
+   vector<Client*> due;
+   pthread_mutex_lock(&l->mutex);
+   if (l->tracked == 0) {
+      pthread_mutex_unlock(&l->mutex);
+      return -1;
+   }
+   //after a long wait a single turn of the wheel covers every slot
+   uint64_t last = tick < l->wheelTick + WHEEL_SLOTS ? tick : l->wheelTick + WHEEL_SLOTS - 1;
+   for (uint64_t t = l->wheelTick; t <= last; t++) {
+      Client *c = l->wheel[t % WHEEL_SLOTS];
+      while (c != NULL) {
+         Client *next = c->wheelNext;
+         //clients a full turn or more away stay where they are
+         if (c->wheelDue <= tick) {
+            detach(l, c);
+            due.push_back(c);
+         }
+         c = next;
+      }
+   }
+   if (tick >= l->wheelTick) {
+      l->wheelTick = tick + 1;
+   }
+   pthread_mutex_unlock(&l->mutex);
+   //only this loop deletes these clients, so they can be used outside the lock
+   for (vector<Client*>::iterator i = due.begin(); i != due.end(); i++) {
+      heartbeat(l, *i, now);
+   }
+   pthread_mutex_lock(&l->mutex);
+   bool empty = l->tracked == 0;
+   pthread_mutex_unlock(&l->mutex);
+   return empty ? -1 : (int)((tick + 1) * WHEEL_TICK_MS - now);
+}
+
+/**
+ * heartbeat checks on a client that has come due on the wheel, pinging it
+ * if it has gone quiet and evicting it if it has stayed that way
+ */
+void Reactor::heartbeat(Loop *l, Client *c, uint64_t now) {
+   pthread_mutex_lock(&c->outLock);
+   bool closing = c->closing;
+   //nothing is heard from a client while reading from it is paused
+   bool paused = c->paused != 0;
+   pthread_mutex_unlock(&c->outLock);
+   if (closing) {
+      return;
+   }
+   uint64_t heard = paused ? now : c->lastHeard;
+   uint64_t next = heard + hbInterval;
+   if (now - heard >= hbTimeout) {
+      l->evictions++;
+      c->evict();
+      return;
+   }
+   if (now - heard >= hbInterval) {
+      l->pings++;
+      c->send_data(MSG_PING, NULL);
+      //ping again each interval until the timeout
+      next = now + hbInterval < heard + hbTimeout ? now + hbInterval : heard + hbTimeout;
+   }
+   pthread_mutex_lock(&l->mutex);
+   file(l, c, next);
+   pthread_mutex_unlock(&l->mutex);
+}
+
+void Reactor::beginBatch() {
+   if (uring) {
+      Uring::holdSubmits();
+   }
+}
+
+void Reactor::endBatch() {
+   if (uring) {
+      Uring::releaseSubmits();
+      for (vector<Loop*>::iterator i = loops.begin(); i != loops.end(); i++) {
+         (*i)->ring->submit(false);
+      }
+   }
+}
+
+string Reactor::dumpStats() {
+   string s;
+   for (unsigned int i = 0; i < loops.size(); i++) {
+      char line[128];
+      if (uring) {
+         snprintf(line, sizeof(line), "io_uring loop %u: %llu submit calls, %llu completions\n", i,
+                  (unsigned long long)loops[i]->ring->submitCalls(),
+                  (unsigned long long)loops[i]->ring->completionCount());
+         s += line;
+      }
+      if (hbInterval != 0) {
+         pthread_mutex_lock(&loops[i]->mutex);
+         snprintf(line, sizeof(line), "heartbeats loop %u: %u clients, %llu pings, %llu evictions\n", i,
+                  loops[i]->tracked, (unsigned long long)loops[i]->pings,
+                  (unsigned long long)loops[i]->evictions);
+         pthread_mutex_unlock(&loops[i]->mutex);
+         s += line;
+      }
+   }
+   return s;
+}
+
+/**
+ * run is the body of a single I/O thread. Each ready client is given a
+ * chance to read and write, and clients whose connections have closed are
+ * torn down here, on their owning thread. Released clients are torn down
+ * only after the current batch of events, which may still refer to them,
+ * has been handled.
+ */
+void *Reactor::run(void *arg) {
+   Loop *l = (Loop*)arg;
+   struct epoll_event events[MAX_EVENTS];
+   while (true) {
+      int n = epoll_wait(l->epfd, events, MAX_EVENTS, l->owner->runTimers(l));
+      if (n == -1) {
+         if (errno == EINTR) {
+            continue;
+         }
+         perror("epoll_wait");
+         break;
+      }
+      bool wake = false;
+      for (int i = 0; i < n; i++) {
+         Client *c = (Client*)events[i].data.ptr;
+         if (c == NULL) {
+            wake = true;
+            continue;
+         }
+         if (!c->onEvent(events[i].events)) {
+            l->owner->teardown(c);
+         }
+      }
+      if (wake) {
+         l->owner->drain(l);
+      }
+   }
+   return NULL;
+}
+
+/**
+ * drain runs on a loop once it has been woken, to resume the clients whose
+ * control messages have been handled and tear down released clients
+ */
+void Reactor::drain(Loop *l) {
+   uint64_t count;
+   if (::read(l->evfd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+      perror("eventfd read");
+   }
+   pthread_mutex_lock(&l->mutex);
+   vector<Client*> controlled;
+   controlled.swap(l->controlled);
+   vector<Client*> released;
+   released.swap(l->pending);
+   pthread_mutex_unlock(&l->mutex);
+   for (vector<Client*>::iterator i = controlled.begin(); i != controlled.end(); i++) {
+      Client *c = *i;
+      if (!c->dying && !c->onControlDone()) {
+         teardown(c);
+      }
+      c->release();
+   }
+   for (vector<Client*>::iterator i = released.begin(); i != released.end(); i++) {
+      teardown(*i);
+   }
+}
+
+/**
+ * completeRecv hands the data of a recv completion to its client and keeps
+ * a recv queued for as long as the connection lasts
+ */
+void Reactor::completeRecv(Loop *l, Client *c, int res, uint32_t flags) {
+   bool ok = true;
+   if (res > 0) {
+      if (!c->dying) {
+         ok = c->onReceived(l->ring->buffer(flags), res);
+      }
+      l->ring->recycle(flags);
+   }
+   else if (res == -EINVAL && l->multishot) {
+      //no multishot recv in this kernel, fall back to one recv at a time
+      l->multishot = false;
+   }
+   else if (res == -ECANCELED && !c->dying) {
+      //reading has been paused
+   }
+   else if (res != -ENOBUFS) {
+      ok = false;   //end of file or a failed connection
+   }
+   if (!Uring::more(flags)) {
+      pthread_mutex_lock(&c->outLock);
+      c->receiving = false;
+      c->recvCancelled = false;
+      if (ok && !c->dying && (c->events & EPOLLIN)) {
+         c->receiving = l->ring->recv(c->getFileDescriptor(), tag(c, OP_RECV), l->multishot);
+         ok = c->receiving;
+      }
+      bool rearmed = c->receiving;
+      pthread_mutex_unlock(&c->outLock);
+      if (rearmed) {
+         return;
+      }
+      __sync_sub_and_fetch(&c->inflight, 1);
+   }
+   if (c->dying) {
+      finish(c);
+   }
+   else if (!ok) {
+      teardown(c);
+   }
+}
+
+/**
+ * completeSend retires what a send wrote and lets the client queue the next one
+ */
+void Reactor::completeSend(Client *c, int res) {
+   pthread_mutex_lock(&c->outLock);
+   c->conn->sendComplete(res);
+   pthread_mutex_unlock(&c->outLock);
+   if (c->dying) {
+      finish(c);
+   }
+   else if (!c->onEvent(EPOLLOUT)) {
+      teardown(c);
+   }
+}
+
+void Reactor::completePoll(Client *c) {
+   pthread_mutex_lock(&c->outLock);
+   c->pollingOut = false;
+   pthread_mutex_unlock(&c->outLock);
+   __sync_sub_and_fetch(&c->inflight, 1);
+   if (c->dying) {
+      finish(c);
+   }
+   else if (!c->onEvent(EPOLLOUT)) {
+      teardown(c);
+   }
+}
+
+/**
+ * submitOthers submits whatever the calling loop queued on other loops' rings
+ */
+void Reactor::submitOthers(Loop *l) {
+   for (vector<Loop*>::iterator i = loops.begin(); i != loops.end(); i++) {
+      if (*i != l) {
+         (*i)->ring->submit(false);
+      }
+   }
+}
+
+/**
+ * runUring is the body of a single I/O thread in uring mode. Requests queued
+ * while handling a batch of completions, by this thread or for any client, are
+ * submitted together with the wait for the next batch.
+ */
+void *Reactor::runUring(void *arg) {
+   Loop *l = (Loop*)arg;
+   Reactor *r = l->owner;
+   UringCompletion done[MAX_EVENTS];
+   Uring::holdSubmits();
+   l->ring->poll(l->evfd, POLLIN, tag(NULL, OP_WAKE), true);
+   while (true) {
+      int wait = r->runTimers(l);
+      if (wait >= 0 && monotonic_ms() + wait < l->timeoutAt) {
+         //no timeout is queued that ends the wait in time for the next timer
+         l->timeoutAt = monotonic_ms() + wait;
+         l->ring->timeout(wait, tag(NULL, OP_TIMEOUT));
+      }
+      r->submitOthers(l);
+      if (!l->ring->submit(true)) {
+         break;
+      }
+      bool wake = false;
+      unsigned int n = l->ring->reap(done, MAX_EVENTS);
+      for (unsigned int i = 0; i < n; i++) {
+         Client *c = (Client*)(uintptr_t)(done[i].user & ~(uint64_t)OP_MASK);
+         switch (done[i].user & OP_MASK) {
+            case OP_WAKE:
+               wake = true;
+               if (!Uring::more(done[i].flags)) {
+                  l->ring->poll(l->evfd, POLLIN, tag(NULL, OP_WAKE), true);
+               }
+               break;
+            case OP_RECV:
+               r->completeRecv(l, c, done[i].res, done[i].flags);
+               break;
+            case OP_SEND:
+               r->completeSend(c, done[i].res);
+               break;
+            case OP_POLL:
+               r->completePoll(c);
+               break;
+            case OP_TIMEOUT:
+               //runTimers queues another if an earlier timeout is still outstanding
+               l->timeoutAt = UINT64_MAX;
+               break;
+            default:
+               break;
+         }
+      }
+      if (wake) {
+         r->drain(l);
+      }
+   }
+   return NULL;
+}
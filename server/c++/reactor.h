@@ -0,0 +1,203 @@
+/*
+   collabREate reactor.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __REACTOR_H
+#define __REACTOR_H
+
+#include <vector>
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
+
+class Client;
+class Uring;
+
+#define WHEEL_SLOTS     64
+#define WHEEL_TICK_MS   1000
+
+using namespace std;
+
+/**
+ * Reactor
+ * This class multiplexes client sockets over a small number of epoll
+ * driven I/O threads. In epoll mode the reactor services both reads and
+ * writes for every client. In threaded mode each client still has its own
+ * reader thread, and the reactor only drains outbound queues that could
+ * not be written immediately. Each client is assigned to a single loop for
+ * its lifetime, and connections are only ever torn down on their owning
+ * loop, which then releases its reference to the client.
+ *
+ * In uring mode each loop owns an io_uring in place of its epoll set. A
+ * multishot recv into the loop's provided buffers replaces EPOLLIN, sends
+ * are queued on the ring rather than written directly, and a oneshot poll
+ * replaces EPOLLOUT while nothing is being sent. A client is only released
+ * once every request it has on the ring has completed.
+ *
+ * A client that stops reading, see Client::pause, is removed from its loop's
+ * epoll set, or has its recv cancelled in uring mode, until it resumes. Each
+ * loop keeps the clients due to resume at a given time.
+ *
+ * Clients that negotiated heartbeats are also kept on a timer wheel by their
+ * loop, ticking once a second. When a client's slot comes around it is
+ * pinged if it has been quiet for the heartbeat interval, and evicted if it
+ * has been quiet for the heartbeat timeout, otherwise it is filed again for
+ * when its interval ends. Noting activity costs a client nothing beyond a
+ * timestamp, and each tick only visits the clients that are due.
+ */
+
+class Reactor {
+private:
+   struct Loop {
+      Reactor *owner;
+      int epfd;
+      Uring *ring;               //replaces epfd in uring mode
+      bool multishot;            //the kernel supports multishot recv
+      int evfd;                  //wakes the loop when releases are pending
+      pthread_mutex_t mutex;     //guards pending and controlled
+      vector<Client*> pending;   //clients waiting to be torn down
+      vector<Client*> controlled;   //referenced clients whose control message has been handled
+      multimap<uint64_t,Client*> timers;   //clients to resume, by monotonic_ms deadline
+      uint64_t timeoutAt;        //uring mode: the earliest deadline a ring timeout is queued for
+      //heartbeat timer wheel, guarded by mutex. Each slot lists the clients
+      //due in a tick that maps to it, linked through Client::wheelNext
+      Client *wheel[WHEEL_SLOTS];
+      uint64_t wheelTick;        //the next tick to run
+      uint32_t tracked;          //clients on the wheel
+      uint64_t pings;
+      uint64_t evictions;
+   };
+
+   vector<Loop*> loops;
+   unsigned int next;    //round robin assignment of new clients
+   pthread_mutex_t mutex;
+   bool uring;
+
+   static void *run(void *arg);
+   static void *runUring(void *arg);
+   void teardown(Client *c);
+   void finish(Client *c);
+   int assign();
+   bool watchRing(Client *c, uint32_t events);
+   void completeRecv(Loop *l, Client *c, int res, uint32_t flags);
+   void completeSend(Client *c, int res);
+   void completePoll(Client *c);
+   void submitOthers(Loop *l);
+   int runTimers(Loop *l);
+   void cancelTimer(Loop *l, Client *c);
+   int runWheel(Loop *l, uint64_t now);
+   void file(Loop *l, Client *c, uint64_t due);
+   void unfile(Loop *l, Client *c);
+   void detach(Loop *l, Client *c);
+   void heartbeat(Loop *l, Client *c, uint64_t now);
+   void wake(Loop *l);
+   void drain(Loop *l);
+
+   uint32_t hbInterval;   //ms of quiet before a tracked client is pinged
+   uint32_t hbTimeout;    //ms of quiet before it is evicted
+
+public:
+   /**
+    * @param nthreads the number of I/O threads to run
+    * @param uring true to drive each loop with an io_uring rather than epoll
+    */
+   Reactor(int nthreads, bool uring = false);
+   ~Reactor();
+
+   /**
+    * start launches the I/O threads
+    */
+   void start();
+
+   /**
+    * add hands the reading side of a newly connected client to one of
+    * the I/O threads
+    * @param c the client to add
+    * @return false if the client could not be registered
+    */
+   bool add(Client *c);
+
+   /**
+    * watch changes the set of epoll events a client is registered for,
+    * registering the client with a loop on first use. An empty set removes
+    * the client from its loop. The caller must hold the client's output lock.
+    * @param c the client to update
+    * @param events the EPOLL* events of interest
+    * @return false if the registration could not be changed
+    */
+   bool watch(Client *c, uint32_t events);
+
+   /**
+    * release hands a client whose connection has ended to its owning loop,
+    * which terminates and releases it once no events for it can be pending
+    * @param c the client to release
+    */
+   void release(Client *c);
+
+   /**
+    * controlDone hands a client whose control message has been handled by
+    * the ControlPool back to its owning loop, see Client::onControlDone
+    * @param c the client, the loop takes over the caller's reference to it
+    */
+   void controlDone(Client *c);
+
+   /**
+    * setHeartbeat sets the heartbeat timing of clients passed to track
+    * @param interval ms of quiet before a client is pinged
+    * @param timeout ms of quiet before a client is evicted
+    */
+   void setHeartbeat(uint32_t interval, uint32_t timeout);
+
+   /**
+    * track puts a client on its loop's timer wheel, so that it is pinged
+    * when it goes quiet and evicted if it stays that way
+    * @param c the client, which must already have been assigned a loop
+    */
+   void track(Client *c);
+
+   /**
+    * resumeAfter lifts a client's PAUSE_RATE once ms milliseconds have passed.
+    * Only the client's own loop may call this, from reading the client.
+    * @param c the client, which must be paused for PAUSE_RATE
+    * @param ms the length of the pause
+    */
+   void resumeAfter(Client *c, uint32_t ms);
+
+   /**
+    * beginBatch holds back the ring submissions of the calling thread until
+    * endBatch, so that the sends of many clients are submitted together.
+    * Has no effect unless in uring mode.
+    */
+   void beginBatch();
+
+   /**
+    * endBatch submits everything queued since beginBatch
+    */
+   void endBatch();
+
+   /**
+    * dumpStats describes the work done by the I/O threads
+    * @return the stats
+    */
+   string dumpStats();
+
+};
+
+#endif
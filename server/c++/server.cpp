@@ -43,6 +43,7 @@
 #include "db_mgr.h"
 #include "mgr_helper.h"
 #include "client.h"
+#include "uring.h"
 
 #define ERROR_NO_USER "Failed to find user %s"
 #define ERROR_NO_PRIVS "drop_privs failed!"
@@ -79,12 +80,35 @@ void sigchld(int sig) {
 //   fprintf(stderr, "sigchld returning\n");
 }
 
+/*
+ * An acceptor hands the connections accepted by one listening service
+ * to the connection manager
+ */
+struct Acceptor {
+   NetworkService *svc;
+   ConnectionManagerBase *mgr;
+   ManagerHelper *hlp;
+};
+
+void *accept_loop(void *arg) {
+   Acceptor *a = (Acceptor*)arg;
+   while (!a->hlp->done) {
+      NetworkIO *nio = a->svc->accept();
+      fprintf(stderr, "Accepted new client\n");
+      if (nio) {
+         a->mgr->add(nio);
+      }
+   }
+   return NULL;
+}
+
 /*
  * Enter a threaded accept loop.  Create a new thread using the
  * client_callback function for each new client connection.  If 
- * the client thread crashes, the entire server crashes.
+ * the client thread crashes, the entire server crashes. Each
+ * service after the first is accepted on by a thread of its own.
  */
-void loop(NetworkService *svc) {
+void loop(vector<Tcp6Service*> &svcs) {
    ConnectionManagerBase *mgr;
    if (conf == NULL) {
       mgr = new BasicConnectionManager(conf);
@@ -106,13 +130,18 @@ void loop(NetworkService *svc) {
    ManagerHelper hlp(mgr, conf);
    hlp.start();
    helper = &hlp;
-   while (!hlp.done) {
-      NetworkIO *nio = svc->accept();
-      fprintf(stderr, "Accepted new client\n");
-      if (nio) {
-         mgr->add(nio);
+   vector<Acceptor> acceptors(svcs.size());
+   for (unsigned int i = 0; i < svcs.size(); i++) {
+      acceptors[i].svc = svcs[i];
+      acceptors[i].mgr = mgr;
+      acceptors[i].hlp = &hlp;
+      if (i > 0) {
+         pthread_t tid;
+         pthread_create(&tid, NULL, accept_loop, &acceptors[i]);
+         pthread_detach(tid);
       }
    }
+   accept_loop(&acceptors[0]);
    while (!hlp.quit) {};
 }
 
@@ -207,7 +236,7 @@ void writePidFile() {
  * then calls a function to accept incoming connections in a loop.
  */
 int main(int argc, char **argv, char **envp) {
-   Tcp6Service *svc;
+   vector<Tcp6Service*> svcs;
    srand(time(NULL));
    if (signal(SIGCHLD, sigchld) == SIG_ERR) {
 #ifdef DEBUG      
@@ -239,12 +268,31 @@ int main(int argc, char **argv, char **envp) {
    short svc_port = getShortOption(conf, "SERVER_PORT", 5042);
    string svc_host = getStringOption(conf, "SERVER_HOST", "");
    const char *svc_user = getCstringOption(conf, "RUN_AS", NULL);
+   int backlog = getIntOption(conf, "LISTEN_BACKLOG", 128);
+   int deferAccept = getIntOption(conf, "TCP_DEFER_ACCEPT", 0);
+   //with more than one acceptor each listens on its own socket and the kernel
+   //spreads new connections among them
+   int acceptors = getIntOption(conf, "ACCEPT_THREADS", 1);
+   if (acceptors < 1) {
+      acceptors = 1;
+   }
+   bool reusePort = acceptors > 1;
+   //the uring I/O model accepts connections through io_uring as well
+   bool uring = getStringOption(conf, "IO_MODEL", "threads") == "uring" && Uring::supported();
    try {
-      if (svc_host.length() == 0) {
-         svc = new Tcp6Service(svc_port);
-      }
-      else {
-         svc = new Tcp6Service(svc_host.c_str(), svc_port);
+      for (int i = 0; i < acceptors; i++) {
+         Tcp6Service *svc;
+         if (svc_host.length() == 0) {
+            svc = uring ? new UringService(svc_port, backlog, reusePort) : new Tcp6Service(svc_port, backlog, reusePort);
+         }
+         else {
+            svc = uring ? new UringService(svc_host.c_str(), svc_port, backlog, reusePort) :
+                          new Tcp6Service(svc_host.c_str(), svc_port, backlog, reusePort);
+         }
+         if (deferAccept > 0) {
+            svc->setDeferAccept(deferAccept);
+         }
+         svcs.push_back(svc);
       }
    } catch (int e) {
       exit(e);
@@ -254,7 +302,7 @@ int main(int argc, char **argv, char **envp) {
    }
    daemon(1, 0);
    writePidFile();
-   loop(svc);
+   loop(svcs);
    return 0;
 }
 
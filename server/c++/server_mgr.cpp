@@ -137,7 +137,8 @@ ServerManager::ServerManager(json_object *p) {
 }
 
 /**
- * deleteProject deletes a local project
+ * deleteProject deletes a local project, a project whose history is shared by
+ * forks of it is left intact
  * @param pid the local project id to delete
  */
 void ServerManager::deleteProject(int pid) {
@@ -329,14 +330,14 @@ void ServerManager::initQueries() {
       }
       PQclear(res);
       res = PQprepare(dbConn, "getAllUpdates", 
-                      "select updateid,username,pid,json,created from updates where pid=$1 order by updateid asc",
+                      "select u.updateid,u.username,u.pid,u.json,u.created from project_lineage($1) l join updates u on u.pid = l.pid where u.updateid <= l.maxid order by u.updateid asc",
                       0, NULL);
       if (PQresultStatus(res) != PGRES_COMMAND_OK) {
          fprintf(stderr, "getAllUpdates: %s\n", PQerrorMessage(dbConn));
       }
       PQclear(res);
       res = PQprepare(dbConn, "deleteUpdatesByPID", 
-                      "delete from updates where pid=$1",
+                      "delete from updates where pid=$1 and not exists (select 1 from forklist where source=$1)",
                       0, NULL);
       if (PQresultStatus(res) != PGRES_COMMAND_OK) {
          fprintf(stderr, "deleteUpdatesByPID: %s\n", PQerrorMessage(dbConn));
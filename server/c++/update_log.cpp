@@ -0,0 +1,403 @@
+/*
+   collabREate update_log.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "utils.h"
+#include "frame.h"
+#include "cli_mgr.h"
+#include "update_log.h"
+
+#define UPDATE_LOG_HEADER 16   //UPDATE_LOG_MAGIC and since
+
+/**
+ * writeAt writes an array of buffers at a given offset, as many system calls as it takes
+ */
+static bool writeAt(int fd, struct iovec *iov, int iovcnt, off_t offset) {
+   while (iovcnt > 0) {
+      int n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+      ssize_t nbytes = pwritev(fd, iov, n, offset);
+      if (nbytes < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         return false;
+      }
+      offset += nbytes;
+      while (n > 0 && (size_t)nbytes >= iov->iov_len) {
+         nbytes -= iov->iov_len;
+         iov++;
+         iovcnt--;
+         n--;
+      }
+      if (nbytes > 0) {
+         iov->iov_base = (char*)iov->iov_base + nbytes;
+         iov->iov_len -= nbytes;
+      }
+   }
+   return true;
+}
+
+UpdateLog::UpdateLog(const string &base) {
+   pthread_mutex_init(&lock, NULL);
+   this->base = base;
+   usable = false;
+   logFd = idxFd = -1;
+   since = count = lastId = logSize = 0;
+}
+
+UpdateLog::~UpdateLog() {
+   close();
+   pthread_mutex_destroy(&lock);
+}
+
+/**
+ * open opens the files of a usable log, dropping any update whose append
+ * was cut short. Must be called with lock held.
+ * @return false if the files are unreadable
+ */
+bool UpdateLog::open() {
+   if (logFd != -1) {
+      return true;
+   }
+   logFd = ::open((base + ".log").c_str(), O_RDWR);
+   idxFd = ::open((base + ".idx").c_str(), O_RDWR);
+   char header[UPDATE_LOG_HEADER];
+   struct stat lst, ist;
+   if (logFd == -1 || idxFd == -1 || fstat(logFd, &lst) == -1 || fstat(idxFd, &ist) == -1 ||
+       pread(idxFd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, UPDATE_LOG_MAGIC, 8) != 0) {
+      close();
+      return false;
+   }
+   memcpy(&since, header + 8, sizeof(since));
+   count = (ist.st_size - UPDATE_LOG_HEADER) / sizeof(UpdateLogEntry);
+   lastId = since;
+   logSize = 0;
+   UpdateLogEntry e;
+   //the index is written after the log, so only the index can run past the end of the other
+   while (count > 0) {
+      if (!readEntry(count - 1, &e)) {
+         close();
+         return false;
+      }
+      char nl = 0;
+      if (e.offset + e.length <= (uint64_t)lst.st_size && pread(logFd, &nl, 1, e.offset + e.length - 1) == 1 && nl == '\n') {
+         lastId = e.updateid;
+         logSize = e.offset + e.length;
+         break;
+      }
+      count--;
+   }
+   if (ftruncate(idxFd, UPDATE_LOG_HEADER + count * sizeof(UpdateLogEntry)) == -1 ||
+       ftruncate(logFd, logSize) == -1) {
+      close();
+      return false;
+   }
+   return true;
+}
+
+/**
+ * close closes the log's files, must be called with lock held
+ */
+void UpdateLog::close() {
+   if (logFd != -1) {
+      ::close(logFd);
+   }
+   if (idxFd != -1) {
+      ::close(idxFd);
+   }
+   logFd = idxFd = -1;
+}
+
+bool UpdateLog::readEntry(uint64_t idx, UpdateLogEntry *e) {
+   return pread(idxFd, e, sizeof(*e), UPDATE_LOG_HEADER + idx * sizeof(*e)) == sizeof(*e);
+}
+
+bool UpdateLog::verify(uint64_t lastStored) {
+   pthread_mutex_lock(&lock);
+   usable = open() && (count > 0 ? lastStored == lastId : lastStored <= since);
+   close();
+   if (!usable) {
+      unlink((base + ".log").c_str());
+      unlink((base + ".idx").c_str());
+   }
+   bool result = usable;
+   pthread_mutex_unlock(&lock);
+   return result;
+}
+
+bool UpdateLog::create(uint64_t since) {
+   pthread_mutex_lock(&lock);
+   close();
+   usable = false;
+   logFd = ::open((base + ".log").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+   idxFd = ::open((base + ".idx").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+   char header[UPDATE_LOG_HEADER];
+   memcpy(header, UPDATE_LOG_MAGIC, 8);
+   memcpy(header + 8, &since, sizeof(since));
+   if (logFd == -1 || idxFd == -1 || pwrite(idxFd, header, sizeof(header), 0) != sizeof(header)) {
+      fprintf(stderr, "unable to create update log %s: %s\n", base.c_str(), strerror(errno));
+      close();
+   }
+   else {
+      this->since = lastId = since;
+      count = logSize = 0;
+      usable = true;
+   }
+   bool result = usable;
+   pthread_mutex_unlock(&lock);
+   return result;
+}
+
+bool UpdateLog::append(Packet **batch, uint32_t count) {
+   struct iovec *iov = new struct iovec[count];
+   UpdateLogEntry *entries = new UpdateLogEntry[count];
+   pthread_mutex_lock(&lock);
+   bool ok = usable && open();
+   if (ok) {
+      uint64_t offset = logSize;
+      for (uint32_t i = 0; i < count; i++) {
+         EncodedPacket *wire = batch[i]->wire;
+         iov[i].iov_base = (void*)wire->data();
+         iov[i].iov_len = wire->length();
+         entries[i].updateid = batch[i]->uid;
+         entries[i].offset = offset;
+         entries[i].length = wire->length();
+         entries[i].cmd = batch[i]->cmdId;
+         entries[i].reserved = 0;
+         offset += wire->length();
+      }
+      struct iovec idx;
+      idx.iov_base = entries;
+      idx.iov_len = count * sizeof(UpdateLogEntry);
+      ok = writeAt(logFd, iov, count, logSize) &&
+           writeAt(idxFd, &idx, 1, UPDATE_LOG_HEADER + this->count * sizeof(UpdateLogEntry));
+      if (ok) {
+         logSize = offset;
+         this->count += count;
+         lastId = entries[count - 1].updateid;
+      }
+      else {
+         fprintf(stderr, "unable to append to update log %s: %s\n", base.c_str(), strerror(errno));
+      }
+   }
+   pthread_mutex_unlock(&lock);
+   delete [] iov;
+   delete [] entries;
+   if (!ok) {
+      discard();
+   }
+   return ok;
+}
+
+int UpdateLog::find(uint64_t after, UpdateLogEntry *out, int max, int *log) {
+   int n = -1;
+   pthread_mutex_lock(&lock);
+   if (usable && after >= since && open()) {
+      //the first record newer than after
+      uint64_t lo = 0;
+      uint64_t hi = count;
+      UpdateLogEntry e;
+      while (lo < hi) {
+         uint64_t mid = lo + (hi - lo) / 2;
+         if (!readEntry(mid, &e)) {
+            break;
+         }
+         if (e.updateid <= after) {
+            lo = mid + 1;
+         }
+         else {
+            hi = mid;
+         }
+      }
+      if (lo == hi) {
+         n = count - lo < (uint64_t)max ? (int)(count - lo) : max;
+         ssize_t want = n * sizeof(UpdateLogEntry);
+         if (n > 0 && pread(idxFd, out, want, UPDATE_LOG_HEADER + lo * sizeof(UpdateLogEntry)) != want) {
+            n = -1;
+         }
+         if (n > 0) {
+            *log = dup(logFd);
+            if (*log == -1) {
+               n = -1;
+            }
+         }
+      }
+   }
+   pthread_mutex_unlock(&lock);
+   return n;
+}
+
+void UpdateLog::discard() {
+   pthread_mutex_lock(&lock);
+   //packets already queued from the log keep their own descriptors
+   close();
+   if (usable) {
+      unlink((base + ".log").c_str());
+      unlink((base + ".idx").c_str());
+   }
+   usable = false;
+   pthread_mutex_unlock(&lock);
+}
+
+bool UpdateLog::isUsable() {
+   pthread_mutex_lock(&lock);
+   bool result = usable;
+   pthread_mutex_unlock(&lock);
+   return result;
+}
+
+UpdateArchive::UpdateArchive(const string &dir) {
+   pthread_mutex_init(&lock, NULL);
+   this->dir = dir;
+   appended = appendedBytes = appendFailures = 0;
+   replays = replayedUpdates = replayedBytes = 0;
+   if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST) {
+      fprintf(stderr, "unable to create archive directory %s: %s\n", dir.c_str(), strerror(errno));
+   }
+   DIR *d = opendir(dir.c_str());
+   if (d != NULL) {
+      struct dirent *de;
+      while ((de = readdir(d)) != NULL) {
+         char *end;
+         long pid = strtol(de->d_name, &end, 10);
+         if (end != de->d_name && strcmp(end, ".idx") == 0) {
+            found.push_back((int)pid);
+         }
+      }
+      closedir(d);
+   }
+}
+
+UpdateArchive::~UpdateArchive() {
+   for (map<int,UpdateLog*>::iterator i = logs.begin(); i != logs.end(); i++) {
+      delete i->second;
+   }
+   pthread_mutex_destroy(&lock);
+}
+
+/**
+ * find looks up the log of a project
+ * @param pid the project
+ * @param create true to add a log, not yet usable, if the project has none
+ * @return the log, or NULL if the project has none and create is false
+ */
+UpdateLog *UpdateArchive::find(int pid, bool create) {
+   UpdateLog *log = NULL;
+   pthread_mutex_lock(&lock);
+   map<int,UpdateLog*>::iterator i = logs.find(pid);
+   if (i != logs.end()) {
+      log = i->second;
+   }
+   else if (create) {
+      char name[32];
+      snprintf(name, sizeof(name), "/%d", pid);
+      log = new UpdateLog(dir + name);
+      logs[pid] = log;
+   }
+   pthread_mutex_unlock(&lock);
+   return log;
+}
+
+vector<int> UpdateArchive::projects() {
+   return found;
+}
+
+void UpdateArchive::verify(int pid, uint64_t lastStored) {
+   if (!find(pid, true)->verify(lastStored)) {
+      fprintf(stderr, "update log of project %d is out of date, discarded\n", pid);
+   }
+}
+
+void UpdateArchive::create(int pid) {
+   find(pid, true)->create(0);
+}
+
+void UpdateArchive::append(Packet **batch, uint32_t count) {
+   //split the batch by project, keeping each project's updates in order
+   map<int,vector<Packet*> > byProject;
+   for (uint32_t i = 0; i < count; i++) {
+      byProject[batch[i]->pid].push_back(batch[i]);
+   }
+   uint64_t bytes = 0;
+   uint64_t failures = 0;
+   for (map<int,vector<Packet*> >::iterator i = byProject.begin(); i != byProject.end(); i++) {
+      UpdateLog *log = find(i->first, true);
+      vector<Packet*> &updates = i->second;
+      //a log started now holds everything newer than the project's first update in this batch
+      if (!log->isUsable() && !log->create(updates[0]->uid - 1)) {
+         failures += updates.size();
+         continue;
+      }
+      if (!log->append(&updates[0], updates.size())) {
+         failures += updates.size();
+         continue;
+      }
+      for (vector<Packet*>::iterator u = updates.begin(); u != updates.end(); u++) {
+         bytes += (*u)->wire->length();
+      }
+   }
+   pthread_mutex_lock(&lock);
+   appended += count - failures;
+   appendedBytes += bytes;
+   appendFailures += failures;
+   pthread_mutex_unlock(&lock);
+}
+
+UpdateLog *UpdateArchive::get(int pid) {
+   return find(pid, false);
+}
+
+void UpdateArchive::discard(int pid) {
+   UpdateLog *log = find(pid, false);
+   if (log != NULL) {
+      log->discard();
+   }
+}
+
+void UpdateArchive::replayed(uint32_t updates, uint64_t bytes) {
+   pthread_mutex_lock(&lock);
+   replays++;
+   replayedUpdates += updates;
+   replayedBytes += bytes;
+   pthread_mutex_unlock(&lock);
+}
+
+string UpdateArchive::stats() {
+   char buf[512];
+   pthread_mutex_lock(&lock);
+   snprintf(buf, sizeof(buf),
+            "Update archive: %u logs, %" PRIu64 " updates appended (%" PRIu64 " bytes), %" PRIu64 " failed\n"
+            "   %" PRIu64 " catch ups served, %" PRIu64 " updates (%" PRIu64 " bytes)\n",
+            (uint32_t)logs.size(), appended, appendedBytes, appendFailures,
+            replays, replayedUpdates, replayedBytes);
+   pthread_mutex_unlock(&lock);
+   return buf;
+}
@@ -0,0 +1,219 @@
+/*
+   collabREate update_log.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __UPDATE_LOG_H
+#define __UPDATE_LOG_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+using namespace std;
+
+class Packet;
+class EncodedPacket;
+
+//the first 8 bytes of every index file
+#define UPDATE_LOG_MAGIC "CRLOG001"
+
+/**
+ * UpdateLogEntry is a single record of a project's index file, which
+ * follows a header holding UPDATE_LOG_MAGIC and the log's since value
+ */
+struct UpdateLogEntry {
+   uint64_t updateid;
+   uint64_t offset;     //where the update's wire image starts in the log
+   uint32_t length;     //the length of the wire image, including its newline
+   uint16_t cmd;        //the frameCommandId of the update's command
+   uint16_t reserved;
+};
+
+/**
+ * UpdateLog
+ * The archive of a single project: an append-only file holding the json
+ * wire image of each of the project's updates, updateid included, exactly
+ * as it is sent to clients, and an index file of UpdateLogEntry records in
+ * updateid order. A log holds every update of its project that is newer
+ * than its since value, so a client that has seen at least that much can
+ * be caught up by handing runs of the log straight to its socket.
+ * The database remains the authoritative copy, a log that is found to
+ * disagree with it is discarded and started over.
+ */
+class UpdateLog {
+public:
+   /**
+    * @param base the path of the log, less its .log and .idx extensions
+    */
+   UpdateLog(const string &base);
+   ~UpdateLog();
+
+   /**
+    * verify opens the files left by an earlier run and checks that they hold
+    * every update the database has, discarding them if they don't. The files
+    * are closed again until the log is next used.
+    * @param lastStored the newest updateid stored in the database for the project
+    * @return true if the log can be used
+    */
+   bool verify(uint64_t lastStored);
+
+   /**
+    * create starts the log over with no updates
+    * @param since the updateid the log starts after
+    * @return false if the files could not be created
+    */
+   bool create(uint64_t since);
+
+   /**
+    * append adds a batch of stored updates, in updateid order. On failure
+    * the log is discarded, to be started over by the next append.
+    * Only the update writer may call this.
+    * @param batch the updates, all of this log's project
+    * @param count the number of updates in batch
+    * @return false if the updates could not be written
+    */
+   bool append(Packet **batch, uint32_t count);
+
+   /**
+    * find looks up the updates that follow a given one
+    * @param after the last update the caller already has
+    * @param out receives the index records of the updates
+    * @param max the size of out
+    * @param log receives a new descriptor for the log, when any records are returned
+    * @return the number of records copied to out, or -1 if the log does not
+    *         hold every update after after
+    */
+   int find(uint64_t after, UpdateLogEntry *out, int max, int *log);
+
+   /**
+    * discard deletes the log's files, leaving the log unusable until it is created again
+    */
+   void discard();
+
+   /**
+    * isUsable inspector to see whether updates may be appended to the log
+    * @return false if the log must first be created
+    */
+   bool isUsable();
+
+private:
+   bool open();
+   void close();
+   bool readEntry(uint64_t idx, UpdateLogEntry *e);
+
+   pthread_mutex_t lock;   //guards everything below
+   string base;
+   bool usable;            //the files exist and agree with the database
+   int logFd;              //-1 while the files are closed
+   int idxFd;
+   uint64_t since;
+   uint64_t count;         //records in the index
+   uint64_t lastId;        //updateid of the last record, since if there are none
+   uint64_t logSize;
+};
+
+/**
+ * UpdateArchive
+ * The UpdateLog of every project, kept in ARCHIVE_DIR as <pid>.log and
+ * <pid>.idx. Logs are created when a project is, or else as soon as one of
+ * its updates is stored, and are never removed from the archive.
+ */
+class UpdateArchive {
+public:
+   /**
+    * @param dir the directory holding the logs, which is created if need be
+    */
+   UpdateArchive(const string &dir);
+   ~UpdateArchive();
+
+   /**
+    * projects lists the projects with logs left by an earlier run, which
+    * must each be verified before they are used
+    * @return the pids of the projects
+    */
+   vector<int> projects();
+
+   /**
+    * verify checks a log left by an earlier run against the database
+    * @param pid the project of the log
+    * @param lastStored the newest updateid stored in the database for the project
+    */
+   void verify(int pid, uint64_t lastStored);
+
+   /**
+    * create starts a log for a newly created project, which holds all of its updates
+    * @param pid the project
+    */
+   void create(int pid);
+
+   /**
+    * append adds a stored batch of updates to the logs of their projects.
+    * Only the update writer may call this.
+    * @param batch the updates, in updateid order
+    * @param count the number of updates in batch
+    */
+   void append(Packet **batch, uint32_t count);
+
+   /**
+    * get finds the log of a project
+    * @param pid the project
+    * @return the log, or NULL if the project has none
+    */
+   UpdateLog *get(int pid);
+
+   /**
+    * discard deletes the log of a project whose updates are being stored
+    * some other way
+    * @param pid the project
+    */
+   void discard(int pid);
+
+   /**
+    * replayed counts a catch up served from a log
+    * @param updates the number of updates sent
+    * @param bytes the bytes sent
+    */
+   void replayed(uint32_t updates, uint64_t bytes);
+
+   /**
+    * stats reports how much has been archived and served from the archive
+    * @return a printable summary
+    */
+   string stats();
+
+private:
+   UpdateLog *find(int pid, bool create);
+
+   string dir;
+   pthread_mutex_t lock;   //guards logs and the statistics
+   map<int,UpdateLog*> logs;
+   vector<int> found;      //logs left by an earlier run
+
+   uint64_t appended;
+   uint64_t appendedBytes;
+   uint64_t appendFailures;
+   uint64_t replays;
+   uint64_t replayedUpdates;
+   uint64_t replayedBytes;
+};
+
+#endif
@@ -0,0 +1,366 @@
+/*
+   collabREate update_writer.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <algorithm>
+
+#include "utils.h"
+#include "client.h"
+#include "cli_mgr.h"
+#include "update_writer.h"
+#include "update_log.h"
+
+static uint64_t elapsedUs(const struct timeval &from, const struct timeval &to) {
+   return (to.tv_sec - from.tv_sec) * 1000000ULL + to.tv_usec - from.tv_usec;
+}
+
+/**
+ * copyEscape appends s to out escaped for the COPY text format
+ */
+static void copyEscape(string &out, const char *s, size_t len) {
+   for (size_t i = 0; i < len; i++) {
+      switch (s[i]) {
+         case '\\':
+            out += "\\\\";
+            break;
+         case '\n':
+            out += "\\n";
+            break;
+         case '\r':
+            out += "\\r";
+            break;
+         case '\t':
+            out += "\\t";
+            break;
+         default:
+            out += s[i];
+            break;
+      }
+   }
+}
+
+UpdateWriter::UpdateWriter(ConnectionManagerBase *mgr, DbPool *pool, int batchSize, int lingerMs, UpdateArchive *archive) {
+   this->mgr = mgr;
+   this->pool = pool;
+   this->archive = archive;
+   this->batchSize = batchSize < 1 ? 1 : batchSize;
+   this->lingerMs = lingerMs < 0 ? 0 : lingerMs;
+   pthread_mutex_init(&lock, NULL);
+   pthread_cond_init(&ready, NULL);
+   head = tail = NULL;
+   depth = 0;
+   batches = rows = failed = 0;
+   maxBatch = 0;
+   totalWaitUs = maxWaitUs = 0;
+   totalStoreUs = maxStoreUs = 0;
+}
+
+void UpdateWriter::start() {
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+   pthread_t tid;
+   pthread_create(&tid, &attr, run, (void*)this);
+   pthread_attr_destroy(&attr);
+}
+
+/**
+ * submit queues an update to be stored and then dispatched
+ * @param c the client that made the update
+ * @param cmd the command of the update
+ * @param cmdId the id of cmd
+ * @param obj the update, ownership passes to the writer
+ */
+void UpdateWriter::submit(Client *c, const char *cmd, uint16_t cmdId, json_object *obj) {
+   PendingUpdate *u = new PendingUpdate;
+   u->c = c->ref();
+   u->pid = c->getPid();
+   u->user = c->getUser();
+   u->cmd = cmd;
+   u->cmdId = cmdId;
+   u->obj = obj;
+   size_t jlen;
+   u->json = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &jlen);
+   u->jlen = jlen;
+   gettimeofday(&u->queued, NULL);
+   u->next = NULL;
+
+   pthread_mutex_lock(&lock);
+   if (tail == NULL) {
+      head = u;
+   }
+   else {
+      tail->next = u;
+   }
+   tail = u;
+   depth++;
+   //wake the writer when it is idle or when a batch has filled
+   if (depth == 1 || depth == batchSize) {
+      pthread_cond_signal(&ready);
+   }
+   pthread_mutex_unlock(&lock);
+}
+
+/**
+ * run waits for updates to arrive, gives a batch up to lingerMs to fill,
+ * then stores it
+ */
+void *UpdateWriter::run(void *arg) {
+   UpdateWriter *w = (UpdateWriter*)arg;
+   PendingUpdate **batch = new PendingUpdate*[w->batchSize];
+   while (true) {
+      pthread_mutex_lock(&w->lock);
+      while (w->depth == 0) {
+         pthread_cond_wait(&w->ready, &w->lock);
+      }
+      if (w->depth < w->batchSize && w->lingerMs > 0) {
+         struct timespec deadline;
+         clock_gettime(CLOCK_REALTIME, &deadline);
+         deadline.tv_nsec += w->lingerMs * 1000000L;
+         deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+         deadline.tv_nsec %= 1000000000L;
+         while (w->depth < w->batchSize) {
+            if (pthread_cond_timedwait(&w->ready, &w->lock, &deadline) == ETIMEDOUT) {
+               break;
+            }
+         }
+      }
+      uint32_t count = 0;
+      while (count < w->batchSize && w->head != NULL) {
+         batch[count++] = w->head;
+         w->head = w->head->next;
+      }
+      if (w->head == NULL) {
+         w->tail = NULL;
+      }
+      w->depth -= count;
+      pthread_mutex_unlock(&w->lock);
+
+      w->store(batch, count);
+   }
+   delete [] batch;
+   return NULL;
+}
+
+/**
+ * copyRows stores updates with a single COPY
+ * @param dbConn a checked out connection
+ * @param batch the updates to store
+ * @param ids the updateids reserved for them
+ * @param count the number of updates
+ * @return 1 if the updates were stored, 0 if the COPY rejected them, or -1 if it could not be run
+ */
+int UpdateWriter::copyRows(PGconn *dbConn, PendingUpdate **batch, uint64_t *ids, uint32_t count) {
+   string data;
+   char buf[64];
+   for (uint32_t i = 0; i < count; i++) {
+      PendingUpdate *u = batch[i];
+      snprintf(buf, sizeof(buf), "%" PRIu64 "\t", ids[i]);
+      data += buf;
+      copyEscape(data, u->user.c_str(), u->user.length());
+      snprintf(buf, sizeof(buf), "\t%d\t", u->pid);
+      data += buf;
+      copyEscape(data, u->cmd, strlen(u->cmd));
+      data += '\t';
+      copyEscape(data, u->json, u->jlen);
+      data += '\n';
+   }
+
+   int res = -1;
+   PGresult *rset = PQexec(dbConn, "COPY updates (updateid,username,pid,cmd,json) FROM STDIN;");
+   if (PQresultStatus(rset) != PGRES_COPY_IN) {
+      fprintf(stderr, "copy updates: %s\n", PQerrorMessage(dbConn));
+   }
+   else {
+      bool sent = PQputCopyData(dbConn, data.data(), data.length()) == 1;
+      if (PQputCopyEnd(dbConn, sent ? NULL : "update batch aborted") != 1) {
+         sent = false;
+      }
+      res = sent ? 1 : -1;
+      PGresult *end;
+      while ((end = PQgetResult(dbConn)) != NULL) {
+         if (PQresultStatus(end) != PGRES_COMMAND_OK) {
+            fprintf(stderr, "copy updates: %s\n", PQresultErrorMessage(end));
+            //the server refused the rows themselves unless the connection is gone
+            if (res == 1) {
+               res = PQstatus(dbConn) == CONNECTION_OK ? 0 : -1;
+            }
+         }
+         PQclear(end);
+      }
+   }
+   PQclear(rset);
+   return res;
+}
+
+/**
+ * copyBatch stores updates with as few COPYs as it can. When a COPY rejects
+ * its rows, say for text the database can't encode, each half is stored on
+ * its own, until only the rejected updates are left out.
+ * @param dbConn a checked out connection
+ * @param batch the updates to store
+ * @param ids the updateids reserved for them
+ * @param stored set for each update that was stored
+ * @param count the number of updates
+ * @return the number of updates stored
+ */
+uint32_t UpdateWriter::copyBatch(PGconn *dbConn, PendingUpdate **batch, uint64_t *ids, bool *stored, uint32_t count) {
+   int res = copyRows(dbConn, batch, ids, count);
+   if (res > 0) {
+      for (uint32_t i = 0; i < count; i++) {
+         stored[i] = true;
+      }
+      return count;
+   }
+   if (res < 0 || count == 1) {
+      return 0;
+   }
+   uint32_t half = count / 2;
+   return copyBatch(dbConn, batch, ids, stored, half) +
+          copyBatch(dbConn, batch + half, ids + half, stored + half, count - half);
+}
+
+/**
+ * store reserves updateids for a batch, stores the batch with COPY, and
+ * hands each stored update to the dispatcher in order. The originator of
+ * an update that could not be stored is sent an error instead of an ack.
+ * @param batch the updates to store, which are released by this function
+ * @param count the number of updates in batch
+ * @return true if the whole batch was stored
+ */
+bool UpdateWriter::store(PendingUpdate **batch, uint32_t count) {
+   static const int plens[1] = {4};
+   static const int pformats[1] = {1};
+
+   struct timeval start;
+   gettimeofday(&start, NULL);
+
+   uint64_t *ids = new uint64_t[count];
+   bool *stored = new bool[count];
+   memset(stored, 0, count * sizeof(bool));
+   uint32_t nstored = 0;
+   uint32_t n = htonl(count);
+   const char * const parms[1] = {(char*)&n};
+
+   PGconn *dbConn = pool->checkout();
+   PGresult *rset = PQexecPrepared(dbConn, "reserveUpdateIds",
+                       1, //int nParams,   size of arrays that follow
+                       parms, //parms,  //const char * const *paramValues, array of string values
+                       plens, //const int *paramLengths,
+                       pformats, //const int *paramFormats,
+                       1); //int resultFormat); 0 == text, 1 == binary
+   if (PQresultStatus(rset) != PGRES_TUPLES_OK || PQntuples(rset) != (int)count) {
+      fprintf(stderr, "reserveUpdateIds: %s\n", PQerrorMessage(dbConn));
+      PQclear(rset);
+   }
+   else {
+      for (uint32_t i = 0; i < count; i++) {
+         ids[i] = ntohll(*(uint64_t*)PQgetvalue(rset, i, 0));
+      }
+      PQclear(rset);
+      //nextval order across rows is not guaranteed, so hand them out sorted
+      sort(ids, ids + count);
+      nstored = copyBatch(dbConn, batch, ids, stored, count);
+   }
+   pool->checkin(dbConn);
+
+   struct timeval end;
+   gettimeofday(&end, NULL);
+   uint64_t storeUs = elapsedUs(start, end);
+   uint64_t waitUs = 0;
+   uint64_t maxUs = 0;
+   Packet **packets = nstored != 0 ? new Packet*[nstored] : NULL;
+   uint32_t npackets = 0;
+   for (uint32_t i = 0; i < count; i++) {
+      PendingUpdate *u = batch[i];
+      uint64_t us = elapsedUs(u->queued, end);
+      waitUs += us;
+      if (us > maxUs) {
+         maxUs = us;
+      }
+      if (stored[i]) {
+         //the packet takes over the update object, the ids of stored updates are still in order
+         packets[npackets++] = new Packet(u->c, u->pid, u->cmd, u->cmdId, u->obj, ids[i], u->json, u->jlen);
+      }
+      else {
+         u->c->send_error(string("unable to store ") + u->cmd + " update");
+         json_object_put(u->obj);
+         mgr->retire(u->pid);
+      }
+      u->c->release();
+      delete u;
+   }
+   delete [] ids;
+   delete [] stored;
+   if (npackets != 0) {
+      //archived first, so that anything a client sees live is also in the archive
+      if (archive != NULL) {
+         archive->append(packets, npackets);
+      }
+      for (uint32_t i = 0; i < npackets; i++) {
+         mgr->enqueue(packets[i]);
+      }
+      delete [] packets;
+   }
+
+   pthread_mutex_lock(&lock);
+   batches++;
+   rows += nstored;
+   failed += count - nstored;
+   if (count > maxBatch) {
+      maxBatch = count;
+   }
+   totalWaitUs += waitUs;
+   if (maxUs > maxWaitUs) {
+      maxWaitUs = maxUs;
+   }
+   totalStoreUs += storeUs;
+   if (storeUs > maxStoreUs) {
+      maxStoreUs = storeUs;
+   }
+   pthread_mutex_unlock(&lock);
+   return nstored == count;
+}
+
+/**
+ * stats reports batch sizes and latencies
+ * @return a printable summary
+ */
+string UpdateWriter::stats() {
+   char buf[512];
+   pthread_mutex_lock(&lock);
+   uint64_t n = rows + failed;
+   snprintf(buf, sizeof(buf),
+            "Update writer: %" PRIu64 " batches, %" PRIu64 " updates stored, %" PRIu64 " failed, %u queued\n"
+            "   batch size avg %" PRIu64 ", max %u\n"
+            "   submit to stored avg %" PRIu64 " us, max %" PRIu64 " us\n"
+            "   batch store avg %" PRIu64 " us, max %" PRIu64 " us\n",
+            batches, rows, failed, depth,
+            batches ? n / batches : 0, maxBatch,
+            n ? totalWaitUs / n : 0, maxWaitUs,
+            batches ? totalStoreUs / batches : 0, maxStoreUs);
+   pthread_mutex_unlock(&lock);
+   return buf;
+}
@@ -0,0 +1,127 @@
+/*
+   collabREate update_writer.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __UPDATE_WRITER_H
+#define __UPDATE_WRITER_H
+
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <json-c/json.h>
+
+#include "db_pool.h"
+
+using namespace std;
+
+class Client;
+class ConnectionManagerBase;
+class UpdateArchive;
+
+/**
+ * PendingUpdate is an update that has been received from a client but
+ * not yet stored in the database
+ */
+struct PendingUpdate {
+   Client *c;           //referenced until the update is stored
+   int pid;
+   string user;
+   const char *cmd;     //points into obj
+   uint16_t cmdId;      //id of cmd, see frameCommandId
+   json_object *obj;
+   const char *json;    //obj serialized without an updateid
+   uint32_t jlen;
+   struct timeval queued;
+   PendingUpdate *next;
+};
+
+/**
+ * UpdateWriter
+ * This class group commits updates. Client threads submit updates, and a
+ * single writer thread stores them in batches of up to DB_BATCH_SIZE,
+ * waiting at most DB_BATCH_LINGER_MS for a batch to fill. Each batch
+ * reserves its updateids from the updates sequence in one round trip and
+ * stores its rows with a single COPY. Because there is only one writer and
+ * ids are handed out in submission order, updates reach the dispatcher in
+ * updateid order. When there is an UpdateArchive, each stored batch is
+ * appended to it before any of its updates are dispatched. A row the COPY
+ * rejects only costs its own update, see copyBatch.
+ */
+
+class UpdateWriter {
+public:
+   /**
+    * @param mgr the manager whose dispatcher receives stored updates
+    * @param pool the pool that database connections are checked out from
+    * @param batchSize the largest number of updates stored at once
+    * @param lingerMs how long to wait for a batch to fill
+    * @param archive the archive stored updates are appended to, or NULL
+    */
+   UpdateWriter(ConnectionManagerBase *mgr, DbPool *pool, int batchSize, int lingerMs, UpdateArchive *archive = NULL);
+
+   /**
+    * start launches the writer thread
+    */
+   void start();
+
+   /**
+    * submit queues an update to be stored and then dispatched
+    * @param c the client that made the update
+    * @param cmd the command of the update
+    * @param cmdId the id of cmd
+    * @param obj the update, ownership passes to the writer
+    */
+   void submit(Client *c, const char *cmd, uint16_t cmdId, json_object *obj);
+
+   /**
+    * stats reports batch sizes and latencies
+    * @return a printable summary
+    */
+   string stats();
+
+private:
+   static void *run(void *arg);
+   bool store(PendingUpdate **batch, uint32_t count);
+   uint32_t copyBatch(PGconn *dbConn, PendingUpdate **batch, uint64_t *ids, bool *stored, uint32_t count);
+   int copyRows(PGconn *dbConn, PendingUpdate **batch, uint64_t *ids, uint32_t count);
+
+   ConnectionManagerBase *mgr;
+   DbPool *pool;
+   UpdateArchive *archive;
+   uint32_t batchSize;
+   int lingerMs;
+
+   pthread_mutex_t lock;   //guards the queue and the statistics
+   pthread_cond_t ready;
+   PendingUpdate *head;
+   PendingUpdate *tail;
+   uint32_t depth;
+
+   uint64_t batches;
+   uint64_t rows;
+   uint64_t failed;
+   uint32_t maxBatch;
+   uint64_t totalWaitUs;   //submit until the update was stored
+   uint64_t maxWaitUs;
+   uint64_t totalStoreUs;  //time spent storing each batch
+   uint64_t maxStoreUs;
+};
+
+#endif
@@ -0,0 +1,500 @@
+/*
+   collabREate uring.cpp
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+#include "uring.h"
+
+//requests queued by a thread inside holdSubmits are left for an explicit submit
+static __thread int holding;
+
+void Uring::holdSubmits() {
+   holding++;
+}
+
+void Uring::releaseSubmits() {
+   holding--;
+}
+
+#ifdef HAVE_IO_URING
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p) {
+   return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned int submit, unsigned int wait, unsigned int flags) {
+   return (int)syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned int op, void *arg, unsigned int nargs) {
+   return (int)syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+Uring::Uring(unsigned int entries) {
+   sqRing = cqRing = MAP_FAILED;
+   sqes = (io_uring_sqe*)MAP_FAILED;
+   bufRing = NULL;
+   bufs = NULL;
+   bufTail = 0;
+   enters = completions = 0;
+   pthread_mutex_init(&lock, NULL);
+
+   struct io_uring_params p;
+   memset(&p, 0, sizeof(p));
+   p.flags = IORING_SETUP_CQSIZE;
+   p.cq_entries = entries * 4;
+   fd = uring_setup(entries, &p);
+   if (fd == -1) {
+      return;
+   }
+   sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+   cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      if (cqRingSize > sqRingSize) {
+         sqRingSize = cqRingSize;
+      }
+      cqRingSize = 0;
+   }
+   sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+   if (cqRingSize == 0) {
+      cqRing = sqRing;
+   }
+   else {
+      cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+   }
+   sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+   sqes = (io_uring_sqe*)mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+   if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+      perror("io_uring mmap");
+      ::close(fd);
+      fd = -1;
+      return;
+   }
+   unsigned char *sq = (unsigned char*)sqRing;
+   sqHead = (unsigned int*)(sq + p.sq_off.head);
+   sqTail = (unsigned int*)(sq + p.sq_off.tail);
+   sqMask = *(unsigned int*)(sq + p.sq_off.ring_mask);
+   sqEntries = *(unsigned int*)(sq + p.sq_off.ring_entries);
+   sqArray = (unsigned int*)(sq + p.sq_off.array);
+   //every slot of the submission queue always names the sqe of the same index
+   for (unsigned int i = 0; i < sqEntries; i++) {
+      sqArray[i] = i;
+   }
+   unsigned char *cq = (unsigned char*)cqRing;
+   cqHead = (unsigned int*)(cq + p.cq_off.head);
+   cqTail = (unsigned int*)(cq + p.cq_off.tail);
+   cqMask = *(unsigned int*)(cq + p.cq_off.ring_mask);
+   cqes = cq + p.cq_off.cqes;
+}
+
+Uring::~Uring() {
+   if (fd != -1) {
+      ::close(fd);
+   }
+   if (sqRing != MAP_FAILED) {
+      munmap(sqRing, sqRingSize);
+   }
+   if (cqRing != MAP_FAILED && cqRing != sqRing) {
+      munmap(cqRing, cqRingSize);
+   }
+   if (sqes != MAP_FAILED) {
+      munmap(sqes, sqesSize);
+   }
+   if (bufRing != NULL) {
+      munmap(bufRing, URING_BUFFERS * sizeof(struct io_uring_buf));
+   }
+   delete [] bufs;
+   pthread_mutex_destroy(&lock);
+}
+
+bool Uring::supported() {
+   static int result = -1;
+   if (result == -1) {
+      Uring probe(8);
+      result = probe.isValid() && probe.provideBuffers();
+   }
+   return result == 1;
+}
+
+bool Uring::provideBuffers() {
+   size_t size = URING_BUFFERS * sizeof(struct io_uring_buf);
+   void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (mem == MAP_FAILED) {
+      return false;
+   }
+   struct io_uring_buf_reg reg;
+   memset(&reg, 0, sizeof(reg));
+   reg.ring_addr = (uint64_t)(uintptr_t)mem;
+   reg.ring_entries = URING_BUFFERS;
+   reg.bgid = URING_BUFFER_GROUP;
+   if (uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+      munmap(mem, size);
+      return false;
+   }
+   bufRing = (io_uring_buf_ring*)mem;
+   bufs = new unsigned char[URING_BUFFERS * URING_BUFFER_SIZE];
+   for (unsigned int i = 0; i < URING_BUFFERS; i++) {
+      recycle(i << IORING_CQE_BUFFER_SHIFT);
+   }
+   return true;
+}
+
+unsigned char *Uring::buffer(uint32_t flags) {
+   return bufs + (flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUFFER_SIZE;
+}
+
+void Uring::recycle(uint32_t flags) {
+   uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+   //not bufRing->bufs, which C++ places after the empty struct the header uses to declare it
+   struct io_uring_buf *b = (struct io_uring_buf*)bufRing + (bufTail & (URING_BUFFERS - 1));
+   b->addr = (uint64_t)(uintptr_t)(bufs + bid * URING_BUFFER_SIZE);
+   b->len = URING_BUFFER_SIZE;
+   b->bid = bid;
+   bufTail++;
+   __atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+}
+
+bool Uring::more(uint32_t flags) {
+   return (flags & IORING_CQE_F_MORE) != 0;
+}
+
+/**
+ * getSqe claims the next submission queue entry, submitting what is already
+ * queued if the queue is full. Must be called with lock held.
+ * @return a cleared entry, or NULL if the ring has failed
+ */
+io_uring_sqe *Uring::getSqe() {
+   unsigned int tail = *sqTail;
+   while (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+      __sync_add_and_fetch(&enters, 1);
+      if (uring_enter(fd, tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE), 0, 0) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+         perror("io_uring_enter");
+         return NULL;
+      }
+   }
+   io_uring_sqe *sqe = &sqes[tail & sqMask];
+   memset(sqe, 0, sizeof(*sqe));
+   return sqe;
+}
+
+/**
+ * queued publishes the entry claimed by getSqe. Must be called with lock held.
+ */
+void Uring::queued() {
+   __atomic_store_n(sqTail, *sqTail + 1, __ATOMIC_RELEASE);
+}
+
+bool Uring::recv(int sock, uint64_t user, bool multishot) {
+   pthread_mutex_lock(&lock);
+   io_uring_sqe *sqe = getSqe();
+   if (sqe != NULL) {
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = sock;
+      sqe->len = multishot ? 0 : URING_BUFFER_SIZE;
+      sqe->ioprio = multishot ? IORING_RECV_MULTISHOT : 0;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = URING_BUFFER_GROUP;
+      sqe->user_data = user;
+      queued();
+   }
+   pthread_mutex_unlock(&lock);
+   return sqe != NULL && (holding || submit(false));
+}
+
+bool Uring::sendmsg(int sock, const struct msghdr *mh, uint64_t user) {
+   pthread_mutex_lock(&lock);
+   io_uring_sqe *sqe = getSqe();
+   if (sqe != NULL) {
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = sock;
+      sqe->addr = (uint64_t)(uintptr_t)mh;
+      sqe->len = 1;
+      sqe->msg_flags = MSG_NOSIGNAL;
+      sqe->user_data = user;
+      queued();
+   }
+   pthread_mutex_unlock(&lock);
+   return sqe != NULL && (holding || submit(false));
+}
+
+bool Uring::poll(int sock, uint32_t events, uint64_t user, bool multishot) {
+   pthread_mutex_lock(&lock);
+   io_uring_sqe *sqe = getSqe();
+   if (sqe != NULL) {
+      sqe->opcode = IORING_OP_POLL_ADD;
+      sqe->fd = sock;
+      sqe->poll32_events = events;
+      sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+      sqe->user_data = user;
+      queued();
+   }
+   pthread_mutex_unlock(&lock);
+   return sqe != NULL && (holding || submit(false));
+}
+
+bool Uring::accept(int sock, uint64_t user) {
+   pthread_mutex_lock(&lock);
+   io_uring_sqe *sqe = getSqe();
+   if (sqe != NULL) {
+      sqe->opcode = IORING_OP_ACCEPT;
+      sqe->fd = sock;
+      sqe->accept_flags = SOCK_CLOEXEC;
+      sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+      sqe->user_data = user;
+      queued();
+   }
+   pthread_mutex_unlock(&lock);
+   return sqe != NULL && (holding || submit(false));
+}
+
+bool Uring::cancel(uint64_t target, uint64_t user) {
+   pthread_mutex_lock(&lock);
+   io_uring_sqe *sqe = getSqe();
+   if (sqe != NULL) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = target;
+      sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+      sqe->user_data = user;
+      queued();
+   }
+   pthread_mutex_unlock(&lock);
+   return sqe != NULL && (holding || submit(false));
+}
+
+bool Uring::timeout(uint32_t ms, uint64_t user) {
+   pthread_mutex_lock(&lock);
+   io_uring_sqe *sqe = getSqe();
+   if (sqe != NULL) {
+      timeoutSpec[0] = ms / 1000;
+      timeoutSpec[1] = (ms % 1000) * 1000000LL;
+      sqe->opcode = IORING_OP_TIMEOUT;
+      sqe->fd = -1;
+      sqe->addr = (uint64_t)(uintptr_t)timeoutSpec;
+      sqe->len = 1;
+      sqe->user_data = user;
+      queued();
+   }
+   pthread_mutex_unlock(&lock);
+   return sqe != NULL && (holding || submit(false));
+}
+
+bool Uring::submit(bool wait) {
+   //the kernel does not wait if it submits fewer entries than it was asked to
+   unsigned int pending = __atomic_load_n(sqTail, __ATOMIC_ACQUIRE) - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+   if (!wait && pending == 0) {
+      return true;
+   }
+   __sync_add_and_fetch(&enters, 1);
+   if (uring_enter(fd, pending, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0) < 0) {
+      //a full completion queue clears as soon as the owner reaps it
+      if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+         perror("io_uring_enter");
+         return false;
+      }
+   }
+   return true;
+}
+
+unsigned int Uring::reap(UringCompletion *out, unsigned int max) {
+   unsigned int head = *cqHead;
+   unsigned int tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+   unsigned int n = 0;
+   while (head != tail && n < max) {
+      struct io_uring_cqe *cqe = &((struct io_uring_cqe*)cqes)[head & cqMask];
+      out[n].user = cqe->user_data;
+      out[n].res = cqe->res;
+      out[n].flags = cqe->flags;
+      head++;
+      n++;
+   }
+   __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+   completions += n;
+   return n;
+}
+
+#else
+
+Uring::Uring(unsigned int entries) {
+   fd = -1;
+   bufRing = NULL;
+   bufs = NULL;
+   enters = completions = 0;
+   pthread_mutex_init(&lock, NULL);
+}
+
+Uring::~Uring() {
+   pthread_mutex_destroy(&lock);
+}
+
+bool Uring::supported() {
+   return false;
+}
+
+bool Uring::provideBuffers() {
+   return false;
+}
+
+unsigned char *Uring::buffer(uint32_t flags) {
+   return NULL;
+}
+
+void Uring::recycle(uint32_t flags) {
+}
+
+bool Uring::more(uint32_t flags) {
+   return false;
+}
+
+bool Uring::recv(int sock, uint64_t user, bool multishot) {
+   return false;
+}
+
+bool Uring::sendmsg(int sock, const struct msghdr *mh, uint64_t user) {
+   return false;
+}
+
+bool Uring::poll(int sock, uint32_t events, uint64_t user, bool multishot) {
+   return false;
+}
+
+bool Uring::accept(int sock, uint64_t user) {
+   return false;
+}
+
+bool Uring::cancel(uint64_t target, uint64_t user) {
+   return false;
+}
+
+bool Uring::timeout(uint32_t ms, uint64_t user) {
+   return false;
+}
+
+bool Uring::submit(bool wait) {
+   return false;
+}
+
+unsigned int Uring::reap(UringCompletion *out, unsigned int max) {
+   return 0;
+}
+
+#endif
+
+UringService::UringService(int port, int backlog, bool reusePort) : Tcp6Service(port, backlog, reusePort) {
+   ring = NULL;
+   fallback = false;
+}
+
+UringService::UringService(const char *host, int port, int backlog, bool reusePort) : Tcp6Service(host, port, backlog, reusePort) {
+   ring = NULL;
+   fallback = false;
+}
+
+UringService::~UringService() {
+   delete ring;
+   for (deque<int>::iterator i = accepted.begin(); i != accepted.end(); i++) {
+      ::close(*i);
+   }
+}
+
+/**
+ * arm queues a multishot accept on one of the listening sockets
+ * @param listener the index of the socket in fds
+ */
+bool UringService::arm(unsigned int listener) {
+   return ring->accept(fds[listener], listener);
+}
+
+/**
+ * drain moves every connection waiting in the completion queue into accepted,
+ * re-arming listeners whose multishot accept has ended. Once fallback is set
+ * nothing is re-armed, but the rest of the queue is still drained so that no
+ * accepted socket is lost with the ring.
+ */
+void UringService::drain() {
+   UringCompletion done[16];
+   unsigned int n;
+   do {
+      n = ring->reap(done, 16);
+      for (unsigned int i = 0; i < n; i++) {
+         if (done[i].res >= 0) {
+            accepted.push_back(done[i].res);
+         }
+         else if (done[i].res == -EINVAL) {
+            //no multishot accept in this kernel
+            fallback = true;
+         }
+         else {
+            fprintf(stderr, "accept failed: %s\n", strerror(-done[i].res));
+         }
+         if (!fallback && !Uring::more(done[i].flags) && !arm((unsigned int)done[i].user)) {
+            fallback = true;
+         }
+      }
+   } while (n == 16);
+}
+
+NetworkIO *UringService::accept() {
+   if (ring == NULL && !fallback) {
+      ring = new Uring(64);
+      fallback = !ring->isValid();
+      for (unsigned int i = 0; !fallback && i < fds.size(); i++) {
+         fallback = !arm(i);
+      }
+   }
+   while (accepted.empty() && !fallback) {
+      if (!ring->submit(true)) {
+         fallback = true;
+         break;
+      }
+      drain();
+   }
+   if (accepted.empty() && ring != NULL && ring->isValid()) {
+      //connections the multishot accepts took after the failure are still in the completion queue
+      drain();
+   }
+   if (accepted.empty()) {
+      if (ring != NULL) {
+         fprintf(stderr, "io_uring accept is not available, using accept\n");
+         //closing the ring cancels anything still queued on it
+         delete ring;
+         ring = NULL;
+      }
+      return Tcp6Service::accept();
+   }
+   int client = accepted.front();
+   accepted.pop_front();
+   struct sockaddr_in6 peer;
+   socklen_t peer_len = sizeof(peer);
+   memset(&peer, 0, sizeof(peer));
+   getpeername(client, (struct sockaddr*)&peer, &peer_len);
+   return new Tcp6IO(client, peer);
+}
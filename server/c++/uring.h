@@ -0,0 +1,231 @@
+/*
+   collabREate uring.h
+   Copyright (C) 2018 Chris Eagle <cseagle at gmail d0t com>
+   Copyright (C) 2018 Tim Vidas <tvidas at gmail d0t com>
+
+   This program is free software; you can redistribute it and/or modify it
+   under the terms of the GNU General Public License as published by the Free
+   Software Foundation; either version 2 of the License, or (at your option)
+   any later version.
+
+   This program is distributed in the hope that it will be useful, but WITHOUT
+   ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+   FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+   more details.
+
+   You should have received a copy of the GNU General Public License along with
+   this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+   Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef __COLLAB_URING_H
+#define __COLLAB_URING_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <deque>
+
+#include "utils.h"
+
+using namespace std;
+
+struct io_uring_sqe;
+struct io_uring_buf_ring;
+struct msghdr;
+
+#define URING_ENTRIES       1024   //submission queue entries per ring, the completion queue is 4 times larger
+#define URING_BUFFERS       256    //receive buffers provided to each ring, a power of 2
+#define URING_BUFFER_SIZE   4096
+#define URING_BUFFER_GROUP  0
+
+/**
+ * UringCompletion is a copy of a single completion queue entry
+ */
+struct UringCompletion {
+   uint64_t user;
+   int32_t res;
+   uint32_t flags;
+};
+
+/**
+ * Uring
+ * A minimal io_uring instance driven directly through the io_uring system
+ * calls. Any thread may queue requests, but only the thread that owns the
+ * ring reaps its completions and recycles its receive buffers. Requests are
+ * submitted as soon as they are queued unless the queueing thread has called
+ * holdSubmits, in which case they wait for the next call to submit so that a
+ * batch of them costs a single system call. Only available when built with
+ * HAVE_IO_URING.
+ */
+class Uring {
+public:
+   /**
+    * @param entries the size of the submission queue
+    */
+   Uring(unsigned int entries);
+   ~Uring();
+
+   /**
+    * isValid inspector to see whether the ring was set up
+    * @return false if the kernel refused to create the ring
+    */
+   bool isValid() {
+      return fd != -1;
+   }
+
+   /**
+    * supported checks once whether this kernel provides everything the uring
+    * I/O model uses
+    * @return true if rings with provided buffer rings can be created
+    */
+   static bool supported();
+
+   /**
+    * provideBuffers registers a ring of receive buffers, which recv requests
+    * pick from as data arrives rather than each reserving a buffer up front
+    * @return false if the kernel does not support provided buffer rings
+    */
+   bool provideBuffers();
+
+   /**
+    * buffer gets a provided buffer named by a completion
+    * @param flags the flags of a completion that consumed a buffer
+    * @return the buffer
+    */
+   unsigned char *buffer(uint32_t flags);
+
+   /**
+    * recycle hands a buffer named by a completion back to the kernel.
+    * Only the thread that owns the ring may call this.
+    * @param flags the flags of a completion that consumed a buffer
+    */
+   void recycle(uint32_t flags);
+
+   /**
+    * recv queues a receive into the provided buffers. Without multishot a
+    * single completion is posted, otherwise completions are posted as data
+    * arrives until one without more() set ends the request.
+    */
+   bool recv(int sock, uint64_t user, bool multishot);
+
+   /**
+    * sendmsg queues a send, mh and everything it points to must remain valid
+    * until the request completes
+    */
+   bool sendmsg(int sock, const struct msghdr *mh, uint64_t user);
+
+   /**
+    * poll queues a poll for the POLL* events of interest
+    */
+   bool poll(int sock, uint32_t events, uint64_t user, bool multishot);
+
+   /**
+    * accept queues a multishot accept, one completion is posted for each new
+    * connection holding its descriptor
+    */
+   bool accept(int sock, uint64_t user);
+
+   /**
+    * cancel queues the cancellation of every request queued with target
+    */
+   bool cancel(uint64_t target, uint64_t user);
+
+   /**
+    * timeout queues a timeout that completes once ms milliseconds have passed.
+    * Only the thread that owns the ring may call this, at most once between
+    * submits, as the kernel reads the interval when the request is submitted.
+    */
+   bool timeout(uint32_t ms, uint64_t user);
+
+   /**
+    * submit hands every queued request to the kernel
+    * @param wait true to block until at least one completion is available
+    * @return false if the ring has failed
+    */
+   bool submit(bool wait);
+
+   /**
+    * reap copies completions out of the completion queue.
+    * Only the thread that owns the ring may call this.
+    * @param out receives the completions
+    * @param max the size of out
+    * @return the number of completions copied
+    */
+   unsigned int reap(UringCompletion *out, unsigned int max);
+
+   /**
+    * more checks whether a request will post further completions
+    * @param flags the flags of a completion
+    */
+   static bool more(uint32_t flags);
+
+   /**
+    * holdSubmits keeps requests queued by the calling thread from being submitted
+    * until releaseSubmits, the caller must then submit every ring it may have used
+    */
+   static void holdSubmits();
+   static void releaseSubmits();
+
+   uint64_t submitCalls() {
+      return enters;
+   }
+
+   uint64_t completionCount() {
+      return completions;
+   }
+
+private:
+   io_uring_sqe *getSqe();
+   void queued();
+
+   int fd;
+   pthread_mutex_t lock;   //guards the submission queue
+   void *sqRing;
+   size_t sqRingSize;
+   void *cqRing;
+   size_t cqRingSize;
+   io_uring_sqe *sqes;
+   size_t sqesSize;
+   unsigned int *sqHead;
+   unsigned int *sqTail;
+   unsigned int sqMask;
+   unsigned int sqEntries;
+   unsigned int *sqArray;
+   unsigned int *cqHead;
+   unsigned int *cqTail;
+   unsigned int cqMask;
+   void *cqes;
+
+   io_uring_buf_ring *bufRing;
+   unsigned char *bufs;
+   uint16_t bufTail;
+
+   int64_t timeoutSpec[2];   //the __kernel_timespec of the last queued timeout
+
+   volatile uint64_t enters;
+   uint64_t completions;
+};
+
+/**
+ * UringService
+ * A Tcp6Service that waits for connections with a multishot accept on an
+ * io_uring rather than blocking in accept or select. If no ring can be set
+ * up it behaves exactly like a Tcp6Service.
+ */
+class UringService : public Tcp6Service {
+public:
+   UringService(int port, int backlog = DEFAULT_LISTEN_BACKLOG, bool reusePort = false);
+   UringService(const char *host, int port, int backlog = DEFAULT_LISTEN_BACKLOG, bool reusePort = false);
+   virtual ~UringService();
+   NetworkIO *accept();
+
+private:
+   bool arm(unsigned int listener);
+   void drain();
+
+   Uring *ring;             //NULL until the first accept
+   bool fallback;           //the ring could not be used, accept as a Tcp6Service does
+   deque<int> accepted;     //connections reaped but not yet returned
+};
+
+#endif
@@ -27,17 +27,25 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <linux/sock_diag.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <err.h>
+#include <errno.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <string>
 #include <openssl/md5.h>
 #include <json-c/json.h>
 
 #include "utils.h"
+#include "frame.h"
+#include "uring.h"
 
 #define ERROR_CREATE_SOCK "Unable to create socket"
 #define ERROR_REUSE_SOCK "Unable to set reuse"
@@ -69,6 +77,21 @@ const char *permStrings[] = {
 
 int permStringsLength = sizeof(permStrings) / sizeof(char*) - 1;
 
+/*
+ * Strings common to most updates, with the most common last as zlib favors
+ * the end of a dictionary. Clients that ask for COMPRESS_ZLIB_DICT must use
+ * exactly these bytes.
+ */
+const char zlibDictionary[] =
+   "\"type\":\"struc_mbr_chg_data\"\"type\":\"create_struc_mbr_data\"\"struc_name\":\""
+   "\"type\":\"enum_const_created\"\"enum_name\":\"\"type\":\"op_type_changed\"\"opnum\":"
+   "\"type\":\"add_cref\"\"type\":\"add_dref\"\"from\":\"to\":\"reftype\":"
+   "\"type\":\"add_func\"\"startea\":\"endea\":\"type\":\"ti_changed\"\"ti\":\"fnames\":"
+   "\"type\":\"cmt_changed\"\"comment\":\"\"rep\":\"type\":\"make_data\"\"flags\":\"length\":"
+   "\"type\":\"ack_updateid\"\"type\":\"renamed\"\"name\":\"\"type\":\"make_code\""
+   "{\"addr\":,\"user\":\"\",\"updateid\":";
+const uint32_t zlibDictionaryLength = sizeof(zlibDictionary) - 1;
+
 union uLongLong {
    uint64_t ll;
    uint32_t ii[2];
@@ -209,13 +232,46 @@ json_object *IOBase::readJson() {
 bool IOBase::writeJson(json_object *obj) {
    size_t jlen;
    const char *json = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &jlen);
-   *this << json << "\n";
+   //the message and its newline go out in a single write
+   string line(json, jlen);
+   line += '\n';
+   int res = sendAll(line.data(), line.length());
    json_object_put(obj);   //release the object
-   return true;
+   return res == (int)line.length();
 }
 
 FileIO::FileIO() {
    state = curr = max = 0;
+   fd = -1;
+   tok = NULL;
+   msgBytes = 0;
+   discarding = false;
+   lineOpen = false;
+   maxMessage = 0;
+   maxDepth = JSON_TOKENER_DEFAULT_DEPTH;
+   framed = false;
+   frameLen = 0;
+   skip = 0;
+   zin = NULL;
+   zpending = false;
+   zskipLine = false;
+   wireIn = dataIn = 0;
+   fed = NULL;
+   fedLen = 0;
+}
+
+void FileIO::setLimits(uint32_t maxMessage, int maxDepth) {
+   this->maxMessage = maxMessage;
+   this->maxDepth = maxDepth;
+   if (tok != NULL) {
+      json_tokener_free(tok);
+      tok = NULL;
+   }
+}
+
+void FileIO::setFramed() {
+   framed = true;
+   discarding = lineOpen;
 }
 
 IOBase &FileIO::operator<<(const string &s) {
@@ -242,19 +298,97 @@ int FileIO::fillbuf() {
    FD_ZERO(&rds);
    FD_SET(fd, &rds);
 */
-   curr = max = 0;
-   max = ::read(fd, buf, sizeof(buf));
-   if (max < 0) {
+   int nbytes = receive(true);
+   if (nbytes < 0) {
       state |= _FILE_STATE_ERROR;
       return EOF;
    }
-   else if (max == 0) {
+   else if (nbytes == 0) {
       state |= _FILE_STATE_EOF;
       return EOF;
    }
    return max;
 }
 
+int FileIO::receive(bool wait) {
+   curr = max = 0;
+   while (true) {
+      if (inflatePending()) {
+         zin->next_out = buf;
+         zin->avail_out = sizeof(buf);
+         int res = inflate(zin, Z_SYNC_FLUSH);
+         if (res == Z_NEED_DICT &&
+             inflateSetDictionary(zin, (const Bytef*)zlibDictionary, zlibDictionaryLength) == Z_OK) {
+            continue;
+         }
+         if (res != Z_OK && res != Z_BUF_ERROR) {
+            fprintf(stderr, "inflate failed: %s\n", zin->msg ? zin->msg : "stream end");
+            return -1;
+         }
+         max = sizeof(buf) - zin->avail_out;
+         zpending = zin->avail_out == 0;
+         dataIn += max;
+         if (max > 0) {
+            return max;
+         }
+      }
+      unsigned char *dest = zin ? zraw : buf;
+      int nbytes;
+      if (fed != NULL) {
+         if (fedLen == 0) {
+            return -2;
+         }
+         nbytes = fedLen < sizeof(buf) ? fedLen : sizeof(buf);
+         memcpy(dest, fed, nbytes);
+         fed += nbytes;
+         fedLen -= nbytes;
+      }
+      else {
+         nbytes = wait ? ::read(fd, dest, sizeof(buf)) : recv(fd, dest, sizeof(buf), MSG_DONTWAIT);
+      }
+      if (nbytes < 0) {
+         if (!wait && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return -2;
+         }
+         return -1;
+      }
+      if (nbytes == 0) {
+         return 0;
+      }
+      wireIn += nbytes;
+      if (zin == NULL) {
+         dataIn += nbytes;
+         max = nbytes;
+         return max;
+      }
+      zin->next_in = zraw;
+      zin->avail_in = nbytes;
+      if (zskipLine) {
+         unsigned char *nl = (unsigned char*)memchr(zraw, '\n', nbytes);
+         zskipLine = nl == NULL;
+         zin->avail_in = nl ? nbytes - (nl + 1 - zraw) : 0;
+         zin->next_in = nl ? nl + 1 : zraw;
+      }
+   }
+}
+
+void FileIO::startInflate() {
+   zin = new z_stream;
+   memset(zin, 0, sizeof(z_stream));
+   inflateInit(zin);
+   //input that follows the last json message was compressed by the peer
+   zskipLine = lineOpen;
+   lineOpen = false;
+   while (zskipLine && curr < max) {
+      zskipLine = buf[curr++] != '\n';
+   }
+   zin->avail_in = max - curr;
+   memcpy(zraw, buf + curr, zin->avail_in);
+   zin->next_in = zraw;
+   dataIn -= zin->avail_in;   //counted when it is inflated
+   curr = max = 0;
+}
+
 int FileIO::read() {
    if (curr < max) {
 /*
@@ -280,12 +414,12 @@ uint32_t FileIO::get_avail(void *ubuf, uint32_t size) {
    if (curr < max) {
       uint32_t avail = max - curr;
       if (avail >= size) {
-         memcpy(ubuf, buf, size);
+         memcpy(ubuf, buf + curr, size);
          curr += size;
          result = size;
       }
       else {
-         memcpy(ubuf, buf, avail);
+         memcpy(ubuf, buf + curr, avail);
          curr += avail;
          result = avail;
       }
@@ -379,12 +513,198 @@ int FileIO::read_until_delim(char *ubuf, unsigned int size, char endchar) {
 }
 
 bool FileIO::readLine(string &s) {
-   int ch;
-   while ((ch = read()) >= 0) {
-      if (ch == '\n') {
+   while (curr < max || fillbuf() > 0) {
+      char *start = (char*)buf + curr;
+      char *nl = (char*)memchr(start, '\n', max - curr);
+      if (nl != NULL) {
+         s.append(start, nl - start);
+         curr += nl - start + 1;
          return true;
       }
-      s += (char)ch;
+      s.append(start, max - curr);
+      curr = max;
+   }
+   return false;
+}
+
+json_object *FileIO::readJson() {
+   json_object *obj;
+   while (!nextJson(&obj)) {
+      if (fillbuf() <= 0) {
+         return NULL;
+      }
+   }
+   return obj;
+}
+
+static bool isJsonSpace(unsigned char ch) {
+   return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+}
+
+bool FileIO::nextJson(json_object **obj) {
+   if (framed) {
+      return nextFrame(obj);
+   }
+   while (curr < max) {
+      if (discarding) {
+         char *nl = (char*)memchr(buf + curr, '\n', max - curr);
+         if (nl == NULL) {
+            curr = max;
+            break;
+         }
+         curr = nl - (char*)buf + 1;
+         discarding = false;
+      }
+      if (msgBytes == 0) {
+         //whitespace between messages, including the newline that ends each one
+         while (curr < max && isJsonSpace(buf[curr])) {
+            if (buf[curr++] == '\n') {
+               lineOpen = false;
+            }
+         }
+         if (curr >= max) {
+            break;
+         }
+      }
+      char *start = (char*)buf + curr;
+      char *nl = (char*)memchr(start, '\n', max - curr);
+      uint32_t len = nl ? nl - start : max - curr;
+      if (len == 0) {
+         //the line ended in the middle of a message
+         curr++;
+         reject("incomplete message");
+         continue;
+      }
+      if (tok == NULL) {
+         tok = json_tokener_new_ex(maxDepth);
+      }
+      json_object *res = json_tokener_parse_ex(tok, start, len);
+      enum json_tokener_error jerr = json_tokener_get_error(tok);
+      if (res != NULL || jerr == json_tokener_continue) {
+         //the tokener stops as soon as the message is complete
+         uint32_t used = res ? tok->char_offset : len;
+         curr += used;
+         msgBytes += used;
+         if (maxMessage != 0 && msgBytes > maxMessage) {
+            json_object_put(res);
+            reject("message too large");
+            discarding = true;
+         }
+         else if (res != NULL) {
+            json_tokener_reset(tok);
+            msgBytes = 0;
+            lineOpen = true;
+            *obj = res;
+            return true;
+         }
+      }
+      else {
+         curr += tok->char_offset;
+         reject(json_tokener_error_desc(jerr));
+         discarding = true;
+      }
+   }
+   return false;
+}
+
+/**
+ * reject drops the message currently being parsed
+ * @param why the reason for dropping it
+ */
+void FileIO::reject(const char *why) {
+   fprintf(stderr, "discarding received message: %s\n", why);
+   if (tok != NULL) {
+      json_tokener_reset(tok);
+   }
+   msgBytes = 0;
+}
+
+/**
+ * frameLength reads the length field at the start of a frame
+ * @param p the start of the frame
+ * @return the length of the whole frame, including the length field
+ */
+static uint64_t frameLength(const unsigned char *p) {
+   return FRAME_LENGTH_SIZE + (((uint64_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+}
+
+/**
+ * nextFrame is nextJson for a framed connection. A frame is decoded straight
+ * out of buf when all of it has arrived in one read, otherwise it is gathered
+ * in partial.
+ */
+bool FileIO::nextFrame(json_object **obj) {
+   while (curr < max) {
+      uint32_t avail = max - curr;
+      if (discarding) {
+         char *nl = (char*)memchr(buf + curr, '\n', avail);
+         if (nl == NULL) {
+            curr = max;
+            break;
+         }
+         curr = nl - (char*)buf + 1;
+         discarding = false;
+         continue;
+      }
+      if (skip != 0) {
+         uint32_t n = avail < skip ? avail : skip;
+         curr += n;
+         skip -= n;
+         continue;
+      }
+      if (frameLen == 0) {
+         if (partial.empty() && avail >= FRAME_LENGTH_SIZE) {
+            frameLen = frameLength(buf + curr);
+         }
+         else {
+            uint32_t n = FRAME_LENGTH_SIZE - partial.length();
+            n = avail < n ? avail : n;
+            partial.append((char*)buf + curr, n);
+            curr += n;
+            if (partial.length() < FRAME_LENGTH_SIZE) {
+               break;
+            }
+            frameLen = frameLength((const unsigned char*)partial.data());
+         }
+         if (frameLen < FRAME_HEADER_SIZE) {
+            //there is no way to find the start of the next frame
+            fprintf(stderr, "invalid frame length %u\n", (uint32_t)frameLen);
+            state |= _FILE_STATE_ERROR;
+            *obj = NULL;
+            return true;
+         }
+         if (maxMessage != 0 && frameLen > maxMessage) {
+            reject("message too large");
+            skip = frameLen - partial.length();
+            partial.clear();
+            frameLen = 0;
+            continue;
+         }
+         avail = max - curr;
+      }
+      json_object *res;
+      if (partial.empty() && avail >= frameLen) {
+         res = decodeFrame(buf + curr, frameLen, maxDepth);
+         curr += frameLen;
+      }
+      else {
+         uint32_t n = frameLen - partial.length();
+         n = avail < n ? avail : n;
+         partial.append((char*)buf + curr, n);
+         curr += n;
+         if (partial.length() < frameLen) {
+            break;
+         }
+         res = decodeFrame((const unsigned char*)partial.data(), frameLen, maxDepth);
+         partial.clear();
+      }
+      frameLen = 0;
+      if (res == NULL) {
+         reject("malformed frame");
+         continue;
+      }
+      *obj = res;
+      return true;
    }
    return false;
 }
@@ -401,7 +721,8 @@ string FileIO::readLine() {
    return res;
 }
 
-NetworkIO::NetworkIO(const char *host, int port) {
+NetworkIO::NetworkIO(const char *host, int port) : outOffset(0), outBytes(0), zout(NULL), wireOut(0), dataOut(0), cork(false), fileSends(0), fileBytes(0),
+                                                    sendCalls(0), sentMessages(0), ring(NULL), ringUser(0), sending(false), sendIov(NULL), sendHdr(NULL) {
    struct addrinfo hints;
    addrinfo *addr, *ap;
    char str_port[16];
@@ -513,6 +834,413 @@ string NetworkIO::getPeerAddr() {
    return "???";
 }
 
+bool NetworkIO::readJsonAvailable(vector<json_object*> &objs) {
+   //a single read may inflate to more than fits in buf, all of it must be
+   //parsed now as there won't be another notification for it
+   do {
+      if (curr >= max) {
+         int nbytes = receive(false);
+         if (nbytes == -2) {
+            return true;
+         }
+         else if (nbytes < 0) {
+            state |= _FILE_STATE_ERROR;
+            return false;
+         }
+         else if (nbytes == 0) {
+            state |= _FILE_STATE_EOF;
+            return false;
+         }
+      }
+      json_object *obj;
+      while (nextJson(&obj)) {
+         if (obj == NULL) {
+            return false;
+         }
+         objs.push_back(obj);
+      }
+   } while (inflatePending() || fedLen > 0);
+   return true;
+}
+
+bool NetworkIO::readJsonFrom(const void *data, uint32_t len, vector<json_object*> &objs) {
+   fed = (const unsigned char*)data;
+   fedLen = len;
+   bool res = readJsonAvailable(objs);
+   fed = NULL;
+   fedLen = 0;
+   return res;
+}
+
+EncodedPacket::EncodedPacket(const char *json, uint32_t len) {
+   this->len = len + 1;
+   buf = new char[this->len];
+   memcpy(buf, json, len);
+   buf[len] = '\n';
+   refs = 1;
+   file = -1;
+}
+
+EncodedPacket::EncodedPacket(const char *json, uint32_t len, uint64_t updateid) {
+   char tail[48];
+   if (len >= 2 && json[len - 1] == '}') {
+      //replace the closing brace, no comma is needed if the object is empty
+      len--;
+      snprintf(tail, sizeof(tail), "%s\"updateid\":%" PRIu64 "}\n", json[len - 1] == '{' ? "" : ",", updateid);
+   }
+   else {
+      tail[0] = '\n';
+      tail[1] = 0;
+   }
+   uint32_t tlen = strlen(tail);
+   this->len = len + tlen;
+   buf = new char[this->len];
+   memcpy(buf, json, len);
+   memcpy(buf + len, tail, tlen);
+   refs = 1;
+   file = -1;
+}
+
+EncodedPacket::EncodedPacket(const string &frame) {
+   len = frame.length();
+   buf = new char[len];
+   memcpy(buf, frame.data(), len);
+   refs = 1;
+   file = -1;
+}
+
+EncodedPacket::EncodedPacket(int fd, off_t offset, uint32_t len) {
+   buf = NULL;
+   this->len = len;
+   refs = 1;
+   file = fd;
+   this->offset = offset;
+}
+
+EncodedPacket::~EncodedPacket() {
+   delete [] buf;
+   if (file != -1) {
+      ::close(file);
+   }
+}
+
+EncodedPacket *EncodedPacket::load() {
+   string bytes(len, 0);
+   uint32_t total = 0;
+   while (total < len) {
+      ssize_t nbytes = pread(file, &bytes[total], len - total, offset + total);
+      if (nbytes <= 0) {
+         if (nbytes < 0 && errno == EINTR) {
+            continue;
+         }
+         return NULL;
+      }
+      total += nbytes;
+   }
+   return new EncodedPacket(bytes);
+}
+
+EncodedPacket *EncodedPacket::fromJson(json_object *obj) {
+   size_t jlen;
+   const char *json = json_object_to_json_string_length(obj, JSON_C_TO_STRING_PLAIN, &jlen);
+   return new EncodedPacket(json, jlen);
+}
+
+EncodedPacket *EncodedPacket::fromFrame(json_object *obj, uint64_t updateid) {
+   string frame;
+   encodeFrame(obj, updateid, frame);
+   return new EncodedPacket(frame);
+}
+
+static string ackJson;    //an ack_updateid without its updateid
+static string ackFrame;   //a framed ack_updateid, its updateid is overwritten
+static pthread_once_t ackOnce = PTHREAD_ONCE_INIT;
+
+static void makeAckTemplates() {
+   json_object *obj = json_object_new_object();
+   json_object_object_add_ex(obj, "type", json_object_new_string(MSG_ACK_UPDATEID), JSON_NEW_CONST_KEY);
+   ackJson = json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN);
+   //any non-zero id, so that the header flags an updateid
+   encodeFrame(obj, 1, ackFrame);
+   json_object_put(obj);
+}
+
+EncodedPacket *EncodedPacket::ack(uint64_t updateid, bool framed) {
+   pthread_once(&ackOnce, makeAckTemplates);
+   if (!framed) {
+      return new EncodedPacket(ackJson.data(), ackJson.length(), updateid);
+   }
+   EncodedPacket *p = new EncodedPacket(ackFrame);
+   for (int i = 0; i < 8; i++) {
+      p->buf[FRAME_UPDATEID_AT + i] = (char)(updateid >> (56 - 8 * i));
+   }
+   return p;
+}
+
+NetworkIO::~NetworkIO() {
+   for (deque<EncodedPacket*>::iterator i = outq.begin(); i != outq.end(); i++) {
+      (*i)->release();
+   }
+   if (zout != NULL) {
+      deflateEnd(zout);
+      delete zout;
+   }
+   delete [] sendIov;
+   delete sendHdr;
+}
+
+void NetworkIO::startCompression(int level, bool dictionary) {
+   zout = new z_stream;
+   memset(zout, 0, sizeof(z_stream));
+   deflateInit(zout, level);
+   if (dictionary) {
+      deflateSetDictionary(zout, (const Bytef*)zlibDictionary, zlibDictionaryLength);
+   }
+   startInflate();
+}
+
+void NetworkIO::queueSend(EncodedPacket *msg) {
+   if (msg->isFile()) {
+      if (fileSends == 0) {
+         //sendfile can only be kept from blocking if the free send buffer space is known
+         uint32_t meminfo[SK_MEMINFO_VARS];
+         socklen_t mlen = sizeof(meminfo);
+         fileSends = getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &mlen) == 0 ? 1 : -1;
+      }
+      if (zout != NULL || fileSends < 0) {
+         EncodedPacket *copy = msg->load();
+         msg->release();
+         if (copy == NULL) {
+            state |= _FILE_STATE_ERROR;
+            return;
+         }
+         msg = copy;
+      }
+   }
+   dataOut += msg->length();
+   if (zout != NULL) {
+      //the shared encoding is deflated into a copy private to this connection
+      string out;
+      zout->next_in = (Bytef*)msg->data();
+      zout->avail_in = msg->length();
+      uint32_t chunk = msg->length() + 64;
+      do {
+         size_t have = out.length();
+         out.resize(have + chunk);
+         zout->next_out = (Bytef*)&out[have];
+         zout->avail_out = chunk;
+         deflate(zout, Z_SYNC_FLUSH);
+         out.resize(have + chunk - zout->avail_out);
+      } while (zout->avail_out == 0);
+      msg->release();
+      msg = new EncodedPacket(out);
+   }
+   wireOut += msg->length();
+   outq.push_back(msg);
+   outBytes += msg->length();
+}
+
+void NetworkIO::setTcpOptions(bool nodelay, bool cork) {
+   int on = nodelay;
+   setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+   this->cork = cork;
+}
+
+void NetworkIO::setKeepAlive(int idle, int interval, int count) {
+   if (idle <= 0) {
+      return;
+   }
+   int on = 1;
+   unsigned int timeout = (unsigned int)(interval * count) * 1000;
+   if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) == -1 ||
+       setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) == -1 ||
+       setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) == -1 ||
+       setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count)) == -1 ||
+       setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout)) == -1) {
+      perror("setsockopt keepalive");
+   }
+}
+
+void NetworkIO::sendVia(Uring *ring, uint64_t user) {
+   this->ring = ring;
+   ringUser = user;
+   sendIov = new struct iovec[FLUSH_IOVECS];
+   sendHdr = new struct msghdr;
+}
+
+bool NetworkIO::sendComplete(int res) {
+   sending = false;
+   if (res < 0 && res != -EINTR && res != -EAGAIN) {
+      state |= _FILE_STATE_ERROR;
+      return false;
+   }
+   if (res > 0) {
+      outBytes -= res;
+      retire(res);
+   }
+   return true;
+}
+
+/**
+ * retire drops every message that has been completely written
+ * @param nbytes the bytes just written from the head of the queue
+ */
+void NetworkIO::retire(size_t nbytes) {
+   size_t done = outOffset + nbytes;
+   while (!outq.empty() && done >= outq.front()->length()) {
+      done -= outq.front()->length();
+      outq.front()->release();
+      outq.pop_front();
+      sentMessages++;
+   }
+   outOffset = done;
+}
+
+/**
+ * sendFile writes as much of a file packet at the head of the queue as fits
+ * in the socket's send buffer. sendfile takes no flags and the socket may be
+ * blocking, so it is never asked for more than the kernel can take at once.
+ * @param msg the packet at the head of the queue
+ * @return the bytes written, 0 if the send buffer is full, or -1 if the connection failed
+ */
+int NetworkIO::sendFile(EncodedPacket *msg) {
+   uint32_t meminfo[SK_MEMINFO_VARS];
+   socklen_t mlen = sizeof(meminfo);
+   if (getsockopt(fd, SOL_SOCKET, SO_MEMINFO, meminfo, &mlen) == -1) {
+      return -1;
+   }
+   int64_t room = (int64_t)meminfo[SK_MEMINFO_SNDBUF] - meminfo[SK_MEMINFO_WMEM_QUEUED] - FLUSH_FILE_SLACK;
+   uint32_t want = msg->length() - outOffset;
+   if (room <= 0) {
+      return 0;
+   }
+   if (want > room) {
+      want = room;
+   }
+   if (want > FLUSH_FILE_CHUNK) {
+      want = FLUSH_FILE_CHUNK;
+   }
+   off_t off = msg->fileOffset() + outOffset;
+   ssize_t nbytes = sendfile(fd, msg->fileDescriptor(), &off, want);
+   sendCalls++;
+   if (nbytes < 0) {
+      return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+   }
+   if (nbytes == 0) {
+      //the file is shorter than the packet claims
+      return -1;
+   }
+   fileBytes += nbytes;
+   outBytes -= nbytes;
+   retire(nbytes);
+   return nbytes;
+}
+
+int NetworkIO::flushQueue() {
+   if (ring != NULL) {
+      if (fd == -1 || (state & _FILE_STATE_ERROR)) {
+         return -1;
+      }
+      //file packets are written here, memory ones through the ring
+      while (!sending && !outq.empty() && outq.front()->isFile()) {
+         EncodedPacket *head = outq.front();
+         uint32_t left = head->length() - outOffset;
+         int nbytes = sendFile(head);
+         if (nbytes < 0) {
+            state |= _FILE_STATE_ERROR;
+            return -1;
+         }
+         if ((uint32_t)nbytes < left) {
+            return (int)outBytes;
+         }
+      }
+      if (!sending && !outq.empty()) {
+         memset(sendHdr, 0, sizeof(*sendHdr));
+         for (deque<EncodedPacket*>::iterator i = outq.begin(); i != outq.end() && sendHdr->msg_iovlen < FLUSH_IOVECS && !(*i)->isFile(); i++) {
+            uint32_t skip = sendHdr->msg_iovlen == 0 ? outOffset : 0;
+            sendIov[sendHdr->msg_iovlen].iov_base = (char*)(*i)->data() + skip;
+            sendIov[sendHdr->msg_iovlen++].iov_len = (*i)->length() - skip;
+         }
+         sendHdr->msg_iov = sendIov;
+         if (!ring->sendmsg(fd, sendHdr, ringUser)) {
+            state |= _FILE_STATE_ERROR;
+            return -1;
+         }
+         sending = true;
+         sendCalls++;
+      }
+      return (int)outBytes;
+   }
+   if (state & _FILE_STATE_ERROR) {
+      return -1;
+   }
+   bool corked = false;
+   if (cork && outq.size() > FLUSH_IOVECS) {
+      int on = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+      sendCalls++;
+      corked = true;
+   }
+   int result = 0;
+   while (!outq.empty()) {
+      if (outq.front()->isFile()) {
+         EncodedPacket *head = outq.front();
+         uint32_t left = head->length() - outOffset;
+         int nbytes = sendFile(head);
+         if (nbytes < 0) {
+            state |= _FILE_STATE_ERROR;
+            result = -1;
+            break;
+         }
+         if ((uint32_t)nbytes < left) {
+            break;   //the socket buffer is full
+         }
+         continue;
+      }
+      struct iovec iov[FLUSH_IOVECS];
+      struct msghdr mh;
+      memset(&mh, 0, sizeof(mh));
+      size_t want = 0;
+      for (deque<EncodedPacket*>::iterator i = outq.begin(); i != outq.end() && mh.msg_iovlen < FLUSH_IOVECS && !(*i)->isFile(); i++) {
+         uint32_t skip = mh.msg_iovlen == 0 ? outOffset : 0;
+         iov[mh.msg_iovlen].iov_base = (char*)(*i)->data() + skip;
+         iov[mh.msg_iovlen].iov_len = (*i)->length() - skip;
+         want += iov[mh.msg_iovlen++].iov_len;
+      }
+      mh.msg_iov = iov;
+      ssize_t nbytes = sendmsg(fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+      sendCalls++;
+      if (nbytes < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+         }
+         state |= _FILE_STATE_ERROR;
+         result = -1;
+         break;
+      }
+      outBytes -= nbytes;
+      retire(nbytes);
+      if ((size_t)nbytes < want) {
+         break;   //the socket buffer is full
+      }
+   }
+   if (corked && result == 0) {
+      int off = 0;
+      setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+      sendCalls++;
+   }
+   return result < 0 ? result : (int)outBytes;
+}
+
+void NetworkIO::shutdown() {
+   if (fd != -1) {
+      ::shutdown(fd, SHUT_RDWR);
+   }
+}
+
 bool FileIO::write(const void *buf, uint32_t len) {
    return sendAll(buf, len) == len;
 }
@@ -555,8 +1283,9 @@ int NetworkIO::sendAll(const void *buf, unsigned int size) {
    unsigned int total = 0;
    const unsigned char *b = (const unsigned char *)buf;
    while (total < size) {
-      int nbytes = send(fd, b + total, size - total, 0);
-      if (nbytes == 0) return -1;
+      int nbytes = send(fd, b + total, size - total, MSG_NOSIGNAL);
+      if (nbytes < 0 && errno == EINTR) continue;
+      if (nbytes <= 0) return -1;
       total += nbytes;
    }
    return (int)total;
@@ -582,7 +1311,7 @@ int FileIO::sendFormat(const char *format, ...) {
  * SO_REUSEADDR is set on the socket.
  * returns the new server socket.
  */
-Tcp6Service::Tcp6Service(int port) {
+Tcp6Service::Tcp6Service(int port, int backlog, bool reusePort) {
    int server = socket(AF_INET6, SOCK_STREAM, 0);
    if (server == -1) {
 #ifdef DEBUG      
@@ -592,7 +1321,8 @@ Tcp6Service::Tcp6Service(int port) {
 #endif
    }
    int one = 1;
-   if (setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1) {
+   if (setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+       (reusePort && setsockopt(server, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1)) {
       close();
 #ifdef DEBUG      
       err(-1, ERROR_REUSE_SOCK);
@@ -614,7 +1344,7 @@ Tcp6Service::Tcp6Service(int port) {
       throw -1;
 #endif
    }
-   if (listen(server, 20) == -1) {
+   if (listen(server, backlog) == -1) {
       close();
       delete self;
 #ifdef DEBUG      
@@ -632,7 +1362,7 @@ Tcp6Service::Tcp6Service(int port) {
  * SO_REUSEADDR is set on the socket.
  * returns the new server socket.
  */
-Tcp6Service::Tcp6Service(const char *host, int port) {
+Tcp6Service::Tcp6Service(const char *host, int port, int backlog, bool reusePort) {
    char str_port[16];   
    struct addrinfo hints;
    addrinfo *addr, *ap;
@@ -659,7 +1389,8 @@ Tcp6Service::Tcp6Service(const char *host, int port) {
       if (fd == -1) {
          continue;
       }
-      if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1) {
+      if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+          (reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1)) {
          ::close(fd);
          continue;
       }      
@@ -667,7 +1398,7 @@ Tcp6Service::Tcp6Service(const char *host, int port) {
          ::close(fd);
          continue;
       }
-      if (listen(fd, 20) == -1) {
+      if (listen(fd, backlog) == -1) {
          ::close(fd);
          continue;
       }
@@ -690,11 +1421,23 @@ Tcp6Service::Tcp6Service(const char *host, int port) {
 }
 
 bool FileIO::close() {
-   return ::close(fd) == 0;
+   if (fd == -1) {
+      return false;
+   }
+   bool res = ::close(fd) == 0;
+   fd = -1;
+   return res;
 }
 
 FileIO::~FileIO() {
    close();
+   if (tok != NULL) {
+      json_tokener_free(tok);
+   }
+   if (zin != NULL) {
+      inflateEnd(zin);
+      delete zin;
+   }
 }
 
 NetworkService::~NetworkService() {
@@ -713,6 +1456,14 @@ Tcp6Service::~Tcp6Service() {
    delete self;
 }
 
+void Tcp6Service::setDeferAccept(int seconds) {
+   for (vector<int>::iterator i = fds.begin(); i != fds.end(); i++) {
+      if (setsockopt(*i, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)) == -1) {
+         perror("TCP_DEFER_ACCEPT");
+      }
+   }
+}
+
 NetworkIO *Tcp6Service::accept() {
    struct sockaddr_in6 peer;
    socklen_t peer_len = sizeof(peer);
@@ -811,6 +1562,12 @@ int fill_random(unsigned char *buf, unsigned int size) {
    }
 }
 
+uint64_t monotonic_ms() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 json_object *parseConf(const char *fname) {
    return json_object_from_file(fname);
 }
@@ -22,11 +22,14 @@
 #define __COLLAB_UTILS_H
 
 #include <stdint.h>
+#include <sys/types.h>
 #include <sys/select.h>
 #include <string>
 #include <vector>
 #include <map>
+#include <deque>
 #include <json-c/json.h>
+#include <zlib.h>
 
 using namespace std;
 
@@ -144,6 +147,11 @@ using namespace std;
 #define MSG_ERROR                    "collab_error"
 #define MSG_FATAL                    "collab_fatal"
 
+//sent by the server to a client that asked for "heartbeat" in its auth_request once
+//it has been quiet for a while, the client answers with a pong. Either side may ping.
+#define MSG_PING                     "ping"
+#define MSG_PONG                     "pong"
+
 
 #define default_pub 0x3fff
 #define default_sub 0x3fff
@@ -151,6 +159,12 @@ using namespace std;
 #define FULL_PERMISSIONS            0x7fffffff
 
 #define PROTOCOL_VERSION             4
+//the same messages as PROTOCOL_VERSION carried in binary frames, see frame.h
+#define PROTOCOL_FRAMED_VERSION      5
+
+//stream compression a client may ask for with "compress" in its auth_request
+#define COMPRESS_ZLIB                "zlib"
+#define COMPRESS_ZLIB_DICT           "zlib+dict"   //zlib primed with zlibDictionary
 
    //the above commands are grouped in order to provide
    //permissions based on these masks
@@ -188,6 +202,15 @@ using namespace std;
 
 #define MAX_COMMAND 2048
 
+//the most queued messages handed to the kernel by a single sendmsg
+#define FLUSH_IOVECS 64
+
+//the most bytes of a file packet handed to the kernel by a single sendfile
+#define FLUSH_FILE_CHUNK (256 * 1024)
+
+//send buffer space left unused by sendfile, for the kernel's own overhead
+#define FLUSH_FILE_SLACK 4096
+
 #define MD5_SIZE         16
 #define GPID_SIZE        32
 #define CHALLENGE_SIZE   32
@@ -223,7 +246,10 @@ const char * const FILE_SIG = "collabRE";
 
 struct sockaddr_in6;
 struct sockaddr_in;
+struct iovec;
+struct msghdr;
 class NetworkIO;
+class Uring;
 
 uint64_t htonll(uint64_t val);
 #define ntohll(x) htonll(x)
@@ -242,6 +268,10 @@ void logln(const string &msg, int verbosity = 0);
 extern const char *permStrings[];
 extern int permStringsLength;
 
+//the preset dictionary of COMPRESS_ZLIB_DICT, part of the protocol so it may never change
+extern const char zlibDictionary[];
+extern const uint32_t zlibDictionaryLength;
+
 class IOException {
 public:
    IOException(const string &msg = "");
@@ -282,12 +312,53 @@ public:
    int read_until_delim(char *buf, uint32_t size, char endchar);
    bool readLine(string &s);
    string readLine();
+   json_object *readJson();
    int sendMsg(const char *buf, bool nullflag = 0);
    int sendAll(const void *buf, uint32_t len);
    int sendFormat(const char *format, ...);
    int getFileDescriptor() {return fd;};
    bool close();
 
+   /**
+    * setLimits bounds the messages accepted by readJson, a message that exceeds
+    * either limit is discarded up to the end of its line
+    * @param maxMessage the largest message in bytes, 0 for no limit
+    * @param maxDepth the deepest nesting of json objects and arrays
+    */
+   void setLimits(uint32_t maxMessage, int maxDepth);
+
+   /**
+    * setFramed switches readJson from newline delimited json to binary frames
+    * (see frame.h). The rest of the line holding the last json message is skipped
+    * if it has not been read already.
+    */
+   void setFramed();
+
+   /**
+    * isFramed inspector to see whether this connection has switched to binary frames
+    * @return true once setFramed has been called
+    */
+   bool isFramed() {
+      return framed;
+   }
+
+   /**
+    * isCompressed inspector to see whether input is being inflated
+    * @return true once compression has been started
+    */
+   bool isCompressed() {
+      return zin != NULL;
+   }
+
+   /**
+    * bytesReceived inspector to get the number of bytes read so far
+    * @param wire true for the bytes read off the wire, false for the bytes after inflating them
+    * @return the byte count
+    */
+   uint64_t bytesReceived(bool wire) {
+      return wire ? wireIn : dataIn;
+   }
+
    bool write(const void *buf, uint32_t len);
 
    //output the string with no null terminator
@@ -296,20 +367,200 @@ public:
 private:
    int fillbuf();
    uint32_t get_avail(void *buf, uint32_t size);
+   void reject(const char *why);
+   bool nextFrame(json_object **obj);
 
 protected:
+   /**
+    * receive reads more input into buf, inflating it if the connection is compressed
+    * @param wait false to return at once if no input is available
+    * @return the number of bytes now in buf, 0 at end of file, -1 on error,
+    *         or -2 if nothing could be read without waiting
+    */
+   int receive(bool wait);
+
+   /**
+    * startInflate inflates all input from here on. Any input already in buf
+    * that has not been parsed is taken to be compressed, apart from the rest
+    * of the line holding the last json message.
+    */
+   void startInflate();
+
+   /**
+    * inflatePending checks whether inflate may have more input to hand out
+    * without reading from the connection
+    */
+   bool inflatePending() {
+      return zin != NULL && (zin->avail_in > 0 || zpending);
+   }
+
+   /**
+    * nextJson feeds buf to this connection's tokener until a message is complete.
+    * A message may span any number of reads but not a newline, a message that is
+    * malformed or exceeds the limits is dropped and parsing resumes after the
+    * next newline. Once the connection is framed messages are decoded from
+    * frames instead.
+    * @param obj receives the parsed message, NULL if the connection is unusable
+    * @return true if a message was parsed, false if buf ran out first
+    */
+   bool nextJson(json_object **obj);
+
    int fd;
    int state;
    int curr;
    int max;
    unsigned char buf[4096];
+
+   json_tokener *tok;   //holds a partial message between reads
+   uint32_t msgBytes;   //bytes of the current message fed to tok so far
+   bool discarding;     //skipping the rest of a rejected message's line
+   bool lineOpen;       //the newline ending the last message has not been read
+   uint32_t maxMessage;
+   int maxDepth;
+
+   bool framed;         //messages are binary frames rather than lines of json
+   string partial;      //a frame that has not been completely received
+   uint64_t frameLen;   //the length of the current frame, 0 until it is known
+   uint32_t skip;       //bytes left of a rejected frame
+
+   z_stream *zin;       //NULL unless input is compressed
+   unsigned char zraw[4096];   //compressed input, inflated into buf
+   bool zpending;       //the last inflate filled buf and may have more output
+   bool zskipLine;      //the rest of a json line precedes the compressed input
+   uint64_t wireIn;     //bytes read from fd
+   uint64_t dataIn;     //bytes read from fd after inflating them
+
+   const unsigned char *fed;   //input received on our behalf, read in place of fd while set
+   uint32_t fedLen;
+};
+
+/**
+ * EncodedPacket is the immutable, reference counted wire image of a single
+ * message, including its trailing newline. It is built once and the same
+ * buffer may then be queued to any number of connections. A packet may
+ * instead refer to a run of images stored in a file (see update_log.h).
+ */
+class EncodedPacket {
+public:
+   /**
+    * @param json a serialized json object
+    * @param len the length of json
+    */
+   EncodedPacket(const char *json, uint32_t len);
+
+   /**
+    * builds the wire image of an update by splicing its updateid onto the
+    * end of an already serialized json object, so it need not be re-serialized
+    * @param json a serialized json object that does not contain an updateid
+    * @param len the length of json
+    * @param updateid the updateid to append
+    */
+   EncodedPacket(const char *json, uint32_t len, uint64_t updateid);
+
+   /**
+    * fromJson serializes obj into a new EncodedPacket, obj is not released
+    * @param obj the object to encode
+    * @return a new packet holding a single reference
+    */
+   static EncodedPacket *fromJson(json_object *obj);
+
+   /**
+    * fromFrame encodes obj as a binary frame (see frame.h), obj is not released
+    * @param obj the object to encode
+    * @param updateid if non-zero, the updateid to send with obj
+    * @return a new packet holding a single reference
+    */
+   static EncodedPacket *fromFrame(json_object *obj, uint64_t updateid = 0);
+
+   /**
+    * ack builds the ack_updateid that returns an update's id to its
+    * originator by splicing the updateid into a prebuilt template, without
+    * making a json object
+    * @param updateid the id of the update
+    * @param framed true for a binary frame, false for json
+    * @return a new packet holding a single reference
+    */
+   static EncodedPacket *ack(uint64_t updateid, bool framed);
+
+   /**
+    * ref adds a reference to this packet
+    * @return this packet
+    */
+   EncodedPacket *ref() {
+      __sync_add_and_fetch(&refs, 1);
+      return this;
+   }
+
+   /**
+    * release drops a reference, deleting the packet when none remain
+    */
+   void release() {
+      if (__sync_sub_and_fetch(&refs, 1) == 0) {
+         delete this;
+      }
+   }
+
+   const char *data() {
+      return buf;
+   }
+
+   uint32_t length() {
+      return len;
+   }
+
+   /**
+    * @param bytes a complete wire image, sent as is
+    */
+   EncodedPacket(const string &bytes);
+
+   /**
+    * refers to wire images already stored in a file rather than holding
+    * them in memory, so that they can be sent without being copied through
+    * user space (see NetworkIO::flushQueue)
+    * @param fd the file holding the images, the packet takes over the descriptor
+    * @param offset where the images start in fd
+    * @param len the length of the images
+    */
+   EncodedPacket(int fd, off_t offset, uint32_t len);
+
+   /**
+    * isFile inspector to see whether this packet refers to a file
+    * @return true if data is NULL and the image must be read from fileDescriptor
+    */
+   bool isFile() {
+      return file != -1;
+   }
+
+   int fileDescriptor() {
+      return file;
+   }
+
+   off_t fileOffset() {
+      return offset;
+   }
+
+   /**
+    * load reads the image a file packet refers to into memory
+    * @return a new packet holding a single reference, or NULL if the file could not be read
+    */
+   EncodedPacket *load();
+
+private:
+   ~EncodedPacket();
+
+   char *buf;
+   uint32_t len;
+   volatile int refs;
+   int file;        //-1 unless the image is in a file
+   off_t offset;
 };
 
 class NetworkIO : public FileIO {
 public:
-   NetworkIO() {};
+   NetworkIO() : outOffset(0), outBytes(0), zout(NULL), wireOut(0), dataOut(0), cork(false), fileSends(0), fileBytes(0), sendCalls(0), sentMessages(0),
+                 ring(NULL), ringUser(0), sending(false), sendIov(NULL), sendHdr(NULL) {};
    NetworkIO(const char *host, int port);
-   virtual ~NetworkIO() {};
+   virtual ~NetworkIO();
 //   int readAll(void *buf, uint32_t size);
 //   int read_until_delim(char *buf, uint32_t size, char endchar);
 //   bool readLine(string &s);
@@ -317,6 +568,173 @@ public:
    int sendAll(const void *buf, uint32_t len);
    int getPeerPort();
    string getPeerAddr();   
+
+   /**
+    * readJsonAvailable performs a single non-blocking receive and parses every
+    * complete line that is now available. Partial lines are kept for the next call.
+    * @param objs receives the parsed objects, which the caller must release
+    * @return false once the peer has closed the connection or sent garbage
+    */
+   bool readJsonAvailable(vector<json_object*> &objs);
+
+   /**
+    * readJsonFrom parses input that has already been received from this
+    * connection's socket, as readJsonAvailable does for input it reads itself
+    * @param data the received bytes, which are not retained
+    * @param len the number of bytes received
+    * @param objs receives the parsed objects, which the caller must release
+    * @return false if the peer sent garbage
+    */
+   bool readJsonFrom(const void *data, uint32_t len, vector<json_object*> &objs);
+
+   /**
+    * queueSend appends a complete message to this connection's outbound queue.
+    * Nothing is written until flushQueue is called. The outbound queue is
+    * not synchronized, callers must serialize access to it.
+    * @param msg the message, the queue takes over the caller's reference to it
+    */
+   void queueSend(EncodedPacket *msg);
+
+   /**
+    * flushQueue writes as much of the outbound queue as the socket will
+    * accept without blocking, gathering up to FLUSH_IOVECS messages into
+    * each call to sendmsg. Once sends go through a ring only one sendmsg is
+    * queued at a time, and the rest is written after sendComplete. File
+    * packets are written with sendfile, straight from the page cache.
+    * @return the number of bytes still queued, or -1 if the connection failed
+    */
+   int flushQueue();
+
+   /**
+    * sendVia makes flushQueue queue its sends on an io_uring instead of
+    * writing to the socket itself. The outbound queue is not synchronized,
+    * callers must serialize access to it.
+    * @param ring the ring to queue sends on
+    * @param user identifies this connection's sends in the ring's completions
+    */
+   void sendVia(Uring *ring, uint64_t user);
+
+   /**
+    * sendComplete retires whatever the send queued on the ring wrote
+    * @param res the result of the send, bytes written or a negated errno
+    * @return false if the connection failed
+    */
+   bool sendComplete(int res);
+
+   /**
+    * isSending inspector to see whether a send queued on the ring is outstanding
+    * @return true until the send's completion has been handed to sendComplete
+    */
+   bool isSending() {
+      return sending;
+   }
+
+   /**
+    * queuedBytes inspector to get the number of bytes waiting to be sent
+    * @return the outbound queue depth in bytes
+    */
+   uint32_t queuedBytes() {
+      return outBytes;
+   }
+
+   /**
+    * queuedMessages inspector to get the number of messages waiting to be sent
+    * @return the outbound queue depth in messages
+    */
+   uint32_t queuedMessages() {
+      return outq.size();
+   }
+
+   /**
+    * startCompression deflates everything queued and inflates everything
+    * received from here on, flushing the deflate stream at the end of each
+    * message so that it can be acted on as soon as it arrives. The outbound
+    * queue is not synchronized, callers must serialize access to it.
+    * @param level the zlib compression level
+    * @param dictionary true to prime both directions with zlibDictionary
+    */
+   void startCompression(int level, bool dictionary);
+
+   /**
+    * bytesSent inspector to get the number of bytes queued so far
+    * @param wire true for the bytes queued to the wire, false for the bytes before deflating them
+    * @return the byte count
+    */
+   uint64_t bytesSent(bool wire) {
+      return wire ? wireOut : dataOut;
+   }
+
+   /**
+    * setTcpOptions configures how the socket hands queued messages to TCP
+    * @param nodelay true to disable Nagle's algorithm
+    * @param cork true to hold back partial segments while a flush takes more than one sendmsg
+    */
+   void setTcpOptions(bool nodelay, bool cork);
+
+   /**
+    * setKeepAlive enables TCP keepalive probes, so that a peer that has vanished
+    * is noticed even while nothing is being sent to it. Unacknowledged data is
+    * given up on after the same interval and count.
+    * @param idle seconds of silence before the first probe, 0 to leave keepalive off
+    * @param interval seconds between probes
+    * @param count unanswered probes before the connection is dropped
+    */
+   void setKeepAlive(int idle, int interval, int count);
+
+   /**
+    * sendSyscalls inspector to get the number of system calls made writing the outbound queue,
+    * each send queued on a ring is counted as one
+    * @return the system call count
+    */
+   uint64_t sendSyscalls() {
+      return sendCalls;
+   }
+
+   /**
+    * messagesSent inspector to get the number of messages completely written
+    * @return the message count
+    */
+   uint64_t messagesSent() {
+      return sentMessages;
+   }
+
+   /**
+    * shutdown disables further sends and receives on the socket, waking
+    * any thread blocked reading from it, without releasing the descriptor
+    */
+   void shutdown();
+
+   /**
+    * fileBytesSent inspector to get the number of bytes sent straight from a file
+    * @return the byte count
+    */
+   uint64_t fileBytesSent() {
+      return fileBytes;
+   }
+
+private:
+   void retire(size_t nbytes);
+   int sendFile(EncodedPacket *msg);
+
+   deque<EncodedPacket*> outq;   //messages waiting to be written
+   uint32_t outOffset;   //bytes of outq.front() already written
+   uint32_t outBytes;    //total unwritten bytes in outq
+
+   z_stream *zout;       //NULL unless output is compressed
+   uint64_t wireOut;     //bytes queued after deflating them
+   uint64_t dataOut;     //bytes queued before deflating them
+
+   bool cork;            //TCP_CORK the socket during multi-call flushes
+   int fileSends;        //1 if file packets can be sent with sendfile, -1 if not, 0 until known
+   uint64_t fileBytes;   //bytes written by sendfile
+   uint64_t sendCalls;   //sendmsg and setsockopt calls made by flushQueue
+   uint64_t sentMessages;
+
+   Uring *ring;          //NULL unless sends are queued on a ring
+   uint64_t ringUser;
+   bool sending;         //a send is outstanding on ring
+   struct iovec *sendIov;     //the outstanding send, which the kernel reads until it completes
+   struct msghdr *sendHdr;
 };
 
 class NetworkService {
@@ -330,12 +748,27 @@ protected:
    int nfds;
 };
 
+#define DEFAULT_LISTEN_BACKLOG 20
+
 class Tcp6Service : public NetworkService {
 public:
-   Tcp6Service(int port);
-   Tcp6Service(const char *host, int port);
+   /**
+    * @param port the port to listen on
+    * @param backlog the length of the queue of connections waiting to be accepted
+    * @param reusePort true to set SO_REUSEPORT, so that several services may listen
+    *        on the same port with the kernel spreading connections among them
+    */
+   Tcp6Service(int port, int backlog = DEFAULT_LISTEN_BACKLOG, bool reusePort = false);
+   Tcp6Service(const char *host, int port, int backlog = DEFAULT_LISTEN_BACKLOG, bool reusePort = false);
    virtual ~Tcp6Service();
     NetworkIO *accept();
+
+   /**
+    * setDeferAccept sets TCP_DEFER_ACCEPT, so that a connection is only
+    * accepted once the client has sent data or the timeout has passed
+    * @param seconds the timeout, 0 to accept connections as soon as they are established
+    */
+   void setDeferAccept(int seconds);
 private:
    sockaddr_in6 *self;
 };
@@ -361,6 +794,12 @@ public:
 
 int fill_random(unsigned char *buf, uint32_t size);
 
+/**
+ * monotonic_ms reads a clock that is unaffected by changes to the time of day
+ * @return milliseconds since an arbitrary starting point
+ */
+uint64_t monotonic_ms();
+
 json_object *parseConf(const char *conf);
 short getShortOption(json_object *conf, const string &opt, short defaultValue);
 int getIntOption(json_object *conf, const string &opt, int defaultValue);